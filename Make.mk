@@ -25,6 +25,8 @@ OBJS := $(NUVOSDK)/Device/Nuvoton/M451Series/Source/system_M451Series.o \
 	$(NUVOSDK)/StdDriver/src/usbd.o \
 	$(NUVOSDK)/StdDriver/src/eadc.o \
 	$(NUVOSDK)/StdDriver/src/pwm.o \
+	$(NUVOSDK)/StdDriver/src/crc.o \
+	$(NUVOSDK)/StdDriver/src/pdma.o \
 	src/startup/initfini.o \
 	src/startup/sbrk.o \
 	src/startup/init.o \
@@ -35,6 +37,16 @@ OBJS := $(NUVOSDK)/Device/Nuvoton/M451Series/Source/system_M451Series.o \
 	src/display/Display.o \
 	src/font/Font_DejaVuSansMono_8pt.o \
 	src/timer/TimerUtils.o \
+	src/timer/TimerWheel.o \
+	src/deferred/Deferred.o \
+	src/event/Event.o \
+	src/idle/Idle.o \
+	src/gpioint/GPIOInt.o \
+	src/kvstore/KVStore.o \
+	src/settings/Settings.o \
+	src/pufflog/PuffLog.o \
+	src/blackbox/BlackBox.o \
+	src/checksum/Checksum.o \
 	src/button/Button.o \
 	src/usb/USB_VirtualCOM.o \
 	src/adc/ADC.o \
@@ -26,29 +26,41 @@
 #include <Font.h>
 #include <Atomizer.h>
 #include <Button.h>
-#include <TimerUtils.h>
+#include <TimerWheel.h>
 #include <Battery.h>
 #include <Globals.h>
 
 #define TC_TMRFLAG_PID (1 << 1)
+
+// Left + right gesture flags
+#define TC_COMBO_HOLD (1 << 0)
+#define TC_COMBO_LONGHOLD (1 << 1)
 #define TC_TIMER_PID_RESET() do { __set_PRIMASK(1); \
-	TC_timerCountPID = 0; \
 	TC_timerFlag &= ~TC_TMRFLAG_PID; \
 	__set_PRIMASK(0); } while(0)
 
-
 /**
- * TC regulation timer. Each tick is 40us.
- * Counts up to 26 (1ms) and stops.
+ * TC regulation period, in ms.
  * used to collect errors for PID 
  */
-static volatile uint8_t TC_timerCountPID;
+#define TC_TIMER_PID_PERIOD 2
 
 /**
  * Bitwise combination of TC_TMRFLAG_*.
  */
 static volatile uint8_t TC_timerFlag;
 
+/**
+ * Plus/minus steps requested by the right/left keys
+ * since the last main loop iteration.
+ */
+static volatile int16_t TC_stepCount;
+
+/**
+ * Bitwise combination of TC_COMBO_*.
+ */
+static volatile uint8_t TC_comboFlag;
+
 
 
 
@@ -67,11 +79,39 @@ static const uint16_t Atomizer_TempTable[9] = {
 
 
 static void TC_timer_PID(uint32_t unused) {
-	if(TC_timerCountPID != 51) {
-		TC_timerCountPID++;
+	TC_timerFlag |= TC_TMRFLAG_PID;
+}
+
+static void TC_gesture(uint8_t mask, Button_Gesture_t gesture, uint8_t count) {
+	int16_t steps;
+
+	if(mask == (BUTTON_MASK_LEFT | BUTTON_MASK_RIGHT)) {
+		if(gesture == BUTTON_GESTURE_HOLD) {
+			TC_comboFlag |= TC_COMBO_HOLD;
+		}
+		else if(gesture == BUTTON_GESTURE_LONGHOLD) {
+			TC_comboFlag |= TC_COMBO_LONGHOLD;
+		}
+		return;
+	}
+
+	switch(gesture) {
+		case BUTTON_GESTURE_CLICK:
+			steps = count;
+			break;
+		case BUTTON_GESTURE_HOLD:
+		case BUTTON_GESTURE_REPEAT:
+			steps = 1;
+			break;
+		default:
+			return;
+	}
+
+	if(mask == BUTTON_MASK_RIGHT) {
+		TC_stepCount += steps;
 	}
-	else {
-		TC_timerFlag |= TC_TMRFLAG_PID;
+	else if(mask == BUTTON_MASK_LEFT) {
+		TC_stepCount -= steps;
 	}
 }
 
@@ -132,16 +172,21 @@ int main() {
 	uint16_t volts, newVolts, battVolts, displayVolts, atoTemp, tempTC;
   int16_t errTemp, lastErrTemp, sumErrTemp;
   int cons;
+	int16_t steps;
+	uint8_t combo;
 	uint32_t watts, wattsDef;
 	uint16_t atoResDef;//, atoRes;
 	uint8_t btnState, battPerc, boardTemp, mode;
 	Atomizer_Info_t atomInfo;
 
-	if (Timer_CreateTimer(25000, 1, TC_timer_PID, 0) < 0) {
+	if (TimerWheel_CreateTimer(TC_TIMER_PID_PERIOD, 1, TC_timer_PID, 0) < 0) {
     return 1;
   }
 
 
+	// Keys are handled through gestures, so the main loop never blocks
+	Button_SetGestureCallback(TC_gesture);
+
   //just in case
 	Atomizer_Control(0);
 	Atomizer_ReadInfo(&atomInfo);
@@ -179,78 +224,69 @@ int main() {
 			watts = wattsDef;//return to watts setting by user
 		}
 
+		// Collect gestures
+		__set_PRIMASK(1);
+		steps = TC_stepCount;
+		TC_stepCount = 0;
+		combo = TC_comboFlag;
+		TC_comboFlag = 0;
+		__set_PRIMASK(0);
+
 		// Handle plus/minus keys : not allowed while firing
-		if((btnState & BUTTON_MASK_RIGHT) && !(btnState & BUTTON_MASK_LEFT) && !Atomizer_IsOn()) {
-			if (mode==1) {
-        newVolts = wattsToVolts(watts + 100, atomInfo.resistance);
-        if (newVolts > 0) {
-          //don't allow over spec
-    			if(newVolts <= ATOMIZER_MAX_VOLTS && watts < ATOMIZER_MAX_WATT && (watts/newVolts < ATOMIZER_MAX_CURRENT/1000)) {
-    				watts += 100;
-    				volts = newVolts;
-    
-    				// Set voltage
-    				Atomizer_SetOutputVoltage(volts);
-    			}
-    			wattsDef = watts;	
-        }
-        // Slow down increment
-			 Timer_DelayMs(25);
-      } else {
-        if (tempTC < 315) {
-          tempTC += 5;
-        }
-        // Slow down increment
-			 Timer_DelayMs(100);
-      }
-			
- 		}
+		// Repeats speed up while the key is held
+		if(!Atomizer_IsOn()) {
+			for(; steps > 0; steps--) {
+				if (mode==1) {
+					newVolts = wattsToVolts(watts + 100, atomInfo.resistance);
+					if (newVolts > 0) {
+						//don't allow over spec
+						if(newVolts <= ATOMIZER_MAX_VOLTS && watts < ATOMIZER_MAX_WATT && (watts/newVolts < ATOMIZER_MAX_CURRENT/1000)) {
+							watts += 100;
+							volts = newVolts;
+
+							// Set voltage
+							Atomizer_SetOutputVoltage(volts);
+						}
+						wattsDef = watts;
+					}
+				} else if (tempTC < 315) {
+					tempTC += 5;
+				}
+			}
 
-		if((btnState & BUTTON_MASK_LEFT) && !(btnState & BUTTON_MASK_RIGHT) && watts >= 100 && !Atomizer_IsOn()) {
-			if (mode == 1) {
-        watts -= 100;
-  			volts = wattsToVolts(watts, atomInfo.resistance);
-  
-  			// Set voltage
-  			Atomizer_SetOutputVoltage(volts);
-  			wattsDef = watts;
-        // Slow down decrement
-  			Timer_DelayMs(25);
-      } else {
-        if (tempTC > 100) {
-          tempTC -= 5;
-        }      
-        // Slow down decrement
-			 Timer_DelayMs(100);      
-      }
-			
-		}
+			for(; steps < 0; steps++) {
+				if (mode == 1) {
+					if (watts >= 100) {
+						watts -= 100;
+						volts = wattsToVolts(watts, atomInfo.resistance);
+
+						// Set voltage
+						Atomizer_SetOutputVoltage(volts);
+						wattsDef = watts;
+					}
+				} else if (tempTC > 100) {
+					tempTC -= 5;
+				}
+			}
 
-		if(!Atomizer_IsOn() && (btnState & BUTTON_MASK_RIGHT) && (btnState & BUTTON_MASK_LEFT)) {
-			//we authorize reset of resistance with left and right
-      //reset if not 0
-      if (atoResDef != 0) {
-        atoResDef = 0;
-        //switch to power if button still pressed after 1s
-        Timer_DelayMs(1000);
-        btnState = Button_GetState();
-        if (!Atomizer_IsOn() && (btnState & BUTTON_MASK_RIGHT) && (btnState & BUTTON_MASK_LEFT)) {
-          mode = 1;
-        } 
-      } else { 
-  			Atomizer_ReadInfo(&atomInfo);
-        //tcRes is just to show a live resistance, baseRes is used here
-        atoResDef = atomInfo.resistance;
-        //switch to power if button still pressed after 1s
-        Timer_DelayMs(1000);
-        btnState = Button_GetState();
-        if (!Atomizer_IsOn() && (btnState & BUTTON_MASK_RIGHT) && (btnState & BUTTON_MASK_LEFT)) {
-          mode = 2;
-        } 
-      }
-      
-		}
+			if (combo & TC_COMBO_HOLD) {
+				//we authorize reset of resistance with left and right
+				//reset if not 0
+				if (atoResDef != 0) {
+					atoResDef = 0;
+				} else {
+					Atomizer_ReadInfo(&atomInfo);
+					//tcRes is just to show a live resistance, baseRes is used here
+					atoResDef = atomInfo.resistance;
+				}
+			}
 
+			if (combo & TC_COMBO_LONGHOLD) {
+				//still pressed after 1s: switch to TC if a resistance
+				//has just been set, to power otherwise
+				mode = atoResDef != 0 ? 2 : 1;
+			}
+		}
 
 		// Update info
 		// If resistance is zero voltage will be zero
@@ -27,8 +27,15 @@
 #include <Button.h>
 #include <TimerUtils.h>
 #include <Battery.h>
+#include <Settings.h>
+#include <BlackBox.h>
 #include <Globals.h>
 
+/**
+ * Settings key for the power setting.
+ */
+#define KEY_WATTS 0
+
 uint16_t wattsToVolts(uint32_t watts, uint16_t res) {
 	// Units: mV, mW, mOhm
 	// V = sqrt(P * R)
@@ -40,7 +47,7 @@ uint16_t wattsToVolts(uint32_t watts, uint16_t res) {
 int main() {
 	char buf[100];
 	const char *atomState;
-	uint16_t volts, newVolts, battVolts, displayVolts;
+	uint16_t volts, newVolts, displayVolts;
 	uint32_t watts;
 	uint8_t btnState, battPerc, boardTemp;
 	Atomizer_Info_t atomInfo;
@@ -48,26 +55,22 @@ int main() {
 	// Initialize atomizer info
 	Atomizer_ReadInfo(&atomInfo);
 
-	// Let's start with 10.0W as the initial value
+	// Restore the last power setting, or start with 10.0W
 	// We keep watts as mW
 	watts = 10000;
+	BlackBox_Init();
+	Settings_Init(KVSTORE_DEFAULT_PAGE_COUNT);
+	Settings_Register(KEY_WATTS, &watts, sizeof(watts));
 	volts = wattsToVolts(watts, atomInfo.resistance);
 	Atomizer_SetOutputVoltage(volts);
 
+	// Let the fire button interrupt power the atomizer on and off,
+	// so that firing doesn't wait for the display update below
+	Atomizer_SetFireOnButton(1);
+
 	while(1) {
 		btnState = Button_GetState();
 
-		// Handle fire button
-		if(!Atomizer_IsOn() && (btnState & BUTTON_MASK_FIRE) &&
-			atomInfo.resistance != 0 && Atomizer_GetError() == OK) {
-			// Power on
-			Atomizer_Control(1);
-		}
-		else if(Atomizer_IsOn() && !(btnState & BUTTON_MASK_FIRE)) {
-			// Power off
-			Atomizer_Control(0);
-		}
-
 		// Handle plus/minus keys
 		if(btnState & BUTTON_MASK_RIGHT) {
 			newVolts = wattsToVolts(watts + 100, atomInfo.resistance);
@@ -75,6 +78,8 @@ int main() {
 			if(newVolts <= ATOMIZER_MAX_VOLTS) {
 				watts += 100;
 				volts = newVolts;
+				// Saved once the buttons are left alone
+				Settings_Changed(KEY_WATTS);
 
 				// Set voltage
 				Atomizer_SetOutputVoltage(volts);
@@ -85,6 +90,7 @@ int main() {
 		if(btnState & BUTTON_MASK_LEFT && watts >= 100) {
 			watts -= 100;
 			volts = wattsToVolts(watts, atomInfo.resistance);
+			Settings_Changed(KEY_WATTS);
 
 			// Set voltage
 			Atomizer_SetOutputVoltage(volts);
@@ -121,9 +127,8 @@ int main() {
 			Atomizer_SetOutputVoltage(volts);
 		}
 
-		// Get battery voltage and charge
-		battVolts = Battery_IsPresent() ? Battery_GetVoltage() : 0;
-		battPerc = Battery_VoltageToPercent(battVolts);
+		// Get battery charge
+		battPerc = Battery_IsPresent() ? Battery_GetStateOfCharge() : 0;
 
 		// Get board temperature
 		boardTemp = Atomizer_ReadBoardTemp();
@@ -138,7 +143,13 @@ int main() {
 				atomState = "NO ATOM";
 				break;
 			default:
-				atomState = Atomizer_IsOn() ? "FIRING" : "";
+				if(!Atomizer_IsOn()) {
+					atomState = "";
+				}
+				else {
+					// Output is scaled down near the battery and temperature limits
+					atomState = atomInfo.derateReason == DERATE_NONE ? "FIRING" : "THROTTLED";
+				}
 				break;
 		}
 		siprintf(buf, "P:%3lu.%luW\nV:%2d.%02dV\nR:%2d.%02do\nI:%2d.%02dA\nT:%5dC\n%s\n\nBattery:\n%d%%\n%s",
@@ -22,24 +22,43 @@
 #include <Display.h>
 #include <Font.h>
 #include <TimerUtils.h>
+#include <TimerWheel.h>
 #include <Battery.h>
+#include <Event.h>
+
+/**
+ * User event posted every second to refresh the voltage.
+ */
+#define EVENT_REFRESH EVENT_USER
+
+void refreshCallback(uint32_t unused) {
+	Event_Post(EVENT_REFRESH, 0);
+}
 
 int main() {
 	char buf[100];
-	uint16_t battVolt;
+	Battery_VoltageInfo_t voltInfo;
+	uint32_t battEnergy;
 	uint8_t battPerc;
+	Event_t event;
+
+	// Wake up on battery insertion/removal, and every second
+	Event_SetMask(EVENT_MASK(EVENT_BATTERY_PRESENCE));
+	TimerWheel_CreateTimer(1000, 1, refreshCallback, 0);
 
 	while(1) {
 		// Check if the battery is present
 		if(Battery_IsPresent()) {
-			// Read voltage
-			battVolt = Battery_GetVoltage();
-			// Calculate percent
-			battPerc = Battery_VoltageToPercent(battVolt);
+			// Read voltage, smoothed for display
+			Battery_GetVoltageInfo(&voltInfo);
+			// Get estimated charge and energy
+			battPerc = Battery_GetStateOfCharge();
+			battEnergy = Battery_GetRemainingEnergy();
 
-			siprintf(buf, "Voltage:\n%d.%03d V\nCharge:\n%d%%\n%s",
-				battVolt / 1000, battVolt % 1000,
+			siprintf(buf, "Voltage:\n%d.%03d V\nCharge:\n%d%%\nEnergy:\n%lu mWh\n%s",
+				voltInfo.slow / 1000, voltInfo.slow % 1000,
 				battPerc,
+				battEnergy,
 				Battery_IsCharging() ? "CHARGING" : "");
 		}
 		else {
@@ -51,7 +70,7 @@ int main() {
 		Display_PutText(0, 0, buf, FONT_DEJAVU_8PT);
 		Display_Update();
 
-		// Update every second
-		Timer_DelayMs(1000);
+		// Sleep until something changes
+		Event_Wait(&event);
 	}
 }
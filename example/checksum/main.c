@@ -0,0 +1,103 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <stdio.h>
+#include <M451Series.h>
+#include <Display.h>
+#include <Font.h>
+#include <TimerUtils.h>
+#include <Checksum.h>
+
+/**
+ * Benchmark buffer size, in bytes.
+ */
+#define BENCH_SIZE 4096
+
+/**
+ * Benchmark rounds per method.
+ */
+#define BENCH_ROUNDS 16
+
+/**
+ * Feed methods.
+ */
+#define BENCH_SOFTWARE 0
+#define BENCH_HARDWARE 1
+#define BENCH_PDMA     2
+
+uint8_t benchBuf[BENCH_SIZE];
+
+/**
+ * Runs CRC-32 over the benchmark buffer.
+ *
+ * @param method One of BENCH_*.
+ * @param crc    Filled with the resulting checksum.
+ *
+ * @return Throughput, in KB/s.
+ */
+uint32_t bench(uint8_t method, uint32_t *crc) {
+	Checksum_Context_t ctx;
+	uint64_t start;
+	uint32_t elapsed;
+	uint8_t i;
+
+	start = Timer_GetMicros();
+	for(i = 0; i < BENCH_ROUNDS; i++) {
+		Checksum_Begin(&ctx, CHECKSUM_CRC32);
+		switch(method) {
+			case BENCH_SOFTWARE:
+				Checksum_UpdateSoftware(&ctx, benchBuf, BENCH_SIZE);
+				break;
+			case BENCH_HARDWARE:
+				Checksum_Update(&ctx, benchBuf, BENCH_SIZE);
+				break;
+			case BENCH_PDMA:
+				Checksum_UpdateAsync(&ctx, benchBuf, BENCH_SIZE);
+				break;
+		}
+		*crc = Checksum_End(&ctx);
+	}
+	elapsed = Timer_GetMicros() - start;
+
+	// Bytes per us is MB/s, times 1000 for KB/s
+	return elapsed == 0 ? 0 : (uint64_t) BENCH_SIZE * BENCH_ROUNDS * 1000 / elapsed;
+}
+
+int main() {
+	char buf[100];
+	uint32_t i, swSpeed, hwSpeed, dmaSpeed, swCrc, hwCrc, dmaCrc, check;
+
+	for(i = 0; i < BENCH_SIZE; i++) {
+		benchBuf[i] = i * 7 + (i >> 8);
+	}
+
+	// Known answer test for the hardware path
+	check = Checksum_Compute(CHECKSUM_CRC32, "123456789", 9);
+
+	swSpeed = bench(BENCH_SOFTWARE, &swCrc);
+	hwSpeed = bench(BENCH_HARDWARE, &hwCrc);
+	dmaSpeed = bench(BENCH_PDMA, &dmaCrc);
+
+	siprintf(buf, "CRC-32 KB/s\nSW: %lu\nHW: %lu\nDMA: %lu\nMatch: %s\nCheck: %s",
+		swSpeed, hwSpeed, dmaSpeed,
+		swCrc == hwCrc && swCrc == dmaCrc ? "yes" : "NO",
+		check == 0xCBF43926 ? "ok" : "BAD");
+	Display_PutText(0, 0, buf, FONT_DEJAVU_8PT);
+	Display_Update();
+}
@@ -0,0 +1,7 @@
+MODTYPE = evicvtcmini
+TARGET := $(TARGET)
+
+OBJS := $(OBJS)
+
+
+include $(EVICSDK)/make/Base.mk
@@ -0,0 +1,6 @@
+MODTYPE = presatc75w
+TARGET := $(TARGET)
+
+OBJS := $(OBJS)
+
+include $(EVICSDK)/make/Base.mk
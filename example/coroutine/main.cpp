@@ -0,0 +1,78 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <stdio.h>
+#include <M451Series.h>
+#include <Display.h>
+#include <Font.h>
+#include <Coroutine.hpp>
+
+// State shared between tasks.
+// Tasks all run from the main loop, so no volatile is needed.
+static uint32_t seconds, clicks;
+static uint16_t battAdc;
+
+// Counts seconds
+static Coroutine::Task secondsTask() {
+	while(1) {
+		co_await Coroutine::Sleep(1000);
+		seconds++;
+	}
+}
+
+// Counts fire button clicks
+static Coroutine::Task clickTask() {
+	while(1) {
+		co_await Coroutine::WaitButtons(BUTTON_MASK_FIRE, BUTTON_MASK_FIRE);
+		co_await Coroutine::WaitButtons(BUTTON_MASK_FIRE, 0);
+		clicks++;
+	}
+}
+
+// Samples the battery voltage ADC
+static Coroutine::Task batteryTask() {
+	while(1) {
+		battAdc = co_await Coroutine::WaitAdc(ADC_MODULE_VBAT);
+		co_await Coroutine::Sleep(500);
+	}
+}
+
+// Refreshes the display
+static Coroutine::Task displayTask() {
+	char buf[64];
+
+	while(1) {
+		siprintf(buf, "Uptime:\n%lus\nClicks:\n%lu\nVBAT ADC:\n%u",
+			seconds, clicks, battAdc);
+		Display_Clear();
+		Display_PutText(0, 0, buf, FONT_DEJAVU_8PT);
+		Display_Update();
+		co_await Coroutine::Sleep(100);
+	}
+}
+
+int main() {
+	// All tasks run concurrently, none of them blocks the others
+	Coroutine::Spawn(secondsTask());
+	Coroutine::Spawn(clickTask());
+	Coroutine::Spawn(batteryTask());
+	Coroutine::Spawn(displayTask());
+
+	Coroutine::Run();
+}
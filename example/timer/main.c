@@ -22,6 +22,8 @@
 #include <Display.h>
 #include <Font.h>
 #include <TimerUtils.h>
+#include <TimerWheel.h>
+#include <Idle.h>
 
 // All globals used by timer callback should be volatile
 volatile uint32_t timerCounter[3] = {0};
@@ -34,20 +36,27 @@ void timerCallback(uint32_t counterIndex) {
 
 int main() {
 	char buf[100];
+	Idle_Stats_t idleStats;
 
 	// Setup three periodic timers: 0.2Hz (5s period), 1Hz, 100Hz
 	// All of them use the same callback
 	// They are distinguished by the optional parameter
-	Timer_CreateTimeout(5000, 1, timerCallback, 0);
+	// The slow one is a software timer, since only two
+	// hardware timers are available to users
+	TimerWheel_CreateTimer(5000, 1, timerCallback, 0);
 	Timer_CreateTimer(1, 1, timerCallback, 1);
 	Timer_CreateTimer(100, 1, timerCallback, 2);
 
 	while(1) {
-		siprintf(buf, "Count 1:\n%lu\nCount 2:\n%lu\nCount 3:\n%lu",
-			timerCounter[0], timerCounter[1], timerCounter[2]);
+		Idle_GetStats(&idleStats);
+		siprintf(buf, "Count 1:\n%lu\nCount 2:\n%lu\nCount 3:\n%lu\nSleep:\n%u%%",
+			timerCounter[0], timerCounter[1], timerCounter[2], idleStats.sleepPercent);
 
 		Display_Clear();
 		Display_PutText(0, 0, buf, FONT_DEJAVU_8PT);
 		Display_Update();
+
+		// Nothing else to do until the next timer fires
+		Idle_Sleep();
 	}
 }
@@ -64,6 +64,17 @@ extern "C" {
  */
 #define ADC_MODULE_VBAT 0x12
 
+/**
+ * Comparator condition: match when the result is less than the value.
+ */
+#define ADC_CMP_LESS_THAN 0
+
+/**
+ * Comparator condition: match when the result is greater than or equal
+ * to the value.
+ */
+#define ADC_CMP_GREATER_OR_EQUAL 1
+
 /**
  * Initializes the ADC.
  * System control registers must be unlocked.
@@ -88,6 +99,36 @@ void ADC_UpdateCache(const uint8_t moduleNum[], uint8_t len, uint8_t isBlocking)
  */
 uint16_t ADC_GetCachedResult(uint8_t moduleNum);
 
+/**
+ * Enables a hardware result comparator. The comparator checks every
+ * conversion of the specified module, without any CPU intervention,
+ * and latches a flag when the condition has been met for matchCount
+ * consecutive conversions.
+ * Comparators 0 and 1 are used by the atomizer library.
+ *
+ * @param cmpNum     Comparator number (0 - 3).
+ * @param moduleNum  Module to watch (one of ADC_MODULE_*).
+ * @param condition  One of ADC_CMP_*.
+ * @param value      Value to compare against (12 bits).
+ * @param matchCount Consecutive matches needed to set the flag (1 - 16).
+ */
+void ADC_EnableCompare(uint8_t cmpNum, uint8_t moduleNum, uint8_t condition, uint16_t value, uint8_t matchCount);
+
+/**
+ * Disables a hardware result comparator and clears its flag.
+ *
+ * @param cmpNum Comparator number (0 - 3).
+ */
+void ADC_DisableCompare(uint8_t cmpNum);
+
+/**
+ * Reads and clears the latched comparator flags.
+ *
+ * @return Bitmask of the comparators that matched since the last call.
+ *         Bit N is set for comparator N.
+ */
+uint8_t ADC_FetchCompareFlags();
+
 /**
  * Reads a value from the ADC (blocking).
  *
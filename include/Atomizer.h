@@ -43,6 +43,23 @@ typedef enum {
 	POWERON_BOOST
 } Atomizer_ConverterState_t;
 
+/**
+ * Reasons for output derating.
+ */
+typedef enum {
+	/**
+	 * Output is not derated.
+	 */
+	DERATE_NONE,
+	/**
+	 * Battery voltage under load is close to the weak battery limit.
+	 */
+	DERATE_WEAK_BATT,
+	/**
+	 * Board temperature is close to the over temperature limit.
+	 */
+	DERATE_OVER_TEMP
+} Atomizer_DerateReason_t;
 
 /**
  * Structure to hold atomizer info.
@@ -71,6 +88,16 @@ typedef struct {
 	 *
 	 */
 	uint16_t tcRes;  
+	/**
+	 * Output voltage derating, in percent of the target voltage.
+	 * 100 means no derating. Output power scales by its square.
+	 * Always 100 when the atomizer is off.
+	 */
+	uint8_t derating;
+	/**
+	 * Reason for output derating.
+	 */
+	Atomizer_DerateReason_t derateReason;
 } Atomizer_Info_t;
 
 /**
@@ -121,11 +148,58 @@ void Atomizer_SetOutputVoltage(uint16_t volts);
 
 /**
  * Powers the atomizer on or off.
+ * While firing, the output voltage is scaled down smoothly when
+ * the battery voltage under load gets close to the weak battery
+ * limit, or the board temperature gets close to the over temperature
+ * limit (see Atomizer_Info_t.derating). The atomizer is only powered
+ * off as a last resort, when a limit is reached anyway.
  *
  * @param powerOn True to power the atomizer on, false to power it off.
  */
 void Atomizer_Control(uint8_t powerOn);
 
+/**
+ * Enables or disables fire on button mode. It is disabled by default.
+ * In this mode the fire button interrupt powers the atomizer on and
+ * off directly, without waiting for the main loop. The weak battery
+ * check uses the filtered battery voltage (see Battery_GetVoltage).
+ * The atomizer is only powered on if the resistance is known and
+ * there is no error, and powering on is retried on Atomizer_ReadInfo
+ * while the button is held (e.g. after a resistance measurement).
+ * Output voltage is still set with Atomizer_SetOutputVoltage.
+ *
+ * @param isEnabled True to enable fire on button, false to disable it.
+ */
+void Atomizer_SetFireOnButton(uint8_t isEnabled);
+
+/**
+ * Updates the atomizer power for fire on button mode.
+ * This is called by the button library from the fire
+ * button interrupt. Users must not call it.
+ */
+void Atomizer_HandleFireButton();
+
+/**
+ * Gets the battery charge drawn by the atomizer since the last call.
+ * It is integrated from the measured output power and the battery
+ * voltage on every feedback iteration, accounting for an estimated
+ * converter efficiency. This is used by the battery state of charge
+ * estimator: call it from one place only.
+ *
+ * @return Battery charge, in mAs.
+ */
+uint32_t Atomizer_FetchBatteryCharge();
+
+/**
+ * Gets the maximum output power the battery can sustain without
+ * tripping the weak battery check, going by the estimated battery
+ * internal resistance (see Battery_GetInternalResistance).
+ * Apps can use this to throttle power instead of refusing to fire.
+ *
+ * @return Maximum output power, in mW.
+ */
+uint32_t Atomizer_GetMaxPower();
+
 /**
  * Checks whether the atomizer is powered on.
  *
@@ -145,11 +219,30 @@ Atomizer_Error_t Atomizer_GetError();
  * This may power up the atomizer for resistance measuring,
  * depending on the situation. Refresh rate is internally
  * limited, so you can call this as often as you like.
+ * While firing, voltage, current, resistance and state all come
+ * from the same feedback iteration, read without disabling interrupts.
  *
  * @param info Info structure to fill.
  */
 void Atomizer_ReadInfo(Atomizer_Info_t *info);
 
+/**
+ * Pauses the feedback cycle timer while the atomizer is off,
+ * so that its 25kHz interrupt doesn't keep the core awake.
+ * The ADC cache and the refresh timing are frozen meanwhile.
+ * Powering the atomizer on resumes it automatically.
+ * This is used by the idle manager, see Idle.h.
+ * Must not be called from an interrupt handler.
+ *
+ * @return True if the timer is paused, false if the atomizer is on.
+ */
+uint8_t Atomizer_Suspend();
+
+/**
+ * Resumes the feedback cycle timer paused by Atomizer_Suspend.
+ */
+void Atomizer_Resume();
+
 /**
  * Reads the DC/DC converter temperature.
  *
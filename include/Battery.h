@@ -24,6 +24,66 @@
 extern "C" {
 #endif
 
+/**
+ * Default battery capacity for the state of charge estimator, in mAh.
+ * Can be changed with Battery_SetCapacity.
+ */
+#define BATTERY_DEFAULT_CAPACITY 2500
+
+/**
+ * Battery internal resistance assumed until it has been measured, in mOhm.
+ */
+#define BATTERY_DEFAULT_RESISTANCE 20
+
+/**
+ * Each internal resistance measurement is blended into the estimate
+ * with a weight of 1 / BATTERY_RESISTANCE_WEIGHT.
+ */
+#define BATTERY_RESISTANCE_WEIGHT 8
+
+/**
+ * Nominal battery voltage, in mV. Used for remaining energy.
+ */
+#define BATTERY_NOMINAL_VOLTAGE 3700
+
+/**
+ * Time without load or charging after which the battery voltage
+ * is considered an open circuit voltage, in ms.
+ */
+#define BATTERY_REST_TIME 60000
+
+/**
+ * The rested voltage estimate is blended into the state of charge
+ * with a weight of 1 / BATTERY_VOLTAGE_WEIGHT.
+ */
+#define BATTERY_VOLTAGE_WEIGHT 4
+
+/**
+ * Structure to hold filtered battery voltage readings.
+ */
+typedef struct {
+	/**
+	 * Fast filtered voltage (2.5ms time constant), in mV.
+	 * Follows the battery sag under load.
+	 */
+	uint16_t fast;
+	/**
+	 * Slow filtered voltage (650ms time constant), in mV.
+	 * Good for display and charge estimation.
+	 */
+	uint16_t slow;
+	/**
+	 * Minimum fast filtered voltage under load since
+	 * the last query, in mV. 0 if there was no load.
+	 */
+	uint16_t loadMin;
+	/**
+	 * Maximum fast filtered voltage under load since
+	 * the last query, in mV. 0 if there was no load.
+	 */
+	uint16_t loadMax;
+} Battery_VoltageInfo_t;
+
 /**
  * Initializes the battery I/O.
  * System control registers must be unlocked.
@@ -45,15 +105,54 @@ uint8_t Battery_IsPresent();
 uint8_t Battery_IsCharging();
 
 /**
- * Reads the battery voltage.
+ * Gets the battery voltage, fast filtered (see Battery_VoltageInfo_t).
+ * The filters are fed by the atomizer feedback cycle from the ADC
+ * cache, so this doesn't start a conversion and returns right away.
+ * While the idle manager pauses the feedback cycle, the value is the
+ * last one before pausing.
+ * Right after boot or a battery swap, before the feedback cycle has
+ * seeded the filters, this starts a conversion and waits for it. In
+ * interrupt handlers or with interrupts masked, it returns
+ * Battery_GetCachedVoltage instead.
  * If the battery is not present or charging, this will
  * return wrong values. Always check the battery status
  * before trying to read the voltage.
+ * This can be called from interrupt handlers.
  *
  * @return Battery voltage, in millivolts.
  */
 uint16_t Battery_GetVoltage();
 
+/**
+ * Gets the battery voltage from the last conversion, without
+ * starting a new one. The atomizer feedback cycle keeps the value
+ * fresh, unless it is paused by the idle manager. The same caveats
+ * as Battery_GetVoltage apply.
+ * This can be called from interrupt handlers.
+ *
+ * @return Battery voltage, in millivolts.
+ */
+uint16_t Battery_GetCachedVoltage();
+
+/**
+ * Gets the filtered battery voltage readings, and restarts
+ * tracking the minimum and maximum voltage under load.
+ * The same caveats as Battery_GetVoltage apply.
+ *
+ * @param info Voltage info structure to fill.
+ */
+void Battery_GetVoltageInfo(Battery_VoltageInfo_t *info);
+
+/**
+ * Feeds a battery voltage reading to the filters.
+ * This is called by the atomizer feedback cycle.
+ * Users must not call it.
+ *
+ * @param adcValue Raw battery voltage ADC reading.
+ * @param isLoaded True if the atomizer is powered on.
+ */
+void Battery_UpdateVoltage(uint16_t adcValue, uint8_t isLoaded);
+
 /**
  * Converts a battery voltage to a charge percent.
  *
@@ -63,6 +162,53 @@ uint16_t Battery_GetVoltage();
  */
 uint8_t Battery_VoltageToPercent(uint16_t volts);
 
+/**
+ * Gets the estimated battery internal resistance (including contacts).
+ * It is measured from the battery voltage drop on every fire, and
+ * filtered over time. It is reset when a battery is inserted.
+ *
+ * @return Internal resistance, in mOhm.
+ */
+uint16_t Battery_GetInternalResistance();
+
+/**
+ * Adds an internal resistance measurement to the estimate.
+ * This is called by the atomizer library while firing.
+ * Users must not call it.
+ *
+ * @param voltageDrop Battery voltage drop under load, in mV.
+ * @param current     Battery current, in mA.
+ */
+void Battery_UpdateInternalResistance(uint16_t voltageDrop, uint32_t current);
+
+/**
+ * Sets the battery capacity for the state of charge estimator.
+ * The current percentage is kept.
+ *
+ * @param capacity Battery capacity, in mAh.
+ */
+void Battery_SetCapacity(uint16_t capacity);
+
+/**
+ * Gets the estimated battery state of charge.
+ * Unlike Battery_VoltageToPercent, this doesn't jump around under
+ * load: it counts the charge drawn by the atomizer, and is corrected
+ * with the rested battery voltage (see BATTERY_REST_TIME).
+ * The estimate survives resets, but not power loss.
+ * Call this and Battery_GetRemainingEnergy from the main loop only.
+ *
+ * @return Battery charge percentage (0 - 100).
+ */
+uint8_t Battery_GetStateOfCharge();
+
+/**
+ * Gets the estimated remaining battery energy.
+ * See Battery_GetStateOfCharge.
+ *
+ * @return Remaining energy, in mWh.
+ */
+uint32_t Battery_GetRemainingEnergy();
+
 #ifdef __cplusplus
 }
 #endif
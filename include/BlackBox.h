@@ -0,0 +1,216 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_BLACKBOX_H
+#define EVICSDK_BLACKBOX_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of samples kept in the ring.
+ * The atomizer records one sample per millisecond while firing,
+ * so this is the time window (in ms) before a fault.
+ */
+#define BLACKBOX_SAMPLE_COUNT 96
+
+/**
+ * Reasons for a black box dump.
+ */
+typedef enum {
+	/**
+	 * Atomizer error while firing (short, weak battery
+	 * or over temperature).
+	 */
+	BLACKBOX_ATOMIZER_ERROR,
+	/**
+	 * Hard fault. The device is reset after the dump.
+	 */
+	BLACKBOX_HARDFAULT,
+	/**
+	 * Brown-out warning.
+	 */
+	BLACKBOX_BROWNOUT,
+	/**
+	 * Watchdog, lockup or brown-out reset. The dump is saved
+	 * at the next boot from the ring left in RAM.
+	 */
+	BLACKBOX_RESET,
+	/**
+	 * Triggered by the application.
+	 */
+	BLACKBOX_USER
+} BlackBox_Reason_t;
+
+/**
+ * Control loop sample.
+ */
+typedef struct {
+	/**
+	 * Uptime, in ms. Only the low 16 bits are kept.
+	 */
+	uint16_t time;
+	/**
+	 * Atomizer voltage, in mV.
+	 */
+	uint16_t voltage;
+	/**
+	 * Atomizer current, in mA.
+	 */
+	uint16_t current;
+	/**
+	 * Atomizer resistance, in mOhm.
+	 */
+	uint16_t resistance;
+	/**
+	 * Battery voltage, in mV.
+	 */
+	uint16_t battVolts;
+	/**
+	 * Raw board thermistor ADC reading.
+	 * Goes down as temperature goes up.
+	 */
+	uint16_t adcBoardTemp;
+	/**
+	 * Converter duty cycle.
+	 */
+	uint16_t cmr;
+	/**
+	 * Converter state (Atomizer_ConverterState_t).
+	 */
+	uint8_t state;
+	/**
+	 * Atomizer error (Atomizer_Error_t).
+	 */
+	uint8_t error;
+} BlackBox_Sample_t;
+
+/**
+ * Black box dump, as stored in flash.
+ */
+typedef struct {
+	/**
+	 * Magic number, written last. Internal.
+	 */
+	uint32_t magic;
+	/**
+	 * Dump sequence number. Internal.
+	 */
+	uint32_t seq;
+	/**
+	 * Uptime at the trigger, in ms.
+	 */
+	uint32_t uptime;
+	/**
+	 * Faulting instruction address for BLACKBOX_HARDFAULT, 0 otherwise.
+	 */
+	uint32_t faultAddr;
+	/**
+	 * Dump reason (BlackBox_Reason_t).
+	 */
+	uint8_t reason;
+	/**
+	 * Number of valid samples.
+	 */
+	uint8_t count;
+	/**
+	 * Reserved.
+	 */
+	uint16_t reserved;
+	/**
+	 * Samples, oldest first.
+	 */
+	BlackBox_Sample_t sample[BLACKBOX_SAMPLE_COUNT];
+} BlackBox_Dump_t;
+
+/**
+ * Initializes the black box.
+ * Two flash pages are taken from the top of APROM (see
+ * Dataflash_AllocPages): the newest dump is kept in one, while
+ * the other is kept erased, so that a dump only needs to program
+ * flash. The sample ring lives in a .noinit section: if the last
+ * reset came from the watchdog, a CPU lockup or brown-out, the ring
+ * left in RAM is saved here as a BLACKBOX_RESET dump.
+ * This also installs a hard fault handler, which saves a dump
+ * (unless the fault hit a flash write) and resets the device.
+ * Brown-out dumps need the settings layer (Settings_Init), which
+ * owns the brown-out interrupt.
+ * Storage pages are laid out in init order: call this before
+ * Settings_Init, see Dataflash_AllocPages. The atomizer must be off.
+ *
+ * @return True on success, false if the pages would overlap
+ *         the program image or hold another store's data.
+ */
+uint8_t BlackBox_Init();
+
+/**
+ * Records a sample in the ring.
+ * This is called by the atomizer feedback cycle while firing.
+ * Users don't need to call it.
+ *
+ * @param sample Sample to record.
+ */
+void BlackBox_Record(const BlackBox_Sample_t *sample);
+
+/**
+ * Freezes the ring and saves it to flash.
+ * This can be called from any context: the ring is frozen right away,
+ * while the dump is written from deferred work. Writing stalls the CPU
+ * for up to about 40ms, so it waits for the atomizer to be off.
+ * Triggers are ignored until the dump is written.
+ *
+ * @param reason Dump reason.
+ */
+void BlackBox_Trigger(BlackBox_Reason_t reason);
+
+/**
+ * Saves the ring on a brown-out warning.
+ * The dump is written right away, unless the atomizer is on or
+ * another context is writing flash: then it is left pending, and
+ * written like a BlackBox_Trigger dump.
+ * This is called by the SDK brown-out handler.
+ * Users must not call it.
+ */
+void BlackBox_HandlePowerLoss();
+
+/**
+ * Gets the most recent dump.
+ * The dump is read straight from flash, and stays valid until
+ * the next dump is written or BlackBox_Clear is called.
+ *
+ * @return Most recent dump, or NULL if there is none.
+ */
+const BlackBox_Dump_t *BlackBox_GetDump();
+
+/**
+ * Erases all dumps.
+ * Nothing is done while the atomizer is on.
+ *
+ * @return True on success, false on failure.
+ */
+uint8_t BlackBox_Clear();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
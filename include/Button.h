@@ -48,6 +48,77 @@ extern "C" {
  */
 typedef void (*Button_Callback_t)(uint8_t);
 
+/**
+ * Button gestures.
+ * A gesture is made by a button, or by a combination of buttons
+ * pressed together (e.g. left + right).
+ */
+typedef enum {
+	/**
+	 * One or more short presses. The count is the number of clicks.
+	 * Sent once the click gap expires without another press.
+	 */
+	BUTTON_GESTURE_CLICK,
+	/**
+	 * Buttons held for the hold time.
+	 */
+	BUTTON_GESTURE_HOLD,
+	/**
+	 * Buttons held for the long hold time.
+	 */
+	BUTTON_GESTURE_LONGHOLD,
+	/**
+	 * Auto-repeat while held, after BUTTON_GESTURE_HOLD.
+	 * The count is the repeat number (saturates at 255).
+	 * Repeats speed up the longer the buttons are held.
+	 */
+	BUTTON_GESTURE_REPEAT,
+	/**
+	 * Buttons released after a hold.
+	 */
+	BUTTON_GESTURE_RELEASE
+} Button_Gesture_t;
+
+/**
+ * Gesture recognizer timings, all in ms.
+ */
+typedef struct {
+	/**
+	 * Maximum time between clicks of a multi-click.
+	 */
+	uint16_t clickGap;
+	/**
+	 * Press time for BUTTON_GESTURE_HOLD.
+	 */
+	uint16_t holdTime;
+	/**
+	 * Press time for BUTTON_GESTURE_LONGHOLD.
+	 */
+	uint16_t longHoldTime;
+	/**
+	 * Time between the hold and the first repeat.
+	 */
+	uint16_t repeatStart;
+	/**
+	 * Minimum time between repeats.
+	 */
+	uint16_t repeatMin;
+	/**
+	 * Each repeat interval is this percentage of the previous one.
+	 */
+	uint8_t repeatAccel;
+} Button_GestureConfig_t;
+
+/**
+ * Function pointer type for gesture callbacks.
+ * The first argument is the button mask that made the gesture,
+ * the second one is the gesture and the third one is the click
+ * or repeat count (0 for other gestures).
+ * Callbacks will be invoked from an interrupt handler, unless
+ * deferred with Button_SetGestureCallbackDeferred().
+ */
+typedef void (*Button_GestureCallback_t)(uint8_t, Button_Gesture_t, uint8_t);
+
 /**
  * Initializes the buttons I/O.
  * System control registers must be unlocked.
@@ -76,6 +147,45 @@ uint8_t Button_GetState();
  */
 int8_t Button_CreateCallback(Button_Callback_t callback, uint8_t buttonMask);
 
+/**
+ * Sets whether a button callback is invoked directly from the GPIO
+ * interrupt handler (the default), or posted to the deferred work
+ * queue and run from the lowest priority PendSV handler. Deferred
+ * callbacks get the button state at the time of the interrupt.
+ *
+ * @param index      Callback index as returned by Button_CreateCallback().
+ * @param isDeferred True to defer the callback, false to invoke it directly.
+ */
+void Button_SetCallbackDeferred(int8_t index, uint8_t isDeferred);
+
+/**
+ * Sets the gesture callback. Edges are timestamped in the GPIO
+ * interrupt handler and timed with software timers, so the
+ * application never needs to block on button timing.
+ * If a callback was previously set, it will be replaced.
+ *
+ * @param callback Callback function, or NULL to disable gestures.
+ */
+void Button_SetGestureCallback(Button_GestureCallback_t callback);
+
+/**
+ * Sets whether the gesture callback is invoked directly from an
+ * interrupt handler (the default), or posted to the deferred work
+ * queue and run from the lowest priority PendSV handler.
+ *
+ * @param isDeferred True to defer the callback, false to invoke it directly.
+ */
+void Button_SetGestureCallbackDeferred(uint8_t isDeferred);
+
+/**
+ * Sets the gesture recognizer timings.
+ * Defaults are 250ms click gap, 500ms hold, 1000ms long hold,
+ * 300ms to first repeat, 40ms minimum repeat, 80% acceleration.
+ *
+ * @param config Timings to use. They are copied.
+ */
+void Button_SetGestureConfig(const Button_GestureConfig_t *config);
+
 /**
  * Deletes a callback.
  *
@@ -0,0 +1,162 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_CHECKSUM_H
+#define EVICSDK_CHECKSUM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * PDMA channel used by Checksum_UpdateAsync.
+ */
+#define CHECKSUM_PDMA_CHANNEL 0
+
+/**
+ * Checksum algorithms.
+ * Check values are for the ASCII string "123456789".
+ */
+typedef enum {
+	/**
+	 * CRC-8/SMBUS: poly 0x07, init 0x00. Check value 0xF4.
+	 */
+	CHECKSUM_CRC8,
+	/**
+	 * CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF.
+	 * Check value 0x29B1.
+	 */
+	CHECKSUM_CRC16_CCITT,
+	/**
+	 * CRC-16/ARC: poly 0x8005, init 0x0000, reflected.
+	 * Check value 0xBB3D.
+	 */
+	CHECKSUM_CRC16,
+	/**
+	 * CRC-32 (zlib, Ethernet): poly 0x04C11DB7, init 0xFFFFFFFF,
+	 * reflected, final XOR 0xFFFFFFFF. Check value 0xCBF43926.
+	 */
+	CHECKSUM_CRC32
+} Checksum_Type_t;
+
+/**
+ * Streaming checksum context.
+ * Contexts are independent: several checksums can be in progress
+ * at the same time, in different contexts. The CRC unit is taken
+ * by a context only while feeding data, and the software fallback
+ * is used when another context holds it.
+ */
+typedef struct {
+	/**
+	 * CRC register. Internal.
+	 */
+	uint32_t state;
+	/**
+	 * Checksum algorithm. Internal.
+	 */
+	uint8_t type;
+	/**
+	 * True while a PDMA transfer is running. Internal.
+	 */
+	volatile uint8_t isPending;
+	/**
+	 * Data left for after the PDMA transfer. Internal.
+	 */
+	const uint8_t *tail;
+	/**
+	 * Size of the data left, in bytes. Internal.
+	 */
+	uint32_t tailSize;
+} Checksum_Context_t;
+
+/**
+ * Starts a checksum.
+ *
+ * @param ctx  Context to set up.
+ * @param type Checksum algorithm.
+ */
+void Checksum_Begin(Checksum_Context_t *ctx, Checksum_Type_t type);
+
+/**
+ * Feeds data to a checksum.
+ * The hardware CRC unit is used if it's free, taking 32 bits
+ * per write. Otherwise, the software fallback is used.
+ * This is safe to call from any context.
+ *
+ * @param ctx  Checksum context.
+ * @param data Data to feed.
+ * @param size Data size, in bytes.
+ */
+void Checksum_Update(Checksum_Context_t *ctx, const void *data, uint32_t size);
+
+/**
+ * Feeds data to a checksum in software, without the CRC unit.
+ * This is about an order of magnitude slower than the hardware.
+ * This is safe to call from any context.
+ *
+ * @param ctx  Checksum context.
+ * @param data Data to feed.
+ * @param size Data size, in bytes.
+ */
+void Checksum_UpdateSoftware(Checksum_Context_t *ctx, const void *data, uint32_t size);
+
+/**
+ * Starts feeding data to a checksum through PDMA, and returns
+ * right away. The CPU is free to do other work meanwhile.
+ * The data must be left untouched until Checksum_End is called
+ * (or until the next update on the same context, which waits for
+ * the transfer). If the CRC unit is busy, this falls back to
+ * Checksum_Update. Must not be called from interrupt handlers.
+ *
+ * @param ctx  Checksum context.
+ * @param data Data to feed.
+ * @param size Data size, in bytes.
+ */
+void Checksum_UpdateAsync(Checksum_Context_t *ctx, const void *data, uint32_t size);
+
+/**
+ * Finishes a checksum.
+ * Waits for any PDMA transfer started on the context.
+ * The context can be fed more data afterwards, to get
+ * the checksum of the data so far at any point.
+ *
+ * @param ctx Checksum context.
+ *
+ * @return Checksum value.
+ */
+uint32_t Checksum_End(Checksum_Context_t *ctx);
+
+/**
+ * Computes a checksum over a single buffer.
+ *
+ * @param type Checksum algorithm.
+ * @param data Data to checksum.
+ * @param size Data size, in bytes.
+ *
+ * @return Checksum value.
+ */
+uint32_t Checksum_Compute(Checksum_Type_t type, const void *data, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Header-only C++20 coroutine runtime.
+ * Tasks are stackless coroutines. Their frames come from a static
+ * block pool, so there is no heap dependency. Each suspended task
+ * holds a poll predicate for the event it waits on. The scheduler
+ * goes round-robin over the tasks, resumes the ones whose predicate
+ * holds, and sleeps the core with WFI when none are ready.
+ * Predicates are re-checked at least on every SDK tick (1ms).
+ *
+ * Requires -std=c++20 (or -std=c++2a -fcoroutines on older GCC).
+ * Everything runs from the main loop: do not resume or spawn
+ * tasks from interrupt handlers.
+ *
+ * Example:
+ *
+ *     Coroutine::Task blink() {
+ *         while(1) {
+ *             toggleSomething();
+ *             co_await Coroutine::Sleep(500);
+ *         }
+ *     }
+ *
+ *     int main() {
+ *         Coroutine::Spawn(blink());
+ *         Coroutine::Run();
+ *     }
+ */
+
+#ifndef EVICSDK_COROUTINE_HPP
+#define EVICSDK_COROUTINE_HPP
+
+#include <coroutine>
+#include <stddef.h>
+#include <stdint.h>
+#include <M451Series.h>
+#include <TimerUtils.h>
+#include <Button.h>
+#include <ADC.h>
+#include <USB_VirtualCOM.h>
+
+/**
+ * Size of a coroutine frame block, in bytes.
+ * Coroutines with a bigger frame fail to spawn.
+ * Can be overridden before including this header.
+ */
+#ifndef COROUTINE_FRAME_SIZE
+#define COROUTINE_FRAME_SIZE 192
+#endif
+
+/**
+ * Number of coroutine frame blocks (at most 32).
+ * This is also the maximum number of live tasks.
+ * Can be overridden before including this header.
+ */
+#ifndef COROUTINE_FRAME_COUNT
+#define COROUTINE_FRAME_COUNT 8
+#endif
+
+static_assert(COROUTINE_FRAME_COUNT <= 32, "COROUTINE_FRAME_COUNT must be at most 32");
+
+namespace Coroutine {
+
+/**
+ * Poll predicate type. Returns true when the waiting task can resume.
+ * The argument is the awaitable that set it.
+ */
+typedef bool (*Poll_t)(const void *);
+
+/**
+ * Static frame block pool.
+ * This is an internal structure.
+ */
+struct FramePool {
+	/**
+	 * Frame blocks, aligned for any frame contents.
+	 */
+	alignas(8) static inline uint8_t block[COROUTINE_FRAME_COUNT][COROUTINE_FRAME_SIZE];
+
+	/**
+	 * Bitmask of used blocks.
+	 */
+	static inline uint32_t usedMask;
+
+	/**
+	 * Allocates a frame block.
+	 *
+	 * @param size Frame size, in bytes.
+	 *
+	 * @return Frame block, or nullptr if the frame is too
+	 *         big or no blocks are free.
+	 */
+	static void *Alloc(size_t size) noexcept {
+		uint8_t i;
+
+		if(size > COROUTINE_FRAME_SIZE) {
+			return nullptr;
+		}
+
+		for(i = 0; i < COROUTINE_FRAME_COUNT && (usedMask & (1UL << i)); i++);
+		if(i == COROUTINE_FRAME_COUNT) {
+			return nullptr;
+		}
+
+		usedMask |= 1UL << i;
+		return block[i];
+	}
+
+	/**
+	 * Frees a frame block.
+	 *
+	 * @param ptr Frame block, as returned by Alloc.
+	 */
+	static void Free(void *ptr) noexcept {
+		usedMask &= ~(1UL << (((uint8_t *) ptr - block[0]) / COROUTINE_FRAME_SIZE));
+	}
+};
+
+/**
+ * Coroutine task. Create one by calling a function
+ * returning Task, then hand it to Spawn.
+ */
+struct Task {
+	struct promise_type {
+		/**
+		 * What the task is waiting on, nullptr if ready.
+		 */
+		Poll_t poll = nullptr;
+
+		/**
+		 * Argument for poll.
+		 */
+		const void *pollArg = nullptr;
+
+		static void *operator new(size_t size) noexcept {
+			return FramePool::Alloc(size);
+		}
+
+		static void operator delete(void *ptr, size_t) noexcept {
+			FramePool::Free(ptr);
+		}
+
+		static Task get_return_object_on_allocation_failure() noexcept {
+			return Task(nullptr);
+		}
+
+		Task get_return_object() noexcept {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		// Don't run until spawned, and stay around when done
+		// so that the scheduler can reclaim the frame.
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+
+		void unhandled_exception() noexcept {
+			// Built without exceptions, this can't happen
+			while(1);
+		}
+	};
+
+	/**
+	 * Coroutine handle, null if the frame couldn't be allocated.
+	 */
+	std::coroutine_handle<promise_type> handle;
+
+	explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+};
+
+/**
+ * Task handle type.
+ */
+typedef std::coroutine_handle<Task::promise_type> Handle_t;
+
+/**
+ * Scheduler state.
+ * This is an internal structure.
+ */
+struct Scheduler {
+	/**
+	 * Task ring, null entries are free.
+	 */
+	static inline Handle_t task[COROUTINE_FRAME_COUNT];
+
+	/**
+	 * Next task to look at, for round-robin.
+	 */
+	static inline uint8_t next;
+};
+
+/**
+ * Base for poll-based awaitables.
+ * Derived classes provide a static Poll(const void *) function
+ * and pass it up. Suspension stores it in the promise, and the
+ * scheduler resumes the task once it returns true.
+ */
+template<class Derived>
+struct Awaitable {
+	bool await_ready() const noexcept {
+		return Derived::Poll(static_cast<const Derived *>(this));
+	}
+
+	void await_suspend(Handle_t h) const noexcept {
+		h.promise().poll = Derived::Poll;
+		h.promise().pollArg = static_cast<const Derived *>(this);
+	}
+
+	void await_resume() const noexcept {}
+};
+
+/**
+ * Waits for the specified time.
+ */
+struct Sleep : Awaitable<Sleep> {
+	/**
+	 * Uptime to wake up at, in us.
+	 */
+	uint64_t deadline;
+
+	/**
+	 * @param ms Time to wait, in milliseconds.
+	 */
+	explicit Sleep(uint32_t ms) noexcept : deadline(Timer_GetMicros() + ms * 1000ULL) {}
+
+	static bool Poll(const void *self) noexcept {
+		return Timer_GetMicros() >= static_cast<const Sleep *>(self)->deadline;
+	}
+};
+
+/**
+ * Lets other ready tasks run, then resumes.
+ */
+struct Yield {
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(Handle_t h) const noexcept {
+		h.promise().poll = nullptr;
+	}
+	void await_resume() const noexcept {}
+};
+
+/**
+ * Waits until some buttons are in the given state.
+ * Resumes with the full button state.
+ */
+struct WaitButtons : Awaitable<WaitButtons> {
+	/**
+	 * Buttons to look at, bitwise OR of BUTTON_MASK_*.
+	 */
+	uint8_t mask;
+
+	/**
+	 * Expected state for those buttons.
+	 */
+	uint8_t state;
+
+	/**
+	 * @param mask  Buttons to look at, bitwise OR of BUTTON_MASK_*.
+	 * @param state Expected state: pressed buttons have their bit set.
+	 */
+	WaitButtons(uint8_t mask, uint8_t state) noexcept : mask(mask), state(state) {}
+
+	static bool Poll(const void *self) noexcept {
+		const WaitButtons *w = static_cast<const WaitButtons *>(self);
+		return (Button_GetState() & w->mask) == w->state;
+	}
+
+	uint8_t await_resume() const noexcept {
+		return Button_GetState();
+	}
+};
+
+/**
+ * Starts an ADC conversion and waits for it to finish.
+ * Resumes with the conversion result.
+ */
+struct WaitAdc : Awaitable<WaitAdc> {
+	/**
+	 * ADC module number.
+	 */
+	uint8_t moduleNum;
+
+	/**
+	 * @param moduleNum One of ADC_MODULE_*.
+	 */
+	explicit WaitAdc(uint8_t moduleNum) noexcept : moduleNum(moduleNum) {
+		ADC_UpdateCache(&this->moduleNum, 1, 0);
+	}
+
+	static bool Poll(const void *self) noexcept {
+		return !(EADC_GET_PENDING_CONV(EADC) & (1 << static_cast<const WaitAdc *>(self)->moduleNum));
+	}
+
+	uint16_t await_resume() const noexcept {
+		return ADC_GetCachedResult(moduleNum);
+	}
+};
+
+/**
+ * Waits until enough data has been received on the
+ * USB virtual COM port. Resumes with the available size.
+ */
+struct WaitUsbRx : Awaitable<WaitUsbRx> {
+	/**
+	 * Minimum number of bytes to wait for.
+	 */
+	uint16_t size;
+
+	/**
+	 * @param size Minimum number of bytes to wait for.
+	 */
+	explicit WaitUsbRx(uint16_t size = 1) noexcept : size(size) {}
+
+	static bool Poll(const void *self) noexcept {
+		return USB_VirtualCOM_GetAvailableSize() >= static_cast<const WaitUsbRx *>(self)->size;
+	}
+
+	uint16_t await_resume() const noexcept {
+		return USB_VirtualCOM_GetAvailableSize();
+	}
+};
+
+/**
+ * Adds a task to the scheduler.
+ *
+ * @param t Task to run.
+ *
+ * @return True on success, false if the task frame couldn't be
+ *         allocated (frame too big or pool exhausted).
+ */
+inline bool Spawn(Task t) noexcept {
+	uint8_t i;
+
+	if(!t.handle) {
+		return false;
+	}
+
+	// Frames and slots have the same count, so a slot is always free
+	for(i = 0; i < COROUTINE_FRAME_COUNT && Scheduler::task[i]; i++);
+	Scheduler::task[i] = t.handle;
+	return true;
+}
+
+/**
+ * Runs one scheduler pass: resumes every ready task once,
+ * round-robin, and reclaims finished tasks.
+ *
+ * @return True if any task was resumed.
+ */
+inline bool RunOnce() noexcept {
+	Handle_t h;
+	uint8_t i, idx;
+	bool didRun = false;
+
+	for(i = 0; i < COROUTINE_FRAME_COUNT; i++) {
+		idx = (Scheduler::next + i) % COROUTINE_FRAME_COUNT;
+		h = Scheduler::task[idx];
+		if(!h) {
+			continue;
+		}
+
+		Task::promise_type &p = h.promise();
+		if(p.poll != nullptr && !p.poll(p.pollArg)) {
+			continue;
+		}
+
+		p.poll = nullptr;
+		h.resume();
+		didRun = true;
+
+		if(h.done()) {
+			Scheduler::task[idx] = nullptr;
+			h.destroy();
+		}
+	}
+
+	Scheduler::next = (Scheduler::next + 1) % COROUTINE_FRAME_COUNT;
+	return didRun;
+}
+
+/**
+ * Runs the scheduler forever.
+ * When no task is ready, the core sleeps until the next interrupt.
+ */
+[[noreturn]] inline void Run() noexcept {
+	while(1) {
+		if(!RunOnce()) {
+			__WFI();
+		}
+	}
+}
+
+}
+
+#endif
@@ -30,6 +30,18 @@ extern "C" {
  */
 #define DATAFLASH_STATUS_FLIP 4 // Display flipped.
 
+/**
+ * Size of the dataflash parameter record, in bytes.
+ */
+#define DATAFLASH_PARAMS_SIZE 0x100
+
+/**
+ * Storage page owners, see Dataflash_AllocPages.
+ */
+#define DATAFLASH_OWNER_BLACKBOX 0x31584242 // Black box, "BBX1".
+#define DATAFLASH_OWNER_KVSTORE  0x3153564B // Key/value store, "KVS1".
+#define DATAFLASH_OWNER_PUFFLOG  0x31474C50 // Puff log, "PLG1".
+
 /**
  * Boot flag: boot from APROM.
  */
@@ -69,6 +81,79 @@ extern Dataflash_Info_t Dataflash_info;
  */
 void Dataflash_Init();
 
+/**
+ * Reserves flash pages for SDK storage (black box, key/value store,
+ * puff log). Pages are handed out downwards from the dataflash, and
+ * must not overlap the program image.
+ *
+ * Nothing about the allocation is stored, so the layout follows the
+ * order of the storage init calls and their page counts. Firmware
+ * updates must keep both, and add new stores after the existing ones
+ * (BlackBox_Init, Settings_Init or KVStore_Init, then PuffLog_Init).
+ *
+ * The first word of every storage page is its owner's magic
+ * (DATAFLASH_OWNER_*), programmed once the page header is complete.
+ * If the layout changes anyway, pages holding another store's data
+ * are never handed out, so a store never erases them: the allocation
+ * fails and the pages are left for the stores after it.
+ *
+ * @param count Number of pages (FMC_FLASH_PAGE_SIZE each).
+ * @param owner Owner magic of the calling store (DATAFLASH_OWNER_*).
+ *
+ * @return Base address of the pages, or 0 if there is no room or the
+ *         pages belong to another store.
+ */
+uint32_t Dataflash_AllocPages(uint8_t count, uint32_t owner);
+
+/**
+ * Takes ownership of flash programming and enables it (ISP and
+ * APROM update). System control registers are unlocked if needed.
+ * Ownership belongs to the calling context (thread mode or the
+ * running exception) and nests: calls from the owner only bump a
+ * count. Calls from any other context fail, so that an interrupt
+ * never programs flash on top of a write it preempted. Callers that
+ * fail should leave the work pending and retry from a later context.
+ * Must not be called above GPIO priority.
+ *
+ * @return True on success, false if another context owns the flash.
+ */
+uint8_t Dataflash_BeginWrite();
+
+/**
+ * Releases flash ownership taken by a successful Dataflash_BeginWrite.
+ * The last release disables flash programming, and locks the system
+ * control registers again if they were locked.
+ */
+void Dataflash_EndWrite();
+
+/**
+ * Programs a flash word.
+ * The caller must own the flash (see Dataflash_BeginWrite).
+ *
+ * @param addr Word address.
+ * @param data Word to program.
+ */
+void Dataflash_Program(uint32_t addr, uint32_t data);
+
+/**
+ * Erases a flash page.
+ * The caller must own the flash (see Dataflash_BeginWrite).
+ *
+ * @param addr Page address.
+ *
+ * @return True on success, false on failure.
+ */
+uint8_t Dataflash_ErasePage(uint32_t addr);
+
+/**
+ * Gets the active parameter record, as read from the dataflash
+ * on init. Fields not covered by Dataflash_info can be read from
+ * here without going to the flash again.
+ *
+ * @return RAM copy of the parameter record (DATAFLASH_PARAMS_SIZE bytes).
+ */
+const uint8_t *Dataflash_GetParams();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,74 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_DEFERRED_H
+#define EVICSDK_DEFERRED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of pending work items.
+ * Must be a power of 2.
+ */
+#define DEFERRED_QUEUE_SIZE 32
+
+/**
+ * Function pointer type for deferred work.
+ * It accepts a user-defined argument. If more than 4 bytes
+ * are needed, a pointer can be stored and then casted.
+ * Deferred work runs from the PendSV handler, which has the
+ * lowest interrupt priority: it preempts the main loop, but
+ * any other interrupt can preempt it. It can take its time
+ * without delaying the atomizer control loop or other ISRs.
+ */
+typedef void (*Deferred_Callback_t)(uint32_t);
+
+/**
+ * Initializes the deferred work queue.
+ * System control registers must be unlocked.
+ */
+void Deferred_Init();
+
+/**
+ * Queues work to be run from the PendSV handler.
+ * This is lock-free and safe to call from any context,
+ * including interrupt handlers of any priority.
+ * Work items run in the order they were posted.
+ *
+ * @param callback     Work function.
+ * @param callbackData Optional argument to pass to the work function.
+ *
+ * @return True on success, false if the queue is full.
+ */
+uint8_t Deferred_Post(Deferred_Callback_t callback, uint32_t callbackData);
+
+/**
+ * Gets the number of work items dropped because the queue was full.
+ *
+ * @return Number of dropped work items.
+ */
+uint32_t Deferred_GetDropCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
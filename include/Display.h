@@ -71,6 +71,30 @@ typedef enum {
 	DISPLAY_SSD1327
 } Display_Type_t;
 
+/**
+ * Display update statistics.
+ */
+typedef struct {
+	/**
+	 * Number of calls to Display_Update.
+	 */
+	uint32_t frameCount;
+	/**
+	 * Bytes sent to the controller by the last update,
+	 * commands included.
+	 */
+	uint32_t lastFrameBytes;
+	/**
+	 * Bytes sent to the controller by all updates,
+	 * commands included.
+	 */
+	uint32_t totalBytes;
+	/**
+	 * Time taken by the last transfer to the controller, in us.
+	 */
+	uint32_t lastFrameMicros;
+} Display_Stats_t;
+
 /**
  * Initializes the SPI interface for the display controller.
  * System control registers must be unlocked.
@@ -117,9 +141,20 @@ void Display_SetInverted(bool invert);
 
 /**
  * Sends the framebuffer to the controller and updates the display.
+ * Only the parts of the framebuffer changed since the last update
+ * are sent. Changes are tracked by page (8 pixel rows) and column
+ * range, and checked against a copy of what the controller holds,
+ * so redrawing the same contents sends nothing.
  */
 void Display_Update();
 
+/**
+ * Gets the display update statistics.
+ *
+ * @param stats Statistics structure to fill.
+ */
+void Display_GetStats(Display_Stats_t *stats);
+
 /**
  * Clears the framebuffer.
  */
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <M451Series.h>
+#include <Display.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,6 +59,18 @@ extern "C" {
  */
 #define DISPLAY_SSD_DC    PE10
 
+/**
+ * Dirty region of the framebuffer.
+ * For each page (8 pixel rows), the range of columns to send.
+ * Clean pages have startX > endX.
+ */
+typedef struct {
+	/**< First dirty column, by page. */
+	uint8_t startX[DISPLAY_HEIGHT / 8];
+	/**< Last dirty column, by page. */
+	uint8_t endX[DISPLAY_HEIGHT / 8];
+} Display_SSD_Dirty_t;
+
 /**
  * Turns the display on or off.
  *
@@ -79,11 +92,13 @@ void Display_SSD_Flip();
 void Display_SSD_SetInverted(bool invert);
 
 /**
- * Sends the framebuffer to the controller and updates the display.
+ * Sends the dirty part of the framebuffer to the controller
+ * and updates the display.
  *
  * @param framebuf Framebuffer.
+ * @param dirty    Dirty region.
  */
-void Display_SSD_Update(const uint8_t *framebuf);
+void Display_SSD_Update(const uint8_t *framebuf, const Display_SSD_Dirty_t *dirty);
 
 /**
  * Initializes the display controller.
@@ -92,6 +107,10 @@ void Display_SSD_Init();
 
 /**
  * Writes data to the display controller.
+ * Bytes are queued in the SPI TX FIFO, and this returns as soon as
+ * the last one is queued. D/C# is only switched (after waiting for
+ * the queued bytes) when it changes. Use Display_SSD_Flush to wait
+ * for the transfer to complete.
  *
  * @param isData True if writing GDDRAM data (D/C# high).
  * @param buf    Data buffer.
@@ -99,6 +118,11 @@ void Display_SSD_Init();
  */
 void Display_SSD_Write(uint8_t isData, const uint8_t *buf, uint32_t len);
 
+/**
+ * Waits until all the queued bytes have been sent.
+ */
+void Display_SSD_Flush();
+
 /**
  * Sends a command to the display controller.
  *
@@ -106,6 +130,14 @@ void Display_SSD_Write(uint8_t isData, const uint8_t *buf, uint32_t len);
  */
 void Display_SSD_SendCommand(uint8_t cmd);
 
+/**
+ * Gets the number of bytes sent to the display controller,
+ * commands included.
+ *
+ * @return Number of bytes sent since boot.
+ */
+uint32_t Display_SSD_GetByteCount();
+
 #ifdef __cplusplus
 }
 #endif
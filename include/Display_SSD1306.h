@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <Display_SSD.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,6 +32,8 @@ extern "C" {
 /*
  * Display controller commands.
  */
+#define SSD1306_SET_COL_LOW        0x00
+#define SSD1306_SET_COL_HIGH       0x10
 #define SSD1306_SET_NOREMAP        0xA0
 #define SSD1306_SET_REMAP          0xA1
 #define SSD1306_OUTPUT_GDDRAM      0xA4
@@ -49,6 +52,16 @@ extern "C" {
  */
 #define SSD1306_NUM_PAGES 0x10
 
+/**
+ * SPI clock for the SSD1306, in Hz.
+ * The controller allows a 100ns minimum clock cycle. The default
+ * is the fastest PCLK0 (72MHz) divider within that. Can be
+ * overridden at build time.
+ */
+#ifndef DISPLAY_SSD1306_SPI_CLOCK
+#define DISPLAY_SSD1306_SPI_CLOCK 9000000
+#endif
+
 /**
  * Performs the controller power-on sequence.
  */
@@ -60,11 +73,14 @@ void Display_SSD1306_PowerOn();
 void Display_SSD1306_SendInitCmds();
 
 /**
- * Sends the framebuffer to the controller and updates the display.
+ * Sends the dirty part of the framebuffer to the controller
+ * and updates the display.
+ * Each dirty page is sent through its own address window.
  *
  * @param framebuf Framebuffer.
+ * @param dirty    Dirty region.
  */
-void Display_SSD1306_Update(const uint8_t *framebuf);
+void Display_SSD1306_Update(const uint8_t *framebuf, const Display_SSD_Dirty_t *dirty);
 
 /**
  * Flips the display according to the display orientation value in data flash.
@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <Display_SSD.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,6 +48,16 @@ extern "C" {
 #define SSD1327_FUNC_SELECT_B        0xD5
 #define SSD1327_SET_COMMAND_LOCK     0xFD
 
+/**
+ * SPI clock for the SSD1327, in Hz.
+ * The controller allows a 100ns minimum clock cycle. The default
+ * is the fastest PCLK0 (72MHz) divider within that. Can be
+ * overridden at build time.
+ */
+#ifndef DISPLAY_SSD1327_SPI_CLOCK
+#define DISPLAY_SSD1327_SPI_CLOCK 9000000
+#endif
+
 /**
  * Performs the controller power-on sequence.
  */
@@ -58,11 +69,14 @@ void Display_SSD1327_PowerOn();
 void Display_SSD1327_SendInitCmds();
 
 /**
- * Sends the framebuffer to the controller and updates the display.
+ * Sends the dirty part of the framebuffer to the controller
+ * and updates the display.
+ * Each dirty page is sent through its own address window.
  *
  * @param framebuf Framebuffer.
+ * @param dirty    Dirty region.
  */
-void Display_SSD1327_Update(const uint8_t *framebuf);
+void Display_SSD1327_Update(const uint8_t *framebuf, const Display_SSD_Dirty_t *dirty);
 
 /**
  * Flips the display according to the display orientation value in data flash.
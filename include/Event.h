@@ -0,0 +1,145 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_EVENT_H
+#define EVICSDK_EVENT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of queued events.
+ * Must be a power of 2.
+ */
+#define EVENT_QUEUE_SIZE 16
+
+/**
+ * Event types published by the SDK.
+ */
+typedef enum {
+	/**
+	 * A button was pressed or released.
+	 * Data is the new button state (see Button_GetState).
+	 */
+	EVENT_BUTTON = 0,
+	/**
+	 * The atomizer error changed.
+	 * Data is the new Atomizer_Error_t.
+	 */
+	EVENT_ATOMIZER_ERROR,
+	/**
+	 * An atomizer was connected (data is 1) or
+	 * disconnected (data is 0).
+	 */
+	EVENT_ATOMIZER_CONNECT,
+	/**
+	 * The battery was inserted (data is 1) or removed (data is 0).
+	 */
+	EVENT_BATTERY_PRESENCE,
+	/**
+	 * USB was attached (data is 1) or detached (data is 0).
+	 * Only published after USB_VirtualCOM_Init.
+	 */
+	EVENT_USB_ATTACH,
+	/**
+	 * First user-defined event type.
+	 * User events can be posted with Event_Post and
+	 * are always queued, regardless of the event mask.
+	 */
+	EVENT_USER = 32
+} Event_Type_t;
+
+/**
+ * Builds an event mask bit for an SDK event type.
+ */
+#define EVENT_MASK(type) (1UL << (type))
+
+/**
+ * Structure for an event.
+ */
+typedef struct {
+	/**< Event type, Event_Type_t or user-defined. */
+	uint8_t type;
+	/**< Event data, meaning depends on type. */
+	uint16_t data;
+	/**< Uptime when the event was posted, in ms. */
+	uint32_t timestamp;
+} Event_t;
+
+/**
+ * Selects which SDK events are queued.
+ * No SDK events are queued by default, so that
+ * applications not using the queue pay nothing.
+ *
+ * @param mask Bitwise OR of EVENT_MASK(type) for each wanted type.
+ */
+void Event_SetMask(uint32_t mask);
+
+/**
+ * Posts an event to the queue.
+ * This is lock-free and safe to call from any context,
+ * including interrupt handlers of any priority.
+ * SDK event types not in the event mask are discarded.
+ *
+ * @param type Event type.
+ * @param data Event data.
+ *
+ * @return True on success, false if the event was discarded
+ *         or the queue is full.
+ */
+uint8_t Event_Post(uint8_t type, uint16_t data);
+
+/**
+ * Gets the oldest event from the queue, without blocking.
+ * The queue has a single consumer: only call this (and
+ * Event_Wait) from one context, usually the main loop.
+ *
+ * @param event Event structure to fill.
+ *
+ * @return True if an event was fetched, false if the queue is empty.
+ */
+uint8_t Event_Poll(Event_t *event);
+
+/**
+ * Waits for an event and fetches it.
+ * While the queue is empty the device sleeps with Idle_Sleep,
+ * and an event posted just before sleeping is never missed.
+ * Must not be called from interrupt handlers.
+ * To wake up periodically, post a user event from a
+ * software timer (see TimerWheel_CreateTimer).
+ *
+ * @param event Event structure to fill.
+ */
+void Event_Wait(Event_t *event);
+
+/**
+ * Gets the number of events dropped because the queue was full.
+ *
+ * @return Number of dropped events.
+ */
+uint32_t Event_GetDropCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_GPIOINT_H
+#define EVICSDK_GPIOINT_H
+
+#include <M451Series.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of pins with a registered handler.
+ */
+#define GPIOINT_MAX_HANDLERS 8
+
+/**
+ * Function pointer type for GPIO interrupt handlers.
+ * It accepts a user-defined argument. If more than 4 bytes
+ * are needed, a pointer can be stored and then casted.
+ * Handlers are invoked from the GPIO port interrupt handler:
+ * they should be short and must not block.
+ */
+typedef void (*GPIOInt_Callback_t)(uint32_t);
+
+/**
+ * Registers an interrupt handler for a GPIO pin and enables
+ * the pin interrupt. The pin mode (and debounce, if needed)
+ * must be set up by the caller.
+ * The SDK uses this for buttons (PE.0, PD.2, PD.3) and
+ * battery presence (PD.7).
+ * This can be called from interrupt handlers running at
+ * INTERRUPT_PRIO_GPIO or a lower urgency.
+ *
+ * @param port         GPIO port (PA to PF).
+ * @param pin          Pin number (0 to 15).
+ * @param intAttr      Interrupt type, one of GPIO_INT_*.
+ * @param callback     Handler function.
+ * @param callbackData Optional argument to pass to the handler.
+ *
+ * @return A positive index for the handler, or a negative value
+ *         if the port, pin or callback is invalid, there are no
+ *         handler slots available or the pin already has a handler.
+ */
+int8_t GPIOInt_Register(GPIO_T *port, uint8_t pin, uint32_t intAttr, GPIOInt_Callback_t callback, uint32_t callbackData);
+
+/**
+ * Disables a pin interrupt and removes its handler.
+ *
+ * @param port GPIO port (PA to PF).
+ * @param pin  Pin number (0 to 15).
+ */
+void GPIOInt_Unregister(GPIO_T *port, uint8_t pin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
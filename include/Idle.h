@@ -0,0 +1,128 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_IDLE_H
+#define EVICSDK_IDLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Estimated board current while running at 72MHz, in uA.
+ * Used for battery life estimates only, not measured.
+ */
+#define IDLE_CURRENT_RUN_UA 25000
+
+/**
+ * Estimated board current while sleeping (core stopped,
+ * clocks running), in uA. Used for estimates only, not measured.
+ */
+#define IDLE_CURRENT_SLEEP_UA 9000
+
+/**
+ * Maximum time the SDK tick is held back in a single sleep, in ms.
+ * Skipped ticks are caught up on wakeup, so this bounds that work.
+ */
+#define IDLE_MAX_TICKLESS_MS 1000
+
+/**
+ * Structure to hold idle statistics.
+ */
+typedef struct {
+	/**
+	 * Uptime as measured by the SDK clock, in us.
+	 */
+	uint64_t uptime;
+	/**
+	 * Time spent in sleep mode, in us.
+	 */
+	uint64_t sleepTime;
+	/**
+	 * Number of times sleep mode was entered.
+	 */
+	uint32_t sleepCount;
+	/**
+	 * Number of times power-down mode was entered.
+	 * Time spent in power-down is not measured, since
+	 * the SDK clock is paused.
+	 */
+	uint32_t powerDownCount;
+	/**
+	 * Sleep residency: percentage of uptime spent in sleep mode.
+	 */
+	uint8_t sleepPercent;
+} Idle_Stats_t;
+
+/**
+ * Puts the device to sleep until there is something to do.
+ * Call this from your main loop when it has nothing left to do.
+ * It returns after any interrupt has been served.
+ *
+ * The idle manager picks the deepest state that is safe:
+ * - While the atomizer is on, the core just sleeps (WFI).
+ * - Otherwise, the atomizer feedback timer is paused, and the
+ *   SDK tick is held back until the next software timer expiry,
+ *   so the core isn't woken up every millisecond.
+ * - If power-down is enabled, there are no software timers
+ *   pending, no user hardware timers running and USB is not
+ *   attached, the chip enters power-down. It wakes on the fire,
+ *   right and left buttons, on battery presence (PD.7) and,
+ *   if the USB virtual COM is initialized, on USB attach.
+ *
+ * The SDK clock (Timer_GetMicros) pauses during power-down.
+ *
+ * It can be called with PRIMASK set, after checking that there is
+ * nothing to do: an interrupt coming in after the check still wakes
+ * the core. PRIMASK is always cleared on return.
+ */
+void Idle_Sleep();
+
+/**
+ * Enables or disables power-down mode in Idle_Sleep.
+ * It is disabled by default.
+ *
+ * @param isEnabled True to allow power-down, false otherwise.
+ */
+void Idle_SetPowerDownEnabled(uint8_t isEnabled);
+
+/**
+ * Gets idle statistics.
+ *
+ * @param stats Statistics structure to fill.
+ */
+void Idle_GetStats(Idle_Stats_t *stats);
+
+/**
+ * Estimates battery life if the device kept behaving as it did
+ * so far, from the measured sleep residency and the estimated
+ * currents. Since time spent in power-down is not measured, the
+ * estimate is pessimistic when power-down is used.
+ *
+ * @param capacity Battery capacity, in mAh.
+ *
+ * @return Estimated battery life, in hours.
+ */
+uint32_t Idle_GetEstimatedBatteryLife(uint16_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Interrupt priorities and critical sections.
+ * SDK interrupts are spread over the NVIC priority levels so that
+ * the atomizer control loop is never held back by lower urgency work.
+ * Critical sections raise BASEPRI only up to the priority of the
+ * interrupts they guard against, leaving more urgent ones running.
+ * They save and restore BASEPRI, so they can be nested.
+ *
+ * Priority 0 is left free: it can't be masked by BASEPRI, only by
+ * PRIMASK (__set_PRIMASK), which masks everything.
+ */
+
+#ifndef EVICSDK_INTERRUPT_H
+#define EVICSDK_INTERRUPT_H
+
+#include <M451Series.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Priority for the atomizer control loop timer.
+ * This is the most urgent interrupt in the SDK.
+ */
+#define INTERRUPT_PRIO_ATOMIZER 1
+
+/**
+ * Priority for ADC conversions and comparators.
+ */
+#define INTERRUPT_PRIO_ADC 2
+
+/**
+ * Priority for USB.
+ */
+#define INTERRUPT_PRIO_USB 3
+
+/**
+ * Priority for GPIO pins (buttons, battery presence) and brown-out.
+ */
+#define INTERRUPT_PRIO_GPIO 4
+
+/**
+ * Priority for the SDK tick, which also runs software timer callbacks.
+ */
+#define INTERRUPT_PRIO_TICK 5
+
+/**
+ * Default priority for user hardware timers.
+ * Can be changed with Timer_SetPriority.
+ */
+#define INTERRUPT_PRIO_TIMER 6
+
+/**
+ * Lowest priority, used for deferred work (PendSV).
+ */
+#define INTERRUPT_PRIO_LOWEST ((1 << __NVIC_PRIO_BITS) - 1)
+
+/**
+ * Enters a critical section, masking all interrupts with the
+ * specified priority or a lower urgency (higher number).
+ * The mask is only ever raised: if a more restrictive critical
+ * section is already active, it stays in effect.
+ * Use the highest priority among the interrupts that touch the
+ * protected data.
+ *
+ * @param priority Priority to mask, 1 to INTERRUPT_PRIO_LOWEST.
+ *
+ * @return Previous state, to pass to Interrupt_Unlock.
+ */
+static inline uint32_t Interrupt_Lock(uint8_t priority) {
+	uint32_t basepri, newBasepri;
+
+	basepri = __get_BASEPRI();
+	newBasepri = priority << (8 - __NVIC_PRIO_BITS);
+	if(basepri == 0 || newBasepri < basepri) {
+		__set_BASEPRI(newBasepri);
+	}
+
+	return basepri;
+}
+
+/**
+ * Leaves a critical section, restoring the previous state.
+ *
+ * @param state State returned by the matching Interrupt_Lock.
+ */
+static inline void Interrupt_Unlock(uint32_t state) {
+	__set_BASEPRI(state);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_KVSTORE_H
+#define EVICSDK_KVSTORE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of keys. Valid keys go from 0 to KVSTORE_MAX_KEYS - 1.
+ */
+#define KVSTORE_MAX_KEYS 32
+
+/**
+ * Maximum value size, in bytes.
+ * All values at their maximum size must fit in a single flash page.
+ */
+#define KVSTORE_MAX_VALUE_SIZE 32
+
+/**
+ * Default number of flash pages for the store.
+ */
+#define KVSTORE_DEFAULT_PAGE_COUNT 4
+
+/**
+ * Maximum number of flash pages for the store.
+ */
+#define KVSTORE_MAX_PAGE_COUNT 16
+
+/**
+ * Initializes the key/value store.
+ * The store takes pageCount flash pages (2KB each) from the top of
+ * APROM, see Dataflash_AllocPages. Records are appended to one page
+ * at a time, going around the pages in order, so that they all wear
+ * evenly. Every record carries a check word, written last: a record
+ * torn by power loss is ignored, and the previous value is kept.
+ * Keys are looked up through a RAM index.
+ * System control registers don't need to be unlocked.
+ *
+ * @param pageCount Number of flash pages (2 to KVSTORE_MAX_PAGE_COUNT).
+ *
+ * @return True on success, false if pageCount is out of range, or
+ *         the pages would overlap the program image or hold another
+ *         store's data.
+ */
+uint8_t KVStore_Init(uint8_t pageCount);
+
+/**
+ * Reads a value.
+ * Lookup takes constant time.
+ *
+ * @param key   Key to read.
+ * @param value Buffer to fill with the value.
+ * @param size  Buffer size, in bytes. At most this many bytes are read.
+ *
+ * @return Value size, in bytes, or a negative value if the key
+ *         has no value.
+ */
+int8_t KVStore_Get(uint8_t key, void *value, uint8_t size);
+
+/**
+ * Writes a value.
+ * Nothing is written if the value didn't change. This only programs
+ * flash: when a page fills up, writing goes on in the next page, which
+ * was erased beforehand by KVStore_Maintain. Only if that didn't happen
+ * in time, the page is erased here (or, if the atomizer is on, writing
+ * fails). Writing also fails when called from an interrupt that
+ * preempted another flash writer (see Dataflash_BeginWrite).
+ *
+ * @param key   Key to write.
+ * @param value Value to write.
+ * @param size  Value size, in bytes (at most KVSTORE_MAX_VALUE_SIZE).
+ *
+ * @return True on success, false on failure.
+ */
+uint8_t KVStore_Set(uint8_t key, const void *value, uint8_t size);
+
+/**
+ * Deletes a value.
+ *
+ * @param key Key to delete.
+ *
+ * @return True on success, false on failure.
+ */
+uint8_t KVStore_Delete(uint8_t key);
+
+/**
+ * Checks whether some pages are waiting for KVStore_Maintain.
+ *
+ * @return True if maintenance is needed.
+ */
+uint8_t KVStore_NeedsMaintenance();
+
+/**
+ * Erases the flash pages that don't hold live records anymore.
+ * Erasing stalls the CPU (and the atomizer feedback cycle) for about
+ * 20ms per page, so nothing is done while the atomizer is on. Call
+ * this from the main loop when the device is idle.
+ *
+ * @return True if all pages are done, false if maintenance is
+ *         still needed.
+ */
+uint8_t KVStore_Maintain();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
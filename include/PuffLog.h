@@ -0,0 +1,152 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_PUFFLOG_H
+#define EVICSDK_PUFFLOG_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Default number of flash pages for the log.
+ * A typical puff takes about 7 bytes, so each 2KB page holds
+ * around 290 puffs.
+ */
+#define PUFFLOG_DEFAULT_PAGE_COUNT 4
+
+/**
+ * Size of the RAM buffer for records waiting to be written, in bytes.
+ * Records are written to flash in one go when it fills up.
+ */
+#define PUFFLOG_BUFFER_SIZE 128
+
+/**
+ * Structure to hold a puff log entry.
+ */
+typedef struct {
+	/**
+	 * Boot the puff happened in, counting from the first
+	 * boot of the log. Filled in by the log.
+	 */
+	uint16_t boot;
+	/**
+	 * Time since boot, in seconds. Filled in by the log.
+	 */
+	uint32_t time;
+	/**
+	 * Puff duration, in ms. Stored with 100ms resolution.
+	 */
+	uint32_t duration;
+	/**
+	 * Energy delivered to the atomizer, in J.
+	 */
+	uint32_t energy;
+	/**
+	 * Average atomizer resistance, in mOhm.
+	 */
+	uint16_t resistance;
+	/**
+	 * Atomizer error code at the end of the puff (Atomizer_Error_t).
+	 */
+	uint8_t error;
+	/**
+	 * Board temperature at the end of the puff, in °C.
+	 */
+	uint8_t boardTemp;
+} PuffLog_Entry_t;
+
+/**
+ * Structure to hold the state of a log iteration.
+ * Fields are internal.
+ */
+typedef struct {
+	/**< Page being read. */
+	uint8_t page;
+	/**< Number of pages left after this one. */
+	uint8_t pagesLeft;
+	/**< Address of the next record. 0 at the end of the page. */
+	uint32_t addr;
+	/**< Decoder state. */
+	PuffLog_Entry_t state;
+} PuffLog_Iterator_t;
+
+/**
+ * Initializes the puff log, and logs a new boot.
+ * The log takes pageCount flash pages (see Dataflash_AllocPages),
+ * used as a ring: when they are full, the oldest one is erased.
+ * Records are delta and varint encoded, so a puff takes a few bytes.
+ * They are buffered in RAM and written when the buffer fills up, or
+ * on PuffLog_Flush. The buffer survives resets (watchdog, faults,
+ * brown-out): records buffered before one are written here. They
+ * are only lost if power goes away before a flush.
+ *
+ * @param pageCount Number of flash pages (at least 2).
+ *
+ * @return True on success, false if there is no room for the pages
+ *         or they hold another store's data.
+ */
+uint8_t PuffLog_Init(uint8_t pageCount);
+
+/**
+ * Logs a puff. The boot and time fields are filled in here.
+ * This only encodes the puff into the RAM buffer, unless the buffer
+ * is full. If the atomizer is on, flash isn't touched: the puff is
+ * dropped if it doesn't fit in the buffer.
+ * Must not be called from an interrupt handler.
+ *
+ * @param entry Puff to log.
+ *
+ * @return True on success, false if the puff was dropped.
+ */
+uint8_t PuffLog_Append(PuffLog_Entry_t *entry);
+
+/**
+ * Writes the buffered records to flash.
+ * Call this when power is about to go away (e.g. on battery removal).
+ * Must not be called from an interrupt handler.
+ */
+void PuffLog_Flush();
+
+/**
+ * Starts reading the log back, oldest puff first.
+ * Buffered records are flushed first.
+ *
+ * @param it Iterator to initialize.
+ */
+void PuffLog_Begin(PuffLog_Iterator_t *it);
+
+/**
+ * Reads the next puff from the log.
+ * The log must not be written to while iterating.
+ *
+ * @param it    Iterator, initialized with PuffLog_Begin.
+ * @param entry Entry to fill.
+ *
+ * @return True if an entry was read, false at the end of the log.
+ */
+uint8_t PuffLog_Next(PuffLog_Iterator_t *it, PuffLog_Entry_t *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
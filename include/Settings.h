@@ -0,0 +1,120 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_SETTINGS_H
+#define EVICSDK_SETTINGS_H
+
+#include <KVStore.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Time without changes after which settings are written to flash, in ms.
+ */
+#define SETTINGS_COMMIT_DELAY 3000
+
+/**
+ * Structure to hold settings statistics.
+ */
+typedef struct {
+	/**
+	 * Number of Settings_Changed calls.
+	 */
+	uint32_t changeCount;
+	/**
+	 * Number of values written to the key/value store.
+	 */
+	uint32_t writeCount;
+	/**
+	 * Number of flushes on battery removal or brown-out.
+	 */
+	uint32_t powerLossCount;
+} Settings_Stats_t;
+
+/**
+ * Initializes the settings layer and the key/value store under it.
+ * Settings live in RAM, in variables registered by the app. Changes
+ * are written to the store SETTINGS_COMMIT_DELAY after the last one,
+ * from the deferred work queue, so that a burst of button presses
+ * turns into a single write. Old flash pages are also erased then,
+ * unless the atomizer is on.
+ * Pending changes are flushed right away when the battery is removed
+ * (with USB detached) or on brown-out. The brown-out detector is
+ * switched from reset to interrupt mode at 2.7V for this: the low
+ * voltage reset still resets the MCU further down. If that interrupts
+ * another flash write, the flush is retried once the write is done.
+ * Once this is called, the settings layer owns the key/value store:
+ * don't call KVStore functions directly.
+ *
+ * @param pageCount Number of flash pages for the store, see KVStore_Init.
+ *
+ * @return True on success, false if the store couldn't be initialized.
+ */
+uint8_t Settings_Init(uint8_t pageCount);
+
+/**
+ * Registers a setting and loads its stored value.
+ * The variable must stay around as long as the program runs.
+ * If there is no stored value, or its size doesn't match,
+ * the variable is left untouched (keep the default in it).
+ *
+ * @param key  Key in the store (0 to KVSTORE_MAX_KEYS - 1).
+ * @param data Setting variable.
+ * @param size Variable size, in bytes (at most KVSTORE_MAX_VALUE_SIZE).
+ *
+ * @return True if the stored value was loaded, false otherwise.
+ */
+uint8_t Settings_Register(uint8_t key, void *data, uint8_t size);
+
+/**
+ * Marks a setting as changed after updating its variable.
+ * This is cheap: writing happens later.
+ *
+ * @param key Setting key.
+ */
+void Settings_Changed(uint8_t key);
+
+/**
+ * Writes all changed settings to flash right away.
+ * Must not be called from an interrupt handler.
+ */
+void Settings_Flush();
+
+/**
+ * Flushes changed settings when power is going away.
+ * This is called by the battery library on battery removal.
+ * Users must not call it.
+ */
+void Settings_HandlePowerLoss();
+
+/**
+ * Gets the settings statistics, to compare the number of
+ * changes with the number of flash writes.
+ *
+ * @param stats Statistics structure to fill.
+ */
+void Settings_GetStats(Settings_Stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
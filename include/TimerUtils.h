@@ -35,9 +35,36 @@ extern "C" {
  */
 typedef void (*Timer_Callback_t)(uint32_t);
 
+/**
+ * Initializes the SDK clock and tick timer, which also
+ * drives the software timer wheel. TIMER3 is reserved for it.
+ */
+void Timer_Init();
+
+/**
+ * Gets the time elapsed since system init.
+ * The clock is a free-running 1MHz hardware counter, extended
+ * to 64 bits in software. It never wraps in practice.
+ * This is safe to call from any context, including interrupt
+ * handlers and with interrupts disabled.
+ *
+ * @return Uptime, in microseconds.
+ */
+uint64_t Timer_GetMicros();
+
+/**
+ * Gets the time elapsed since system init.
+ * See Timer_GetMicros.
+ *
+ * @return Uptime, in milliseconds.
+ */
+uint64_t Timer_GetMillis();
+
 /**
  * Creates and starts a timer with a specified frequency.
- * There are three timer slots available to users.
+ * There are two hardware timer slots available to users.
+ * For low-rate or numerous timers, use the software timers
+ * in TimerWheel.h instead.
  * For best accuracy, the frequency should be a divisor of 12MHz.
  * If you need a frequency lower than 1Hz or more precise than 1Hz,
  * look at Timer_CreateTimeout.
@@ -56,7 +83,9 @@ int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t cal
 
 /**
  * Creates and starts a timer with a specified period.
- * There are three timer slots available to users.
+ * There are two hardware timer slots available to users.
+ * For millisecond periods, TimerWheel_CreateTimer is usually
+ * a better fit, since it doesn't use up a hardware timer.
  * Even if the timer is one-shot, the slot will only be freed when
  * Timer_DeleteTimer is called.
  *
@@ -70,6 +99,50 @@ int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t cal
  */
 int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData);
 
+/**
+ * Sets whether a timer callback is invoked directly from the
+ * timer interrupt handler (the default), or posted to the deferred
+ * work queue and run from the lowest priority PendSV handler.
+ * Deferred callbacks can be slower without delaying other interrupts,
+ * but they may be dropped if the queue is full.
+ *
+ * @param index      Timer index.
+ * @param isDeferred True to defer the callback, false to invoke it directly.
+ */
+void Timer_SetCallbackDeferred(int8_t index, uint8_t isDeferred);
+
+/**
+ * Sets the interrupt priority of a timer.
+ * Timers are created with INTERRUPT_PRIO_TIMER priority.
+ * See Interrupt.h for the SDK priority plan.
+ *
+ * @param index    Timer index.
+ * @param priority NVIC priority, 0 (most urgent) to INTERRUPT_PRIO_LOWEST.
+ */
+void Timer_SetPriority(int8_t index, uint8_t priority);
+
+/**
+ * Pauses a timer, without freeing its slot.
+ *
+ * @param index Timer index.
+ */
+void Timer_PauseTimer(int8_t index);
+
+/**
+ * Resumes a timer paused by Timer_PauseTimer.
+ *
+ * @param index Timer index.
+ */
+void Timer_ResumeTimer(int8_t index);
+
+/**
+ * Gets which hardware timers are currently running.
+ * The SDK tick timer is not included.
+ *
+ * @return Bitmask of running timers. Bit N is set for timer index N.
+ */
+uint8_t Timer_GetRunningMask();
+
 /**
  * Stops and deletes a timer.
  *
@@ -77,15 +150,42 @@ int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_
  */
 void Timer_DeleteTimer(int8_t index);
 
+/**
+ * Holds back the SDK tick, so that the core isn't woken up every
+ * millisecond while idle. The clock keeps running. Skipped ticks
+ * are all processed when the hold ends, so software timers due
+ * by then fire on time. The hold ends after the given number of
+ * ticks, or earlier when Timer_ResumeTick is called. Timer_ResumeTick
+ * must be called on any wakeup, since a new software timer could
+ * be due before the hold ends.
+ * This is used by the idle manager, see Idle.h.
+ *
+ * @param ticks Number of ticks (ms) to hold back. Keep it well
+ *              below 16s, which is when the hardware counter wraps.
+ */
+void Timer_SuspendTick(uint32_t ticks);
+
+/**
+ * Ends a tick hold started by Timer_SuspendTick, catching up
+ * on all skipped ticks.
+ */
+void Timer_ResumeTick();
+
 /**
  * Delays for the specified time.
+ * The delay is timed by the SDK clock, so SysTick is left free.
+ * The core sleeps (WFI) while waiting, and interrupts keep being
+ * served. Delays under 10us are a calibrated busy-wait. When called
+ * from an interrupt handler, inside Interrupt_Lock or with interrupts
+ * disabled, the delay is always a busy-wait.
  *
- * @param delay Delay in microseconds. Valid range is 0 - 233016.
+ * @param delay Delay in microseconds.
  */
 void Timer_DelayUs(uint32_t delay);
 
 /**
  * Delays for the specified time.
+ * The core sleeps (WFI) while waiting, see Timer_DelayUs.
  *
  * @param delay Delay in milliseconds.
  */
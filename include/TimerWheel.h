@@ -0,0 +1,116 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_TIMERWHEEL_H
+#define EVICSDK_TIMERWHEEL_H
+
+#include <TimerUtils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of software timers available.
+ * Each one takes 20 bytes of RAM.
+ * Two of them are used by the button gesture recognizer.
+ */
+#define TIMERWHEEL_POOL_SIZE 24
+
+/**
+ * Creates and starts a software timer with a specified period.
+ * Software timers are multiplexed over a single 1kHz hardware
+ * tick owned by the SDK, so they don't use up hardware timer
+ * slots. Use Timer_CreateTimer when you need a higher rate.
+ * Callbacks are invoked from the tick interrupt handler, with
+ * the same restrictions as hardware timer callbacks.
+ * Software timer functions can be called from interrupt handlers
+ * running at INTERRUPT_PRIO_GPIO or a lower urgency.
+ * Even if the timer is one-shot, the slot will only be freed when
+ * TimerWheel_DeleteTimer is called. A one-shot timer can be armed
+ * again with TimerWheel_RestartTimer.
+ *
+ * @param timeout      Timer period, in milliseconds. 0 is raised to 1.
+ * @param isPeriodic   True if the timer is periodic, false if one-shot.
+ * @param callback     Timeout callback function.
+ * @param callbackData Optional argument to pass to the callback function.
+ *
+ * @return A positive index for the newly created timer, or a negative
+ *         value if there are no timer slots available.
+ */
+int8_t TimerWheel_CreateTimer(uint32_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData);
+
+/**
+ * Restarts a software timer with a new period.
+ * If the timer is running, it is rescheduled. If it is a one-shot
+ * timer that already fired (or was stopped), it is armed again.
+ * This can be called from the timer callback.
+ *
+ * @param index   Timer index.
+ * @param timeout New timer period, in milliseconds. 0 is raised to 1.
+ */
+void TimerWheel_RestartTimer(int8_t index, uint32_t timeout);
+
+/**
+ * Sets whether a software timer callback is invoked directly from
+ * the tick interrupt handler (the default), or posted to the deferred
+ * work queue. See Timer_SetCallbackDeferred.
+ *
+ * @param index      Timer index.
+ * @param isDeferred True to defer the callback, false to invoke it directly.
+ */
+void TimerWheel_SetCallbackDeferred(int8_t index, uint8_t isDeferred);
+
+/**
+ * Stops a software timer without freeing its slot.
+ * This can be called from the timer callback.
+ *
+ * @param index Timer index.
+ */
+void TimerWheel_StopTimer(int8_t index);
+
+/**
+ * Stops and deletes a software timer.
+ * This can be called from the timer callback.
+ *
+ * @param index Timer index.
+ */
+void TimerWheel_DeleteTimer(int8_t index);
+
+/**
+ * Gets the time until the next software timer expiry.
+ * This is used by the idle manager to know how long it can sleep.
+ *
+ * @return Number of ticks (ms) until the next expiry, or UINT32_MAX
+ *         if no software timer is running.
+ */
+uint32_t TimerWheel_GetNextExpiry();
+
+/**
+ * Advances the wheel by one tick (1ms), firing expired timers.
+ * This is called by the SDK tick interrupt handler.
+ * Users must not call it.
+ */
+void TimerWheel_Tick();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -84,6 +84,15 @@ uint16_t USB_VirtualCOM_Read(uint8_t *buf, uint16_t size);
  */
 void USB_VirtualCOM_SetRxCallback(USB_VirtualCOM_RxCallback_t callbackPtr);
 
+/**
+ * Sets whether the RX callback is invoked directly from the USB
+ * interrupt handler (the default), or posted to the deferred work
+ * queue and run from the lowest priority PendSV handler.
+ *
+ * @param isDeferred True to defer the callback, false to invoke it directly.
+ */
+void USB_VirtualCOM_SetRxCallbackDeferred(uint8_t isDeferred);
+
 /**
  * Sets the sending mode to be synchronous or asynchronous.
  * In synchronous mode, Send() will block until all data is sent.
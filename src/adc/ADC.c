@@ -19,6 +19,7 @@
 
 #include <M451Series.h>
 #include <ADC.h>
+#include <Interrupt.h>
 
 /**
  * \file
@@ -29,6 +30,7 @@
  * 0x0E: temperature
  * 0x12: battery voltage
  * Interrupts 0-3 are assigned in that order.
+ * Result comparators 0-3 also signal on interrupt 3.
  */
 
 /**
@@ -47,24 +49,65 @@ static const uint8_t ADC_moduleNum[4] = {
 static volatile uint16_t ADC_convResult[4] = {0};
 
 /**
- * Convenience macro to define ADC IRQ handlers.
+ * Latched comparator matches.
+ * Bits 0-3 are set when comparators 0-3 match.
+ * Cleared by ADC_FetchCompareFlags().
  */
-#define ADC_DEFINE_IRQ_HANDLER(n) void ADC0 ## n ## _IRQHandler() { \
+static volatile uint8_t ADC_cmpFlags = 0;
+
+/**
+ * Mask for all comparator flags in EADC STATUS2.
+ */
+#define ADC_CMPF_MASK (EADC_STATUS2_ADCMPF0_Msk | EADC_STATUS2_ADCMPF1_Msk | \
+	EADC_STATUS2_ADCMPF2_Msk | EADC_STATUS2_ADCMPF3_Msk)
+
+/**
+ * Convenience macro to handle a conversion end.
+ */
+#define ADC_HANDLE_CONVERSION(n) do { \
 	ADC_convResult[n] = EADC_GET_CONV_DATA(EADC, ADC_moduleNum[n]); \
 	EADC_DISABLE_SAMPLE_MODULE_INT(EADC, n, 1 << ADC_moduleNum[n]); \
 	EADC_CLR_INT_FLAG(EADC, 1 << n); \
+} while(0)
+
+/**
+ * Convenience macro to define ADC IRQ handlers.
+ */
+#define ADC_DEFINE_IRQ_HANDLER(n) void ADC0 ## n ## _IRQHandler() { \
+	ADC_HANDLE_CONVERSION(n); \
 }
 
 ADC_DEFINE_IRQ_HANDLER(0);
 ADC_DEFINE_IRQ_HANDLER(1);
 ADC_DEFINE_IRQ_HANDLER(2);
-ADC_DEFINE_IRQ_HANDLER(3);
+
+/**
+ * ADC interrupt 3 handler.
+ * Shared between the VBAT conversion and the result comparators.
+ * This is an internal function.
+ */
+void ADC03_IRQHandler() {
+	uint32_t cmpFlags;
+
+	// Latch and clear comparator matches
+	cmpFlags = EADC_GET_INT_FLAG(EADC, ADC_CMPF_MASK);
+	if(cmpFlags) {
+		ADC_cmpFlags |= cmpFlags >> EADC_STATUS2_ADCMPF0_Pos;
+		EADC_CLR_INT_FLAG(EADC, cmpFlags);
+	}
+
+	if(EADC_GET_INT_FLAG(EADC, 1 << 3)) {
+		ADC_HANDLE_CONVERSION(3);
+	}
+}
 
 void ADC_UpdateCache(const uint8_t moduleNum[], uint8_t len, uint8_t isBlocking) {
+	uint32_t lock;
 	uint8_t i, j, finishFlag;
 
 	// Enter critical section
-	__set_PRIMASK(1);
+	// The atomizer control loop calls this too, so mask it
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
 
 	for(i = 0; i < len; i++) {
 		// Find interrupt number for module number
@@ -84,7 +127,7 @@ void ADC_UpdateCache(const uint8_t moduleNum[], uint8_t len, uint8_t isBlocking)
 	}
 
 	// Exit critical section
-	__set_PRIMASK(0);
+	Interrupt_Unlock(lock);
 
 	if(isBlocking) {
 		// Wait for modules to finish
@@ -141,10 +184,50 @@ void ADC_Init() {
 	// Enable interrupts
 	for(i = 0; i < 4; i++) {
 		EADC_ENABLE_INT(EADC, 1 << i);
+		NVIC_SetPriority(irqNum[i], INTERRUPT_PRIO_ADC);
 		NVIC_EnableIRQ(irqNum[i]);
 	}
 }
 
+void ADC_EnableCompare(uint8_t cmpNum, uint8_t moduleNum, uint8_t condition, uint16_t value, uint8_t matchCount) {
+	if(cmpNum > 3 || matchCount == 0 || matchCount > 16) {
+		// Invalid comparator or match count
+		return;
+	}
+
+	// Configure and enable comparator with interrupt
+	EADC->CMP[cmpNum] = (moduleNum << EADC_CMP_CMPSPL_Pos) |
+		(condition == ADC_CMP_LESS_THAN ? EADC_CMP_CMPCOND_LESS_THAN : EADC_CMP_CMPCOND_GREATER_OR_EQUAL) |
+		((value & 0xFFF) << EADC_CMP_CMPDAT_Pos) |
+		((matchCount - 1) << EADC_CMP_CMPMCNT_Pos) |
+		EADC_CMP_ADCMPIE_Msk | EADC_CMP_ADCMPEN_Msk;
+}
+
+void ADC_DisableCompare(uint8_t cmpNum) {
+	if(cmpNum > 3) {
+		// Invalid comparator
+		return;
+	}
+
+	EADC->CMP[cmpNum] = 0;
+	EADC_CLR_INT_FLAG(EADC, EADC_STATUS2_ADCMPF0_Msk << cmpNum);
+	ADC_cmpFlags &= ~(1 << cmpNum);
+}
+
+uint8_t ADC_FetchCompareFlags() {
+	uint32_t lock;
+	uint8_t flags;
+
+	// Read and clear in critical section
+	// The atomizer control loop calls this too, so mask it
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	flags = ADC_cmpFlags;
+	ADC_cmpFlags = 0;
+	Interrupt_Unlock(lock);
+
+	return flags;
+}
+
 uint16_t ADC_Read(uint8_t moduleNum) {
 	ADC_UpdateCache((uint8_t []) {moduleNum}, 1, 1);
 	return ADC_GetCachedResult(moduleNum);
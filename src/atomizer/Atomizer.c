@@ -25,6 +25,10 @@
 #include <Dataflash.h>
 #include <Globals.h>
 #include <Battery.h>
+#include <Button.h>
+#include <Event.h>
+#include <Interrupt.h>
+#include <BlackBox.h>
 
 /**
  * \file
@@ -71,38 +75,85 @@
 // To get 1ohm accuracy and save a multiplication, ADC_VREF and ADC_DENOMINATOR are hardcoded.
 // Maximum result size: 17 bits.
 #define ATOMIZER_ADC_THERMRES(x) (20000L * (x) / (5280L - (x)))
+// Resistance window checks, without the division in ATOMIZER_ADC_RESISTANCE.
+// num is voltsX * Atomizer_resFactor, currX must not be zero.
+// Since ATOMIZER_ADC_RESISTANCE(voltsX, currX) == num / (3 * currX),
+// the result is below res iff num < 3 * res * currX.
+// Maximum intermediate size: 30 bits.
+#define ATOMIZER_ADC_RES_BELOW(num, currX, res) ((num) < 3UL * (res) * (currX))
 // Battery is weak when < 2.8V under load, i.e. ADC value < 2240.
-#define ATOMIZER_ADC_WEAKBATT(x) ((x) < 2240)
+// Checked in hardware by ATOMIZER_ADC_CMP_WEAKBATT.
+#define ATOMIZER_ADC_WEAKBATT_THRESHOLD 2240
 // Board temperature limit is 70°C.
-// Simplified from: ATOMIZER_ADC_THERMRES(x) <= Atomizer_boardTempTable[14]
-#define ATOMIZER_ADC_OVERTEMP(x) (41L * (x) <= 16480L)
+// Simplified from: ATOMIZER_ADC_THERMRES(x) <= Atomizer_boardTempTable[14],
+// i.e. 41 * x <= 16480, i.e. ADC value < 402.
+// Checked in hardware by ATOMIZER_ADC_CMP_OVERTEMP.
+#define ATOMIZER_ADC_OVERTEMP_THRESHOLD 402
 // Board temperature limit for actualizing tc res is 25°C(+5°C vs TC coil temp ref)
 // Simplified from: ATOMIZER_ADC_THERMRES(x) <= Atomizer_boardTempTable[5]
 #define ATOMIZER_ADC_TCTEMP(x) (41L * (x) <= 100000L)
-// This assumes a battery internal resistance of 10mOhm (which is pretty low).
-// It takes the target output voltage in 10mV units, the atomizer resistance in mOhm and
-// the battery voltage in mV. The battery is weak if it's under 3.1V, or if it's expected
-// to sag below 2.8V under load (only checked if res != 0).
-#define ATOMIZER_PREDICT_WEAKBATT(targetVolts, res, battVolts) ((battVolts) < 3100 || \
-	((res) != 0 && (battVolts) - (targetVolts) * 10L / (res) < 2800))
-
+// Derating starts when the battery is < 2.9V under load, i.e. ADC value < 2320.
+// It recovers when the battery is > 2.95V, i.e. ADC value > 2360.
+#define ATOMIZER_ADC_DERATE_BATT_LOW 2320
+#define ATOMIZER_ADC_DERATE_BATT_HIGH 2360
+// Derating starts when the board is over 60°C.
+// From ATOMIZER_ADC_THERMRES(x) <= Atomizer_boardTempTable[12], i.e. ADC value < 557.
+#define ATOMIZER_ADC_DERATE_TEMP 557
+// Derating factors scale the target voltage, 65536 is 1.
+// The minimum factor (50%, i.e. 25% power) is kept until a hard limit is hit.
+#define ATOMIZER_DERATE_ONE 65536UL
+#define ATOMIZER_DERATE_MIN (ATOMIZER_DERATE_ONE / 2)
+// Battery derating steps per feedback iteration.
+// Full range takes 20ms down and 650ms up.
+#define ATOMIZER_DERATE_STEP_DOWN 64
+#define ATOMIZER_DERATE_STEP_UP 2
+// Estimated DC/DC converter efficiency, in percent
+#define ATOMIZER_CONVERTER_EFFICIENCY 90
+// Battery voltage under which the battery is weak when idle, in mV
+#define ATOMIZER_WEAKBATT_IDLE_VOLTS 3100
+// Battery voltage the battery must not sag below under load, in mV
+#define ATOMIZER_WEAKBATT_LOAD_VOLTS 2800
+// Feedback iterations into a fire before the loaded battery voltage
+// is sampled for internal resistance estimation (100ms)
+#define ATOMIZER_RINT_SAMPLE_TICKS 2500
+// Minimum battery current for an internal resistance sample, in mA.
+// Below this the voltage drop is lost in ADC noise.
+#define ATOMIZER_RINT_MIN_CURRENT 1000
+// Feedback iterations between black box samples (1ms)
+#define ATOMIZER_BLACKBOX_SAMPLE_TICKS 25
+
+// Converts the battery charge accumulator to mAs.
+// Each feedback iteration counts for 64 * V * I / VBAT (ADC readings).
+// With ATOMIZER_ADC_VOLTAGE/CURRENT and the 1:2 VBAT divider, over a
+// 40us iteration that is 130 * 625 * 4e-5 / (60 * 64 * shuntRes) mAs,
+// i.e. 3.25 / (3840 * shuntRes) mAs per unit. Dividing by the converter
+// efficiency (as a fraction) gives the battery side charge.
+#define ATOMIZER_CHARGE_MAS(acc) ((acc) * 325ULL / \
+	(3840ULL * Atomizer_shuntRes * ATOMIZER_CONVERTER_EFFICIENCY))
+
+// ADC comparators used for weak battery and over temperature
+#define ATOMIZER_ADC_CMP_WEAKBATT 0
+#define ATOMIZER_ADC_CMP_OVERTEMP 1
 
 // Timer flags
 #define ATOMIZER_TMRFLAG_WARMUP (1 << 0)
 #define ATOMIZER_TMRFLAG_REFRESH (1 << 1)
-#define ATOMIZER_TIMER_WARMUP_RESET() do { __set_PRIMASK(1); \
+#define ATOMIZER_TIMER_WARMUP_RESET() do { \
+	uint32_t lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER); \
 	Atomizer_timerCountWarmup = 0; \
 	Atomizer_timerFlag &= ~ATOMIZER_TMRFLAG_WARMUP; \
-	__set_PRIMASK(0); } while(0)
-#define ATOMIZER_TIMER_REFRESH_RESET() do { __set_PRIMASK(1); \
+	Interrupt_Unlock(lock); } while(0)
+#define ATOMIZER_TIMER_REFRESH_RESET() do { \
+	uint32_t lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER); \
 	Atomizer_timerCountRefresh = 0; \
 	Atomizer_timerFlag &= ~ATOMIZER_TMRFLAG_REFRESH; \
-	__set_PRIMASK(0); } while(0)
-#define ATOMIZER_TIMER_RESET() do { __set_PRIMASK(1); \
+	Interrupt_Unlock(lock); } while(0)
+#define ATOMIZER_TIMER_RESET() do { \
+	uint32_t lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER); \
 	Atomizer_timerCountWarmup = 0; \
 	Atomizer_timerCountRefresh = 0; \
 	Atomizer_timerFlag = 0; \
-	__set_PRIMASK(0); } while(0)
+	Interrupt_Unlock(lock); } while(0)
 
 // Busy wait for warmup or error
 #define ATOMIZER_WAIT_WARMUP() do {} while(!(Atomizer_timerFlag & ATOMIZER_TMRFLAG_WARMUP) && Atomizer_error == OK)
@@ -133,11 +184,119 @@ static volatile Atomizer_ConverterState_t Atomizer_curState = POWEROFF;
  */
 static uint8_t Atomizer_shuntRes;
 
+/**
+ * Index of the feedback cycle timer.
+ */
+static int8_t Atomizer_timerIndex = -1;
+
+/**
+ * True if the feedback cycle timer is paused by Atomizer_Suspend.
+ */
+static volatile uint8_t Atomizer_isSuspended;
+
+/**
+ * Resistance numerator factor, 13 * Atomizer_shuntRes.
+ * See ATOMIZER_ADC_RES_BELOW.
+ */
+static uint16_t Atomizer_resFactor;
+
 /**
  * Error code.
  */
 static volatile Atomizer_Error_t Atomizer_error;
 
+/**
+ * Structure for the feedback cycle state snapshot.
+ * This is an internal structure.
+ */
+typedef struct {
+	/**< Raw atomizer voltage ADC reading. */
+	uint16_t adcVoltage;
+	/**< Raw atomizer current ADC reading. */
+	uint16_t adcCurrent;
+	/**< Converter state. */
+	Atomizer_ConverterState_t state;
+	/**< Error code. */
+	Atomizer_Error_t error;
+	/**< Derating factor, see ATOMIZER_DERATE_ONE. */
+	uint32_t derateFactor;
+	/**< Derating reason. */
+	Atomizer_DerateReason_t derateReason;
+} Atomizer_Snapshot_t;
+
+/**
+ * Snapshot of the last feedback iteration while firing.
+ * Protected by Atomizer_snapshotSeq (sequence lock).
+ */
+static Atomizer_Snapshot_t Atomizer_snapshot;
+
+/**
+ * Snapshot sequence number. Odd while the snapshot is being written.
+ */
+static volatile uint32_t Atomizer_snapshotSeq;
+
+/**
+ * Sum of V * I (ADC readings) over the feedback iterations since
+ * the last Atomizer_FetchBatteryCharge.
+ * Only written by the feedback cycle.
+ */
+static volatile uint64_t Atomizer_powerAcc;
+
+/**
+ * Sum of the battery voltage ADC readings over the same iterations.
+ * Only written by the feedback cycle.
+ */
+static volatile uint64_t Atomizer_battAcc;
+
+/**
+ * Number of feedback iterations summed in the accumulators above.
+ * Only written by the feedback cycle.
+ */
+static volatile uint32_t Atomizer_chargeTicks;
+
+/**
+ * Battery charge accumulator, see ATOMIZER_CHARGE_MAS.
+ * Only used by Atomizer_FetchBatteryCharge.
+ */
+static uint64_t Atomizer_chargeAcc;
+
+/**
+ * Battery charge already returned by Atomizer_FetchBatteryCharge, in mAs.
+ */
+static uint64_t Atomizer_chargeFetched;
+
+/**
+ * Battery derating factor, see ATOMIZER_DERATE_ONE.
+ * Only written by the feedback cycle while firing.
+ */
+static volatile uint32_t Atomizer_derateBatt;
+
+/**
+ * Overall derating factor, see ATOMIZER_DERATE_ONE.
+ */
+static volatile uint32_t Atomizer_derateFactor;
+
+/**
+ * Derating reason.
+ */
+static volatile Atomizer_DerateReason_t Atomizer_derateReason;
+
+/**
+ * True if the fire button directly powers the atomizer.
+ */
+static volatile uint8_t Atomizer_isFireOnButton;
+
+/**
+ * True while the main loop powers the atomizer for a measurement.
+ * The fire button handler leaves the atomizer alone meanwhile.
+ */
+static volatile uint8_t Atomizer_isMeasuring;
+
+/**
+ * Last error code published to the event queue.
+ */
+static volatile Atomizer_Error_t Atomizer_publishedError;
+
 /**
  * Initial atomizer resistance, in mOhm.
  * If an atomizer error occurs, this is set to zero.
@@ -170,6 +329,30 @@ static volatile uint16_t Atomizer_tempTargetVolts;
  */
 static volatile uint8_t Atomizer_timerCountWarmup;
 
+/**
+ * Load timer counter, for internal resistance sampling.
+ * Each tick is 40us. Counts up to ATOMIZER_RINT_SAMPLE_TICKS and stops.
+ */
+static volatile uint16_t Atomizer_timerCountLoad;
+
+/**
+ * Black box timer counter. Each tick is 40us.
+ * Counts up to ATOMIZER_BLACKBOX_SAMPLE_TICKS and wraps.
+ */
+static uint8_t Atomizer_timerCountBlackBox;
+
+/**
+ * Weak references, so that the black box is only
+ * linked in if the app uses it.
+ */
+void BlackBox_Record(const BlackBox_Sample_t *sample) __attribute__((weak));
+void BlackBox_Trigger(BlackBox_Reason_t reason) __attribute__((weak));
+
+/**
+ * Battery voltage right before the current fire, in mV.
+ */
+static volatile uint16_t Atomizer_idleBattVolts;
+
 /**
  * Refresh timer counter. Each tick is 40us.
  * Counts up to 5000 (200ms) and stops.
@@ -267,14 +450,243 @@ static void Atomizer_ConfigureConverters(uint8_t enableBuck, uint8_t enableBoost
 	}
 }
 
+/**
+ * Gets the battery current needed for an output power.
+ * This is an internal function.
+ *
+ * @param power     Output power, in mW.
+ * @param battVolts Battery voltage, in mV.
+ *
+ * @return Battery current, in mA.
+ */
+static uint32_t Atomizer_GetBatteryCurrent(uint32_t power, uint16_t battVolts) {
+	if(battVolts == 0) {
+		return 0;
+	}
+
+	// mW / mV = A, account for converter losses
+	return power * 1000 / battVolts * 100 / ATOMIZER_CONVERTER_EFFICIENCY;
+}
+
+/**
+ * Predicts whether firing would trip the weak battery check.
+ * The battery is weak if it's under ATOMIZER_WEAKBATT_IDLE_VOLTS, or if
+ * it's expected to sag below ATOMIZER_WEAKBATT_LOAD_VOLTS under load,
+ * going by the estimated battery internal resistance (only checked if
+ * the atomizer resistance is known).
+ * This is an internal function.
+ *
+ * @param targetVolts Target output voltage, in 10mV units.
+ * @param res         Atomizer resistance, in mOhm.
+ * @param battVolts   Idle battery voltage, in mV.
+ *
+ * @return True if the battery is weak.
+ */
+static uint8_t Atomizer_PredictWeakBattery(uint16_t targetVolts, uint16_t res, uint16_t battVolts) {
+	uint32_t power, sag;
+
+	if(battVolts < ATOMIZER_WEAKBATT_IDLE_VOLTS) {
+		return 1;
+	}
+	if(res == 0) {
+		return 0;
+	}
+
+	// P = V^2 / R, mV^2 / mOhm = mW
+	power = (uint32_t) targetVolts * 10 * targetVolts * 10 / res;
+	sag = Atomizer_GetBatteryCurrent(power, battVolts) * Battery_GetInternalResistance() / 1000;
+
+	return battVolts < ATOMIZER_WEAKBATT_LOAD_VOLTS + sag;
+}
+
+/**
+ * Takes a battery internal resistance sample while firing.
+ * Compares the loaded battery voltage against the idle one.
+ * This is an internal function.
+ *
+ * @param adcVoltage   Raw atomizer voltage ADC reading.
+ * @param adcCurrent   Raw atomizer current ADC reading.
+ * @param adcBattVolts Raw battery voltage ADC reading.
+ */
+static void Atomizer_SampleInternalResistance(uint16_t adcVoltage, uint16_t adcCurrent, uint16_t adcBattVolts) {
+	uint32_t power, current;
+	uint16_t loadVolts;
+
+	loadVolts = adcBattVolts * 2L * ADC_VREF / ADC_DENOMINATOR;
+	power = ATOMIZER_ADC_VOLTAGE(adcVoltage) * 10 * ATOMIZER_ADC_CURRENT(adcCurrent) / 1000;
+	current = Atomizer_GetBatteryCurrent(power, loadVolts);
+
+	if(current >= ATOMIZER_RINT_MIN_CURRENT && loadVolts < Atomizer_idleBattVolts) {
+		Battery_UpdateInternalResistance(Atomizer_idleBattVolts - loadVolts, current);
+	}
+}
+
+/**
+ * Publishes atomizer error transitions to the event queue.
+ * Only call this where the error code is settled: the feedback
+ * cycle clears it at every iteration before re-checking.
+ * An atomizer is reported as connected when leaving OPEN,
+ * and as disconnected when entering it.
+ * This is an internal function.
+ */
+static void Atomizer_PublishError() {
+	Atomizer_Error_t error;
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	error = Atomizer_GetError();
+	if(error != Atomizer_publishedError) {
+		if((error == OPEN) != (Atomizer_publishedError == OPEN)) {
+			Event_Post(EVENT_ATOMIZER_CONNECT, error != OPEN);
+		}
+		Event_Post(EVENT_ATOMIZER_ERROR, error);
+		Atomizer_publishedError = error;
+	}
+	Interrupt_Unlock(lock);
+}
+
+/**
+ * Publishes a feedback cycle snapshot.
+ * Writers run at atomizer priority (from the feedback cycle, or
+ * under an atomizer lock), so they never overlap, and they never
+ * have to wait for readers.
+ * This is an internal function.
+ *
+ * @param adcVoltage Raw atomizer voltage ADC reading.
+ * @param adcCurrent Raw atomizer current ADC reading.
+ */
+static void Atomizer_PublishSnapshot(uint16_t adcVoltage, uint16_t adcCurrent) {
+	Atomizer_snapshotSeq++;
+	__DMB();
+	Atomizer_snapshot.adcVoltage = adcVoltage;
+	Atomizer_snapshot.adcCurrent = adcCurrent;
+	Atomizer_snapshot.state = Atomizer_curState;
+	Atomizer_snapshot.error = Atomizer_error;
+	Atomizer_snapshot.derateFactor = Atomizer_derateFactor;
+	Atomizer_snapshot.derateReason = Atomizer_derateReason;
+	__DMB();
+	Atomizer_snapshotSeq++;
+}
+
+/**
+ * Reads a consistent feedback cycle snapshot, retrying if the
+ * feedback cycle updated it in the meantime. Interrupts are
+ * never disabled. Must not be called from the feedback cycle.
+ * This is an internal function.
+ *
+ * @param snapshot Snapshot structure to fill.
+ */
+static void Atomizer_ReadSnapshot(Atomizer_Snapshot_t *snapshot) {
+	uint32_t seq;
+
+	do {
+		seq = Atomizer_snapshotSeq;
+		__DMB();
+		*snapshot = Atomizer_snapshot;
+		__DMB();
+	} while((seq & 1) || seq != Atomizer_snapshotSeq);
+}
+
+/**
+ * Records a feedback iteration in the black box, once every
+ * ATOMIZER_BLACKBOX_SAMPLE_TICKS iterations or right away on error.
+ * Errors other than OPEN freeze the black box for a dump.
+ * This is an internal function.
+ *
+ * @param adcVoltage   Raw atomizer voltage ADC reading.
+ * @param adcCurrent   Raw atomizer current ADC reading.
+ * @param adcBattVolts Raw battery voltage ADC reading.
+ * @param adcBoardTemp Raw board temperature ADC reading.
+ */
+static void Atomizer_RecordBlackBox(uint16_t adcVoltage, uint16_t adcCurrent, uint16_t adcBattVolts, uint16_t adcBoardTemp) {
+	BlackBox_Sample_t sample;
+
+	if(!BlackBox_Record) {
+		return;
+	}
+
+	if(++Atomizer_timerCountBlackBox < ATOMIZER_BLACKBOX_SAMPLE_TICKS && Atomizer_error == OK) {
+		return;
+	}
+	Atomizer_timerCountBlackBox = 0;
+
+	sample.time = Timer_GetMillis();
+	sample.voltage = ATOMIZER_ADC_VOLTAGE(adcVoltage) * 10;
+	sample.current = ATOMIZER_ADC_CURRENT(adcCurrent);
+	sample.resistance = ATOMIZER_ADC_RESISTANCE(adcVoltage, adcCurrent);
+	sample.battVolts = adcBattVolts * 2L * ADC_VREF / ADC_DENOMINATOR;
+	sample.adcBoardTemp = adcBoardTemp;
+	sample.cmr = Atomizer_curCmr;
+	sample.state = Atomizer_curState;
+	sample.error = Atomizer_error;
+	BlackBox_Record(&sample);
+
+	if(Atomizer_error != OK && Atomizer_error != OPEN) {
+		BlackBox_Trigger(BLACKBOX_ATOMIZER_ERROR);
+	}
+}
+
+/**
+ * Updates the derating factors and applies them to the target voltage.
+ * The battery voltage responds to the setpoint right away, so the
+ * battery factor is integrated to keep it around the derating threshold.
+ * The board temperature lags behind, so the temperature factor is
+ * scaled linearly between the derating and over temperature thresholds.
+ * This is an internal function.
+ *
+ * @param adcBattVolts Raw battery voltage ADC reading.
+ * @param adcBoardTemp Raw board temperature ADC reading.
+ *
+ * @return Derated target voltage, in 10mV units.
+ */
+static uint16_t Atomizer_Derate(uint16_t adcBattVolts, uint16_t adcBoardTemp) {
+	uint32_t factor, tempFactor;
+	Atomizer_DerateReason_t reason;
+
+	if(adcBattVolts < ATOMIZER_ADC_DERATE_BATT_LOW) {
+		Atomizer_derateBatt = Atomizer_derateBatt > ATOMIZER_DERATE_MIN + ATOMIZER_DERATE_STEP_DOWN ?
+			Atomizer_derateBatt - ATOMIZER_DERATE_STEP_DOWN : ATOMIZER_DERATE_MIN;
+	}
+	else if(adcBattVolts > ATOMIZER_ADC_DERATE_BATT_HIGH) {
+		Atomizer_derateBatt = Atomizer_derateBatt < ATOMIZER_DERATE_ONE - ATOMIZER_DERATE_STEP_UP ?
+			Atomizer_derateBatt + ATOMIZER_DERATE_STEP_UP : ATOMIZER_DERATE_ONE;
+	}
+
+	// Thermistor readings go down as temperature goes up
+	if(adcBoardTemp >= ATOMIZER_ADC_DERATE_TEMP) {
+		tempFactor = ATOMIZER_DERATE_ONE;
+	}
+	else if(adcBoardTemp <= ATOMIZER_ADC_OVERTEMP_THRESHOLD) {
+		tempFactor = ATOMIZER_DERATE_MIN;
+	}
+	else {
+		tempFactor = ATOMIZER_DERATE_MIN + (ATOMIZER_DERATE_ONE - ATOMIZER_DERATE_MIN) *
+			(adcBoardTemp - ATOMIZER_ADC_OVERTEMP_THRESHOLD) /
+			(ATOMIZER_ADC_DERATE_TEMP - ATOMIZER_ADC_OVERTEMP_THRESHOLD);
+	}
+
+	factor = Atomizer_derateBatt;
+	reason = factor < ATOMIZER_DERATE_ONE ? DERATE_WEAK_BATT : DERATE_NONE;
+	if(tempFactor < factor) {
+		factor = tempFactor;
+		reason = DERATE_OVER_TEMP;
+	}
+
+	Atomizer_derateFactor = factor;
+	Atomizer_derateReason = reason;
+
+	return (uint32_t) Atomizer_targetVolts * factor >> 16;
+}
+
 /**
  * Negative feedback iteration to keep the DC/DC converters stable.
  * Takes parameters as a timer callback.
  * This is an internal function.
  */
 static void Atomizer_NegativeFeedback(uint32_t unused) {
-	uint16_t adcVoltage, adcCurrent, adcBattery, adcBoardTemp, curVolts;
-	uint32_t resistance;
+	uint16_t adcVoltage, adcCurrent, adcBoardTemp, adcBattVolts, curVolts, targetVolts;
+	uint32_t resNum;
+	uint8_t cmpFlags;
 	Atomizer_ConverterState_t nextState;
 
 	// Update ADC cache without blocking.
@@ -286,6 +698,14 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
 		ADC_MODULE_VBAT, ADC_MODULE_TEMP
 	}, 4, 0);
 
+	// Fetch comparator matches on every tick, so that
+	// matches latched while powered off are discarded.
+	cmpFlags = ADC_FetchCompareFlags();
+
+	// Keep the battery voltage filters going
+	adcBattVolts = ADC_GetCachedResult(ADC_MODULE_VBAT);
+	Battery_UpdateVoltage(adcBattVolts, Atomizer_curState != POWEROFF);
+
 	if(Atomizer_timerCountRefresh != 5000) {
 		Atomizer_timerCountRefresh++;
 	}
@@ -307,29 +727,34 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
 	// Get ADC readings
 	adcVoltage = ADC_GetCachedResult(ADC_MODULE_VATM);
 	adcCurrent = ADC_GetCachedResult(ADC_MODULE_CURS);
-	adcBattery = ADC_GetCachedResult(ADC_MODULE_VBAT);
 	adcBoardTemp = ADC_GetCachedResult(ADC_MODULE_TEMP);
 
+	// Weak battery and over temperature are checked by the
+	// ADC comparators, we only need to look at the flags.
 	Atomizer_error = OK;
-	if(ATOMIZER_ADC_OVERTEMP(adcBoardTemp)) {
+	if(cmpFlags & (1 << ATOMIZER_ADC_CMP_OVERTEMP)) {
 		Atomizer_error = OVER_TEMP;
 	}
-	else if(ATOMIZER_ADC_WEAKBATT(adcBattery)) {
+	else if(cmpFlags & (1 << ATOMIZER_ADC_CMP_WEAKBATT)) {
 		Atomizer_error = WEAK_BATT;
 	}
 	else if(Atomizer_timerCountWarmup > 25) {
 		// Start checking resistance after 1ms
-		resistance = ATOMIZER_ADC_RESISTANCE(adcVoltage, adcCurrent);
-		if(resistance >= 5 && resistance < 40) {
+		// Same as ATOMIZER_ADC_RESISTANCE, current is forced to 1 if zero
+		if(adcCurrent == 0) {
+			adcCurrent = 1;
+		}
+		resNum = (uint32_t) adcVoltage * Atomizer_resFactor;
+		if(!ATOMIZER_ADC_RES_BELOW(resNum, adcCurrent, 5) && ATOMIZER_ADC_RES_BELOW(resNum, adcCurrent, 40)) {
 			Atomizer_error = SHORT;
 		}
-		else if(resistance > 50000) {
+		else if(!ATOMIZER_ADC_RES_BELOW(resNum, adcCurrent, 50001)) {
 			Atomizer_error = OPEN;
 		}
     Board_above_TC_temp = ATOMIZER_ADC_TCTEMP(adcBoardTemp);
   	//Test for TC coils : keep an alive res
     if (Atomizer_error != OPEN && Atomizer_error != SHORT) {
-      Atomizer_tempTCRes = resistance;
+      Atomizer_tempTCRes = ATOMIZER_ADC_RESISTANCE(adcVoltage, adcCurrent);
       //if (Atomizer_baseRes > resistance && Board_above_TC_temp) {
         //Atomizer_baseRes = resistance;//tempRes should descrease while poweroff except if board is less than 25°
       //}
@@ -338,24 +763,48 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
   
   
   
+	Atomizer_RecordBlackBox(adcVoltage, adcCurrent, adcBattVolts, adcBoardTemp);
+
 	if(Atomizer_error != OK) {
 		if (Atomizer_error == OPEN || Atomizer_error == SHORT) {
       Atomizer_baseRes = 0;
     }
  		Atomizer_tempRes = 0;
 		Atomizer_Control(0);
+		Atomizer_PublishSnapshot(adcVoltage, adcCurrent);
+		Atomizer_PublishError();
 		return;
 	}
 
+	// Scale the setpoint down before hitting the hard limits
+	targetVolts = Atomizer_Derate(adcBattVolts, adcBoardTemp);
+
+	Atomizer_PublishSnapshot(adcVoltage, adcCurrent);
+
+	// Count battery charge for the state of charge estimator.
+	// Battery current is output power over battery voltage: the
+	// division is left to Atomizer_FetchBatteryCharge.
+	if(adcBattVolts != 0) {
+		Atomizer_powerAcc += (uint32_t) adcVoltage * adcCurrent;
+		Atomizer_battAcc += adcBattVolts;
+		Atomizer_chargeTicks++;
+	}
+
+	// Sample internal resistance once per fire, after settling
+	if(Atomizer_timerCountLoad != ATOMIZER_RINT_SAMPLE_TICKS &&
+		++Atomizer_timerCountLoad == ATOMIZER_RINT_SAMPLE_TICKS) {
+		Atomizer_SampleInternalResistance(adcVoltage, adcCurrent, adcBattVolts);
+	}
+
 	curVolts = ATOMIZER_ADC_VOLTAGE(adcVoltage);
-	if(curVolts == Atomizer_targetVolts) {
+	if(curVolts == targetVolts) {
 		// Target reached, nothing to do
 		return;
 	}
 
 	nextState = Atomizer_curState;
 
-	if(curVolts < Atomizer_targetVolts) {
+	if(curVolts < targetVolts) {
 		if(Atomizer_curState == POWERON_BUCK) {
 			if(Atomizer_curCmr == 479) {
 				// Reached maximum for buck, switch to boost
@@ -442,6 +891,8 @@ void Atomizer_Init() {
     //by default, setting 115 as for Evic
     Atomizer_shuntRes = 115;
   }
+	Atomizer_resFactor = 13 * Atomizer_shuntRes;
+
 	// Setup control pins
 	PC1 = 0;
 	GPIO_SetMode(PC, BIT1, GPIO_MODE_OUTPUT);
@@ -473,10 +924,41 @@ void Atomizer_Init() {
 	Atomizer_tempRes = 0;
 	ATOMIZER_TIMER_RESET();
 
+	// Let the ADC comparators watch for weak battery and over temperature.
+	// They check every conversion the feedback cycle triggers, and we
+	// only need to look at the flags.
+	ADC_EnableCompare(ATOMIZER_ADC_CMP_WEAKBATT, ADC_MODULE_VBAT, ADC_CMP_LESS_THAN,
+		ATOMIZER_ADC_WEAKBATT_THRESHOLD, 1);
+	ADC_EnableCompare(ATOMIZER_ADC_CMP_OVERTEMP, ADC_MODULE_TEMP, ADC_CMP_LESS_THAN,
+		ATOMIZER_ADC_OVERTEMP_THRESHOLD, 1);
+
 	// Setup 25kHz timer for negative feedback cycle
 	// This function should run during system init, so
 	// the user hasn't had time to create timers yet.
-	Timer_CreateTimer(25000, 1, Atomizer_NegativeFeedback, 0);
+	Atomizer_timerIndex = Timer_CreateTimer(25000, 1, Atomizer_NegativeFeedback, 0);
+	Timer_SetPriority(Atomizer_timerIndex, INTERRUPT_PRIO_ATOMIZER);
+}
+
+uint8_t Atomizer_Suspend() {
+	uint32_t lock;
+	uint8_t ok;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	ok = Atomizer_curState == POWEROFF;
+	if(ok && !Atomizer_isSuspended) {
+		Timer_PauseTimer(Atomizer_timerIndex);
+		Atomizer_isSuspended = 1;
+	}
+	Interrupt_Unlock(lock);
+
+	return ok;
+}
+
+void Atomizer_Resume() {
+	if(Atomizer_isSuspended) {
+		Atomizer_isSuspended = 0;
+		Timer_ResumeTimer(Atomizer_timerIndex);
+	}
 }
 
 void Atomizer_SetOutputVoltage(uint16_t volts) {
@@ -487,37 +969,147 @@ void Atomizer_SetOutputVoltage(uint16_t volts) {
 	Atomizer_targetVolts = (volts + 5) / 10;
 }
 
-void Atomizer_Control(uint8_t powerOn) {
-	uint16_t battVolts;
+/**
+ * Powers the atomizer on or off.
+ * The whole transition runs with the feedback cycle masked, since
+ * this can be called both from the main loop and from interrupts
+ * (feedback cycle errors, fire on button).
+ * This is an internal function.
+ *
+ * @param powerOn   True to power the atomizer on, false to power it off.
+ * @param battVolts Battery voltage for the weak battery check, in mV.
+ *                  Only used when powering on.
+ */
+static void Atomizer_SetPower(uint8_t powerOn, uint16_t battVolts) {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+
 	if(Atomizer_error == SHORT) {
 		// Lock atomizer after short
+		Interrupt_Unlock(lock);
 		return;
 	}
 
 	if((!powerOn && Atomizer_curState == POWEROFF) || (powerOn && Atomizer_curState != POWEROFF)) {
 		// Nothing to do
+		Interrupt_Unlock(lock);
 		return;
 	}
 
 	if(powerOn) {
-		// Don't even bother firing if the battery is weak
-		battVolts = Battery_GetVoltage();
-		if(ATOMIZER_PREDICT_WEAKBATT(Atomizer_targetVolts, Atomizer_baseRes, battVolts)) {
+		// Don't even bother firing if the battery is weak,
+		// even with the output derated as much as it can be
+		if(Atomizer_PredictWeakBattery((uint32_t) Atomizer_targetVolts * ATOMIZER_DERATE_MIN >> 16,
+			Atomizer_baseRes, battVolts)) {
 			Atomizer_error = WEAK_BATT;
+			Atomizer_PublishError();
+			Interrupt_Unlock(lock);
 			return;
 		}
+		// The feedback cycle must be running
+		Atomizer_Resume();
+
 		// Start from buck with duty cycle 10
 		Atomizer_error = OK;
 		Atomizer_curCmr = 10;
 		PWM_SET_CMR(PWM0, ATOMIZER_PWMCH_BUCK, Atomizer_curCmr);
 		Atomizer_ConfigureConverters(1, 0);
 		ATOMIZER_TIMER_WARMUP_RESET();
+		Atomizer_timerCountLoad = 0;
+		Atomizer_idleBattVolts = battVolts;
+		Atomizer_derateBatt = ATOMIZER_DERATE_ONE;
+		Atomizer_derateFactor = ATOMIZER_DERATE_ONE;
+		Atomizer_derateReason = DERATE_NONE;
 		Atomizer_curState = POWERON_BUCK;
+
+		// Don't let readers see the last snapshot from a previous
+		// firing until the feedback cycle publishes a new one
+		Atomizer_PublishSnapshot(ADC_GetCachedResult(ADC_MODULE_VATM), ADC_GetCachedResult(ADC_MODULE_CURS));
 	}
 	else {
 		Atomizer_curState = POWEROFF;
 		Atomizer_ConfigureConverters(0, 0);
 	}
+
+	Interrupt_Unlock(lock);
+}
+
+void Atomizer_Control(uint8_t powerOn) {
+	// Only read the battery when actually powering on
+	Atomizer_SetPower(powerOn, powerOn && Atomizer_curState == POWEROFF ? Battery_GetVoltage() : 0);
+}
+
+void Atomizer_SetFireOnButton(uint8_t isEnabled) {
+	Atomizer_isFireOnButton = isEnabled;
+	Atomizer_HandleFireButton();
+}
+
+void Atomizer_HandleFireButton() {
+	uint32_t lock;
+
+	if(!Atomizer_isFireOnButton) {
+		return;
+	}
+
+	// Button interrupts are masked too, so the button
+	// state can't change until we're done
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	if(Atomizer_isMeasuring) {
+		// Atomizer_ReadInfo catches up when it's done
+		Interrupt_Unlock(lock);
+		return;
+	}
+
+	if(!(Button_GetState() & BUTTON_MASK_FIRE)) {
+		Atomizer_SetPower(0, 0);
+	}
+	else if(Atomizer_curState == POWEROFF && Atomizer_baseRes != 0 && Atomizer_GetError() == OK) {
+		// Under the lock this never waits for the ADC
+		Atomizer_SetPower(1, Battery_GetVoltage());
+	}
+	Interrupt_Unlock(lock);
+}
+
+uint32_t Atomizer_FetchBatteryCharge() {
+	uint64_t acc, total, powerAcc, battAcc;
+	uint32_t lock, ticks, battVolts;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	powerAcc = Atomizer_powerAcc;
+	battAcc = Atomizer_battAcc;
+	ticks = Atomizer_chargeTicks;
+	Atomizer_powerAcc = 0;
+	Atomizer_battAcc = 0;
+	Atomizer_chargeTicks = 0;
+	Interrupt_Unlock(lock);
+
+	// Only firing iterations are summed and the loaded battery voltage
+	// barely moves between two fetches: divide by its average
+	if(ticks != 0) {
+		battVolts = battAcc / ticks;
+		Atomizer_chargeAcc += (powerAcc << 6) / battVolts;
+	}
+
+	total = ATOMIZER_CHARGE_MAS(Atomizer_chargeAcc);
+	acc = total - Atomizer_chargeFetched;
+	Atomizer_chargeFetched = total;
+
+	return acc;
+}
+
+uint32_t Atomizer_GetMaxPower() {
+	uint16_t battVolts;
+
+	battVolts = Atomizer_IsOn() ? Atomizer_idleBattVolts : Battery_GetVoltage();
+	if(battVolts <= ATOMIZER_WEAKBATT_LOAD_VOLTS) {
+		return 0;
+	}
+
+	// Battery power at the sag limit, minus converter losses.
+	// mV * mV / mOhm = mW
+	return (uint32_t) ATOMIZER_WEAKBATT_LOAD_VOLTS * (battVolts - ATOMIZER_WEAKBATT_LOAD_VOLTS) /
+		Battery_GetInternalResistance() * ATOMIZER_CONVERTER_EFFICIENCY / 100;
 }
 
 uint8_t Atomizer_IsOn() {
@@ -526,19 +1118,25 @@ uint8_t Atomizer_IsOn() {
 
 Atomizer_Error_t Atomizer_GetError() {
 	// Mask OK code while resistance is stabilizing if beyond 3.5ohm  (for test purpose, with tc coils, stabilizing could take time and we could want to fire)
-	return Atomizer_error == OK && Atomizer_tempRes != 0 && Atomizer_tempRes > 3500 ? OPEN : Atomizer_error;
+	Atomizer_Error_t error = Atomizer_error;
+	return error == OK && Atomizer_tempRes != 0 && Atomizer_tempRes > 3500 ? OPEN : error;
 }
 
 /**
  * Samples the atomizer info.
+ * Voltage, current, resistance and state are filled in.
+ * If the atomizer is claimed for measurements (Atomizer_isMeasuring),
+ * it is powered on for sampling. Otherwise, they all come from the
+ * same feedback iteration.
  * This is an internal function.
  *
- * @param targetVolts Target volts for sampling (if not firing), in mV.
- * @param voltage     Pointer to store voltage (0 on error).
- * @param current     Pointer to store current (0 on error).
- * @param resistance  Pointer to store resistance (0 on error).
+ * @param targetVolts Target volts for sampling (if measuring), in mV.
+ * @param info        Info structure to fill (voltage, current and
+ *                    resistance are 0 on error).
  */
-static void Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t *current, uint16_t *resistance) {
+static void Atomizer_Sample(uint16_t targetVolts, Atomizer_Info_t *info) {
+	Atomizer_Snapshot_t snapshot;
+	Atomizer_Error_t error;
 	uint32_t vSum, iSum, adcRes;
 	uint16_t savedTargetVolts;
 	uint8_t i;
@@ -546,7 +1144,7 @@ static void Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t *c
 	vSum = 0;
 	iSum = 0;
 
-	if(Atomizer_curState == POWEROFF) {
+	if(Atomizer_isMeasuring) {
 		// Power on atomizer for measurement
 		savedTargetVolts = Atomizer_targetVolts;
 		Atomizer_SetOutputVoltage(targetVolts);
@@ -571,20 +1169,29 @@ static void Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t *c
 		Atomizer_Control(0);
 		Atomizer_SetOutputVoltage(savedTargetVolts);
 
-		*voltage = 0;
-		*current = 0;
+		error = Atomizer_error;
+		info->state = POWEROFF;
+		info->voltage = 0;
+		info->current = 0;
+		info->derating = 100;
+		info->derateReason = DERATE_NONE;
 	}
 	else {
-		// Use cached V and I
-		vSum = ADC_GetCachedResult(ADC_MODULE_VATM);
-		iSum = ADC_GetCachedResult(ADC_MODULE_CURS);
-
-		*voltage = ATOMIZER_ADC_VOLTAGE(vSum) * 10;
-		*current = ATOMIZER_ADC_CURRENT(iSum);
+		// Use V and I from the last feedback iteration
+		Atomizer_ReadSnapshot(&snapshot);
+		vSum = snapshot.adcVoltage;
+		iSum = snapshot.adcCurrent;
+
+		error = snapshot.error;
+		info->state = snapshot.state;
+		info->voltage = ATOMIZER_ADC_VOLTAGE(vSum) * 10;
+		info->current = ATOMIZER_ADC_CURRENT(iSum);
+		info->derating = snapshot.derateFactor * 100 >> 16;
+		info->derateReason = snapshot.derateReason;
 	}
 
-	if(Atomizer_error != OK) {
-		*resistance = 0;
+	if(error != OK) {
+		info->resistance = 0;
 		return;
 	}
 
@@ -598,7 +1205,7 @@ static void Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t *c
 		Atomizer_error = OPEN;
 	}
 	else {
-		*resistance = adcRes;
+		info->resistance = adcRes;
 		// Since TCR is always positive, adcRes < baseRes
 		// implies a better resistance reading has been acquired.
 		if(adcRes >= 5 && adcRes < Atomizer_baseRes) {
@@ -612,20 +1219,21 @@ static void Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t *c
 	Atomizer_baseRes = 0;
 	Atomizer_tempRes = 0;
 
-	*voltage = 0;
-	*current = 0;
-	*resistance = 0;
+	info->voltage = 0;
+	info->current = 0;
+	info->resistance = 0;
 
 	return;
 }
 
 /**
  * Refreshes the atomizer, taking care to update Atomizer_baseRes.
- * Do NOT call this while firing.
+ * The atomizer must be claimed for measurements (Atomizer_isMeasuring).
  * This is an internal function.
  */
 static void Atomizer_Refresh() {
-	uint16_t voltage, current, resistance, targetVolts;
+	Atomizer_Info_t sample;
+	uint16_t resistance, targetVolts;
 
 	if(Atomizer_tempRes == 0) {
 		// Use a 300mV test voltage for refresh
@@ -648,10 +1256,11 @@ static void Atomizer_Refresh() {
 	// so we start sampling it at 1.00V.
 	// Otherwise, we use the previously calculated target voltage.
 	targetVolts = Atomizer_tempRes == 0 ? 100 : Atomizer_tempTargetVolts;
-	Atomizer_Sample(targetVolts, &voltage, &current, &resistance);
+	Atomizer_Sample(targetVolts, &sample);
 	if(Atomizer_error != OK) {
 		return;
 	}
+	resistance = sample.resistance;
 
 	// Calculate test voltage for 1.5% target error.
 	Atomizer_tempTargetVolts = (resistance * 49L / 30L + 744L) / 10L;
@@ -672,8 +1281,18 @@ static void Atomizer_Refresh() {
 }
 
 void Atomizer_ReadInfo(Atomizer_Info_t *info) {
-    info->state = Atomizer_curState;
-    if(Atomizer_curState == POWEROFF) {
+	uint32_t lock;
+
+	// If the atomizer is off, claim it for measurements: the fire
+	// button handler won't power it on until we're done, so the
+	// feedback cycle won't touch the fields below. Checked under
+	// the lock, since the button handler runs in an interrupt.
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	Atomizer_isMeasuring = Atomizer_curState == POWEROFF;
+	Interrupt_Unlock(lock);
+
+	if(Atomizer_isMeasuring) {
+		info->state = POWEROFF;
 		// Lock atomizer after short
 		if(Atomizer_error != SHORT && (Atomizer_timerFlag & ATOMIZER_TMRFLAG_REFRESH)) {
 			ATOMIZER_TIMER_REFRESH_RESET();
@@ -684,11 +1303,20 @@ void Atomizer_ReadInfo(Atomizer_Info_t *info) {
 		info->current = 0;
 		info->resistance = Atomizer_baseRes;
     info->tcRes = Atomizer_tempTCRes;
+		info->derating = 100;
+		info->derateReason = DERATE_NONE;
 	}
 	else {
-		Atomizer_Sample(0, &info->voltage, &info->current, &info->resistance);
+		Atomizer_Sample(0, info);
     info->tcRes = info->resistance;
 	}
+
+	Atomizer_isMeasuring = 0;
+	Atomizer_PublishError();
+
+	// Firing may have been cut short by a measurement or an error:
+	// keep firing if the button is still pressed, like a main loop would
+	Atomizer_HandleFireButton();
 }
 
 uint8_t Atomizer_ReadBoardTemp() {
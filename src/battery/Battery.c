@@ -20,13 +20,95 @@
 #include <M451Series.h>
 #include <Battery.h>
 #include <ADC.h>
+#include <Event.h>
+#include <GPIOInt.h>
+#include <TimerUtils.h>
+#include <Atomizer.h>
+#include <Interrupt.h>
+#include <Settings.h>
 
 /**
  * \file
  * Battery library.
- * Voltage reading is done through the ADC.
+ * Voltage reading is done through the ADC. The atomizer feedback
+ * cycle feeds every VBAT conversion to two IIR filters, so reading
+ * the voltage doesn't wait for the ADC.
  * PD.7 is low when the battery is present.
+ *
+ * The state of charge is tracked by counting the charge drawn by
+ * the atomizer (see Atomizer_FetchBatteryCharge). Once the battery
+ * has rested, the open circuit voltage is looked up in the percent
+ * table and blended in, to correct the drift. After charging or a
+ * battery swap, the counter can't be trusted and is resynced from
+ * the voltage instead. The gauge lives in a .noinit section, so it
+ * survives resets as long as the MCU stays powered.
+ */
+
+/**
+ * Weak reference, so that the settings layer is only
+ * linked in if the app uses it.
+ */
+void Settings_HandlePowerLoss() __attribute__((weak));
+
+/**
+ * Converts a raw battery ADC value to mV.
+ * Doubles the voltage to compensate for the divider.
+ */
+#define BATTERY_ADC_TO_MV(x) ((x) * 2L * ADC_VREF / ADC_DENOMINATOR)
+
+/**
+ * Converts a voltage filter accumulator to mV.
+ */
+#define BATTERY_FILTER_TO_MV(x) BATTERY_ADC_TO_MV(((x) + 0x8000) >> 16)
+
+/**
+ * Fast voltage filter weight, as a shift. At the 25kHz feedback
+ * cycle rate, the time constant is 2^6 * 40us = 2.5ms.
+ */
+#define BATTERY_FILTER_FAST_SHIFT 6
+
+/**
+ * Slow voltage filter weight, as a shift.
+ * Time constant is 2^14 * 40us = 650ms.
+ */
+#define BATTERY_FILTER_SLOW_SHIFT 14
+
+/**
+ * Computes the gauge check word.
+ */
+#define BATTERY_GAUGE_CHECK() (~(Battery_gauge.magic ^ Battery_gauge.charge ^ Battery_gauge.capacity))
+
+/**
+ * Magic number for a valid gauge.
+ */
+#define BATTERY_GAUGE_MAGIC 0x47415547
+
+/**
+ * Gauge flag: charge is unknown, resync from voltage right away.
+ */
+#define BATTERY_GAUGE_INVALID (1 << 0)
+/**
+ * Gauge flag: charge has drifted, resync from voltage at next rest.
+ */
+#define BATTERY_GAUGE_RESYNC (1 << 1)
+/**
+ * Gauge flag: rested voltage already blended in for this rest.
+ */
+#define BATTERY_GAUGE_CORRECTED (1 << 2)
+
+/**
+ * Structure for the persistent gauge state.
  */
+typedef struct {
+	/**< BATTERY_GAUGE_MAGIC if valid. */
+	uint32_t magic;
+	/**< Remaining charge, in mAs. */
+	int32_t charge;
+	/**< Capacity, in mAh. */
+	uint32_t capacity;
+	/**< Bitwise NOT of the XOR of the fields above. */
+	uint32_t check;
+} Battery_Gauge_t;
 
 /**
  * Battery mV voltage to percent lookup table.
@@ -42,15 +124,77 @@ static const uint16_t Battery_percentTable[11] = {
  */
 static volatile uint8_t Battery_isPresent;
 
+/**
+ * Persistent gauge state.
+ */
+static Battery_Gauge_t Battery_gauge __attribute((section(".noinit")));
+
+/**
+ * Bitwise combination of BATTERY_GAUGE_* flags.
+ */
+static uint8_t Battery_gaugeFlags;
+
+/**
+ * True if a battery was inserted since the last gauge update.
+ */
+static volatile uint8_t Battery_isSwapped;
+
+/**
+ * Estimated internal resistance, in 1/16 mOhm.
+ * Kept across resets, range-checked on init.
+ */
+static volatile uint32_t Battery_resistance __attribute((section(".noinit")));
+
+/**
+ * Fast voltage filter accumulator, raw ADC value << 16.
+ * Zero until the first reading (and after a battery insertion).
+ */
+static volatile uint32_t Battery_voltageFast;
+
+/**
+ * Slow voltage filter accumulator, raw ADC value << 16.
+ */
+static volatile uint32_t Battery_voltageSlow;
+
+/**
+ * Minimum fast filtered voltage under load, raw ADC value.
+ * UINT16_MAX if there was no load.
+ */
+static volatile uint16_t Battery_loadMin = UINT16_MAX;
+
+/**
+ * Maximum fast filtered voltage under load, raw ADC value.
+ */
+static volatile uint16_t Battery_loadMax;
+
+/**
+ * Uptime when the battery was last under load or charging, in ms.
+ */
+static uint64_t Battery_lastActive;
+
 /**
  * PD.7 interrupt handler. Needed to make use of debounce.
- * Dirty hack: not an actual interrupt handler, but will be
- * called for PD.7 by the real GPD interrupt handler that
- * resides in the button library.
+ * Takes parameters as a GPIO interrupt handler.
  * This is an internal function.
  */
-void GPD7_IRQHandler() {
-	Battery_isPresent = !PD7;
+static void Battery_PresenceHandler(uint32_t unused) {
+	uint8_t isPresent = !PD7;
+
+	if(isPresent != Battery_isPresent) {
+		if(isPresent) {
+			// Could be another battery
+			Battery_isSwapped = 1;
+			Battery_resistance = BATTERY_DEFAULT_RESISTANCE << 4;
+			// Restart the filters from the new battery voltage
+			Battery_voltageFast = 0;
+		}
+		else if(!USBD_IS_ATTACHED() && Settings_HandlePowerLoss) {
+			// Running on leftover charge, save settings now
+			Settings_HandlePowerLoss();
+		}
+		Battery_isPresent = isPresent;
+		Event_Post(EVENT_BATTERY_PRESENCE, isPresent);
+	}
 }
 
 void Battery_Init() {
@@ -60,8 +204,20 @@ void Battery_Init() {
 
 	Battery_isPresent = !PD7;
 
-	// Leave NVIC enable to the button library
-	GPIO_EnableInt(PD, 7, GPIO_INT_BOTH_EDGE);
+	if(Battery_resistance < (1 << 4) || Battery_resistance > (1000 << 4)) {
+		Battery_resistance = BATTERY_DEFAULT_RESISTANCE << 4;
+	}
+
+	// Keep the gauge from before the reset, if any.
+	// The ADC isn't up yet, so resync happens on first use.
+	if(Battery_gauge.magic != BATTERY_GAUGE_MAGIC || Battery_gauge.check != BATTERY_GAUGE_CHECK()) {
+		Battery_gauge.magic = BATTERY_GAUGE_MAGIC;
+		Battery_gauge.capacity = BATTERY_DEFAULT_CAPACITY;
+		Battery_gauge.charge = 0;
+		Battery_gaugeFlags = BATTERY_GAUGE_INVALID;
+	}
+
+	GPIOInt_Register(PD, 7, GPIO_INT_BOTH_EDGE, Battery_PresenceHandler, 0);
 }
 
 uint8_t Battery_IsPresent() {
@@ -73,9 +229,92 @@ uint8_t Battery_IsCharging() {
 }
 
 uint16_t Battery_GetVoltage() {
-	// Double the voltage to compensate for the divider
-	uint16_t adcValue = ADC_Read(ADC_MODULE_VBAT);
-	return adcValue * 2L * ADC_VREF / ADC_DENOMINATOR;
+	uint32_t fast = Battery_voltageFast;
+
+	if(fast == 0) {
+		// No reading from the feedback cycle yet.
+		// Interrupt handlers and critical sections can't wait for a
+		// conversion: the ADC interrupt stores the result.
+		if(__get_IPSR() != 0 || __get_BASEPRI() != 0 || __get_PRIMASK()) {
+			return Battery_GetCachedVoltage();
+		}
+		return BATTERY_ADC_TO_MV(ADC_Read(ADC_MODULE_VBAT));
+	}
+
+	return BATTERY_FILTER_TO_MV(fast);
+}
+
+uint16_t Battery_GetCachedVoltage() {
+	return BATTERY_ADC_TO_MV(ADC_GetCachedResult(ADC_MODULE_VBAT));
+}
+
+void Battery_GetVoltageInfo(Battery_VoltageInfo_t *info) {
+	uint32_t fast, slow, lock;
+	uint16_t loadMin, loadMax;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	fast = Battery_voltageFast;
+	slow = Battery_voltageSlow;
+	loadMin = Battery_loadMin;
+	loadMax = Battery_loadMax;
+	Battery_loadMin = UINT16_MAX;
+	Battery_loadMax = 0;
+	Interrupt_Unlock(lock);
+
+	if(fast == 0) {
+		info->fast = Battery_GetVoltage();
+		info->slow = info->fast;
+	}
+	else {
+		info->fast = BATTERY_FILTER_TO_MV(fast);
+		info->slow = BATTERY_FILTER_TO_MV(slow);
+	}
+
+	if(loadMin > loadMax) {
+		// No load since last query
+		info->loadMin = 0;
+		info->loadMax = 0;
+	}
+	else {
+		info->loadMin = BATTERY_ADC_TO_MV(loadMin);
+		info->loadMax = BATTERY_ADC_TO_MV(loadMax);
+	}
+}
+
+void Battery_UpdateVoltage(uint16_t adcValue, uint8_t isLoaded) {
+	uint32_t sample;
+	uint16_t fast;
+
+	sample = (uint32_t) adcValue << 16;
+	if(Battery_voltageFast == 0) {
+		Battery_voltageFast = sample;
+		Battery_voltageSlow = sample;
+	}
+	else {
+		Battery_voltageFast += (int32_t) (sample - Battery_voltageFast) >> BATTERY_FILTER_FAST_SHIFT;
+		Battery_voltageSlow += (int32_t) (sample - Battery_voltageSlow) >> BATTERY_FILTER_SLOW_SHIFT;
+	}
+
+	if(isLoaded) {
+		fast = (Battery_voltageFast + 0x8000) >> 16;
+		if(fast < Battery_loadMin) {
+			Battery_loadMin = fast;
+		}
+		if(fast > Battery_loadMax) {
+			Battery_loadMax = fast;
+		}
+	}
+}
+
+/**
+ * Gets the slow filtered battery voltage.
+ * This is an internal function.
+ *
+ * @return Battery voltage, in mV.
+ */
+static uint16_t Battery_GetSlowVoltage() {
+	uint32_t slow = Battery_voltageSlow;
+	return Battery_voltageFast == 0 ? Battery_GetVoltage() : BATTERY_FILTER_TO_MV(slow);
 }
 
 uint8_t Battery_VoltageToPercent(uint16_t volts) {
@@ -98,3 +337,96 @@ uint8_t Battery_VoltageToPercent(uint16_t volts) {
 	higherBound = Battery_percentTable[i];
 	return 10 * (i - 1) + (volts - lowerBound) * 10 / (higherBound - lowerBound);
 }
+
+/**
+ * Updates the state of charge estimate.
+ * This is an internal function.
+ */
+static void Battery_UpdateGauge() {
+	uint64_t now;
+	int32_t fullCharge, voltageCharge;
+	uint32_t drawn;
+
+	now = Timer_GetMillis();
+	fullCharge = Battery_gauge.capacity * 3600;
+
+	if(Battery_isSwapped) {
+		Battery_isSwapped = 0;
+		Battery_gaugeFlags |= BATTERY_GAUGE_INVALID;
+	}
+
+	// Count the charge drawn since last time
+	drawn = Atomizer_FetchBatteryCharge();
+	Battery_gauge.charge -= drawn;
+
+	if(drawn != 0 || Atomizer_IsOn() || Battery_IsCharging()) {
+		// Not resting, voltage is off
+		Battery_lastActive = now;
+		Battery_gaugeFlags &= ~BATTERY_GAUGE_CORRECTED;
+		if(Battery_IsCharging()) {
+			// Charge current can't be measured
+			Battery_gaugeFlags |= BATTERY_GAUGE_RESYNC;
+		}
+	}
+
+	if(Battery_IsPresent() && (((Battery_gaugeFlags & BATTERY_GAUGE_INVALID) && !Atomizer_IsOn()) ||
+		(!(Battery_gaugeFlags & BATTERY_GAUGE_CORRECTED) && now - Battery_lastActive >= BATTERY_REST_TIME))) {
+		voltageCharge = fullCharge / 100 * Battery_VoltageToPercent(Battery_GetSlowVoltage());
+		if(Battery_gaugeFlags & (BATTERY_GAUGE_INVALID | BATTERY_GAUGE_RESYNC)) {
+			Battery_gauge.charge = voltageCharge;
+		}
+		else {
+			Battery_gauge.charge += (voltageCharge - Battery_gauge.charge) / BATTERY_VOLTAGE_WEIGHT;
+		}
+		Battery_gaugeFlags = BATTERY_GAUGE_CORRECTED;
+	}
+
+	if(Battery_gauge.charge < 0) {
+		Battery_gauge.charge = 0;
+	}
+	else if(Battery_gauge.charge > fullCharge) {
+		Battery_gauge.charge = fullCharge;
+	}
+
+	Battery_gauge.check = BATTERY_GAUGE_CHECK();
+}
+
+uint16_t Battery_GetInternalResistance() {
+	// Round to nearest
+	return (Battery_resistance + 8) >> 4;
+}
+
+void Battery_UpdateInternalResistance(uint16_t voltageDrop, uint32_t current) {
+	int32_t sample;
+
+	// mV / mA = Ohm, keep 1/16 mOhm fractional bits
+	sample = ((uint32_t) voltageDrop << 4) * 1000 / current;
+	if(sample < (1 << 4) || sample > (1000 << 4)) {
+		// Not plausible, skip it
+		return;
+	}
+
+	Battery_resistance += (sample - (int32_t) Battery_resistance) / BATTERY_RESISTANCE_WEIGHT;
+}
+
+void Battery_SetCapacity(uint16_t capacity) {
+	if(capacity == 0) {
+		return;
+	}
+
+	// Keep the same percentage
+	Battery_gauge.charge = (int64_t) Battery_gauge.charge * capacity / Battery_gauge.capacity;
+	Battery_gauge.capacity = capacity;
+	Battery_gauge.check = BATTERY_GAUGE_CHECK();
+}
+
+uint8_t Battery_GetStateOfCharge() {
+	Battery_UpdateGauge();
+	return (int64_t) Battery_gauge.charge * 100 / (Battery_gauge.capacity * 3600);
+}
+
+uint32_t Battery_GetRemainingEnergy() {
+	Battery_UpdateGauge();
+	// mAs * mV = uJ, 3.6 * 10^6 uJ = 1mWh
+	return (uint64_t) Battery_gauge.charge * BATTERY_NOMINAL_VOLTAGE / 3600000;
+}
@@ -0,0 +1,414 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <stddef.h>
+#include <M451Series.h>
+#include <BlackBox.h>
+#include <Dataflash.h>
+#include <Deferred.h>
+#include <TimerUtils.h>
+#include <TimerWheel.h>
+#include <Atomizer.h>
+#include <Interrupt.h>
+
+/**
+ * Dump magic, also the page owner for Dataflash_AllocPages.
+ */
+#define BLACKBOX_DUMP_MAGIC DATAFLASH_OWNER_BLACKBOX
+
+/**
+ * Ring magic, marks a ring set up by BlackBox_Init.
+ */
+#define BLACKBOX_RING_MAGIC 0x474E4952
+
+/**
+ * Reset sources that leave a ring worth saving in RAM.
+ */
+#define BLACKBOX_RESET_MASK (SYS_RSTSTS_WDTRF_Msk | SYS_RSTSTS_CPULKRF_Msk | \
+	SYS_RSTSTS_BODRF_Msk | SYS_RSTSTS_LVRF_Msk)
+
+/**
+ * Delay before retrying a dump while the atomizer is on, in ms.
+ */
+#define BLACKBOX_RETRY_DELAY 10
+
+/**
+ * No pending dump, see BlackBox_pendingReason.
+ */
+#define BLACKBOX_REASON_NONE 0xFF
+
+/**
+ * Gets the address of a dump page.
+ */
+#define BLACKBOX_PAGE_ADDR(page) (BlackBox_baseAddr + (page) * FMC_FLASH_PAGE_SIZE)
+
+/**
+ * Gets a dump page through the memory map.
+ */
+#define BLACKBOX_PAGE_DUMP(page) ((const BlackBox_Dump_t *) BLACKBOX_PAGE_ADDR(page))
+
+/**
+ * Sample ring.
+ * This is an internal structure.
+ */
+typedef struct {
+	/**< Ring magic, see BLACKBOX_RING_MAGIC. */
+	uint32_t magic;
+	/**< Next sample slot. */
+	uint8_t head;
+	/**< Number of valid samples. */
+	uint8_t count;
+	/**< True if recording is stopped for a dump. */
+	volatile uint8_t isFrozen;
+	/**< Padding, keeps samples word-aligned. */
+	uint8_t reserved;
+	/**< Samples. */
+	BlackBox_Sample_t sample[BLACKBOX_SAMPLE_COUNT];
+} BlackBox_Ring_t;
+
+/**
+ * Sample ring. Lives in a .noinit section, so that
+ * it can be saved after an unexpected reset.
+ */
+static BlackBox_Ring_t BlackBox_ring __attribute((section(".noinit")));
+
+/**
+ * Dump pages base address. Zero if not initialized.
+ */
+static uint32_t BlackBox_baseAddr;
+
+/**
+ * Page holding the newest dump, negative if none.
+ */
+static int8_t BlackBox_newestPage;
+
+/**
+ * Erased page for the next dump, negative if none.
+ */
+static int8_t BlackBox_freePage;
+
+/**
+ * Sequence number for the next dump.
+ */
+static uint32_t BlackBox_seq;
+
+/**
+ * Reason for the dump waiting to be written.
+ */
+static volatile uint8_t BlackBox_pendingReason = BLACKBOX_REASON_NONE;
+
+/**
+ * Uptime at the pending trigger, in ms.
+ */
+static uint32_t BlackBox_pendingUptime;
+
+/**
+ * Index of the retry timer.
+ */
+static int8_t BlackBox_timerIndex = -1;
+
+/**
+ * Writes the ring to the free page.
+ * Flash is only programmed, never erased.
+ * This is an internal function.
+ *
+ * @param reason    Dump reason.
+ * @param uptime    Uptime at the trigger, in ms.
+ * @param faultAddr Faulting instruction address, or 0.
+ *
+ * @return True on success, false if there is no free page
+ *         or another context is writing flash.
+ */
+static uint8_t BlackBox_Save(uint8_t reason, uint32_t uptime, uint32_t faultAddr) {
+	const uint32_t *word;
+	uint32_t addr;
+	uint8_t count, idx, i, j;
+
+	if(BlackBox_freePage < 0 || !Dataflash_BeginWrite()) {
+		return 0;
+	}
+	addr = BLACKBOX_PAGE_ADDR(BlackBox_freePage);
+
+	// Ring fields may be garbage after an unexpected reset
+	count = BlackBox_ring.count > BLACKBOX_SAMPLE_COUNT ? BLACKBOX_SAMPLE_COUNT : BlackBox_ring.count;
+	idx = BlackBox_ring.head >= BLACKBOX_SAMPLE_COUNT ? 0 : BlackBox_ring.head;
+	idx = (idx + BLACKBOX_SAMPLE_COUNT - count) % BLACKBOX_SAMPLE_COUNT;
+
+	Dataflash_Program(addr + offsetof(BlackBox_Dump_t, seq), BlackBox_seq);
+	Dataflash_Program(addr + offsetof(BlackBox_Dump_t, uptime), uptime);
+	Dataflash_Program(addr + offsetof(BlackBox_Dump_t, faultAddr), faultAddr);
+	Dataflash_Program(addr + offsetof(BlackBox_Dump_t, reason), reason | count << 8);
+
+	// Unroll the ring, oldest first
+	addr += offsetof(BlackBox_Dump_t, sample);
+	for(i = 0; i < count; i++) {
+		word = (const uint32_t *) &BlackBox_ring.sample[idx];
+		for(j = 0; j < sizeof(BlackBox_Sample_t) / 4; j++) {
+			Dataflash_Program(addr, word[j]);
+			addr += 4;
+		}
+		idx = idx + 1 == BLACKBOX_SAMPLE_COUNT ? 0 : idx + 1;
+	}
+
+	Dataflash_Program(BLACKBOX_PAGE_ADDR(BlackBox_freePage) + offsetof(BlackBox_Dump_t, magic), BLACKBOX_DUMP_MAGIC);
+	Dataflash_EndWrite();
+
+	BlackBox_newestPage = BlackBox_freePage;
+	BlackBox_freePage = -1;
+	BlackBox_seq++;
+
+	return 1;
+}
+
+/**
+ * Makes sure the page without the newest dump is erased.
+ * Must not be called while the atomizer is on.
+ * This is an internal function.
+ *
+ * @return True on success, false if another context is writing flash.
+ */
+static uint8_t BlackBox_PreparePage() {
+	uint32_t addr, end;
+	uint8_t page;
+
+	page = BlackBox_newestPage == 0 ? 1 : 0;
+	addr = BLACKBOX_PAGE_ADDR(page);
+	end = addr + sizeof(BlackBox_Dump_t);
+
+	// Only erase if needed
+	while(addr < end && *(volatile uint32_t *) addr == 0xFFFFFFFF) {
+		addr += 4;
+	}
+	if(addr < end) {
+		if(!Dataflash_BeginWrite()) {
+			return 0;
+		}
+		Dataflash_ErasePage(BLACKBOX_PAGE_ADDR(page));
+		Dataflash_EndWrite();
+	}
+
+	BlackBox_freePage = page;
+	return 1;
+}
+
+/**
+ * Clears and restarts the sample ring.
+ * This is an internal function.
+ */
+static void BlackBox_ResetRing() {
+	BlackBox_ring.magic = BLACKBOX_RING_MAGIC;
+	BlackBox_ring.head = 0;
+	BlackBox_ring.count = 0;
+	BlackBox_ring.isFrozen = 0;
+}
+
+/**
+ * Writes the pending dump and gets ready for the next one.
+ * Runs as deferred work, or as a timer callback when retrying.
+ * Takes parameters as a timer callback.
+ * This is an internal function.
+ */
+static void BlackBox_SaveCallback(uint32_t unused) {
+	uint8_t isDone;
+
+	// Flash writes would stall the feedback cycle
+	isDone = !Atomizer_IsOn();
+
+	if(isDone && BlackBox_pendingReason != BLACKBOX_REASON_NONE) {
+		isDone = (BlackBox_freePage >= 0 || BlackBox_PreparePage()) &&
+			BlackBox_Save(BlackBox_pendingReason, BlackBox_pendingUptime, 0);
+		if(isDone) {
+			BlackBox_pendingReason = BLACKBOX_REASON_NONE;
+		}
+	}
+
+	if(!isDone || !BlackBox_PreparePage()) {
+		// Atomizer on, or another context is writing flash
+		TimerWheel_RestartTimer(BlackBox_timerIndex, BLACKBOX_RETRY_DELAY);
+		return;
+	}
+
+	BlackBox_ResetRing();
+}
+
+/**
+ * Saves a dump and resets the device.
+ * This is an internal function.
+ *
+ * @param frame Exception stack frame.
+ */
+static void __attribute__((used)) BlackBox_HandleHardFault(uint32_t *frame) {
+	if(BlackBox_baseAddr != 0 && !BlackBox_ring.isFrozen) {
+		BlackBox_ring.isFrozen = 1;
+		// Stacked PC is the faulting instruction
+		BlackBox_Save(BLACKBOX_HARDFAULT, Timer_GetMillis(), frame[6]);
+	}
+
+	NVIC_SystemReset();
+}
+
+/**
+ * Hard fault handler.
+ * Passes the stack frame (from MSP or PSP) to BlackBox_HandleHardFault.
+ */
+void __attribute__((naked)) HardFault_Handler() {
+	__asm volatile(
+		"tst lr, #4\n"
+		"ite eq\n"
+		"mrseq r0, msp\n"
+		"mrsne r0, psp\n"
+		"b BlackBox_HandleHardFault\n"
+	);
+}
+
+uint8_t BlackBox_Init() {
+	const BlackBox_Dump_t *dump;
+	uint32_t resetSrc;
+	uint8_t page;
+
+	BlackBox_baseAddr = Dataflash_AllocPages(2, BLACKBOX_DUMP_MAGIC);
+	if(BlackBox_baseAddr == 0) {
+		return 0;
+	}
+
+	// Find the newest dump
+	BlackBox_newestPage = -1;
+	BlackBox_seq = 0;
+	for(page = 0; page < 2; page++) {
+		dump = BLACKBOX_PAGE_DUMP(page);
+		if(dump->magic == BLACKBOX_DUMP_MAGIC && (BlackBox_newestPage < 0 || dump->seq >= BlackBox_seq)) {
+			BlackBox_newestPage = page;
+			BlackBox_seq = dump->seq + 1;
+		}
+	}
+	BlackBox_PreparePage();
+
+	// Save what was going on before an unexpected reset
+	resetSrc = SYS->RSTSTS & BLACKBOX_RESET_MASK;
+	if(resetSrc) {
+		if(BlackBox_ring.magic == BLACKBOX_RING_MAGIC && !BlackBox_ring.isFrozen && BlackBox_ring.count != 0) {
+			BlackBox_Save(BLACKBOX_RESET, 0, 0);
+			BlackBox_PreparePage();
+		}
+		SYS_CLEAR_RST_SOURCE(resetSrc);
+	}
+	BlackBox_ResetRing();
+
+	BlackBox_timerIndex = TimerWheel_CreateTimer(BLACKBOX_RETRY_DELAY, 0, BlackBox_SaveCallback, 0);
+	if(BlackBox_timerIndex >= 0) {
+		TimerWheel_StopTimer(BlackBox_timerIndex);
+		TimerWheel_SetCallbackDeferred(BlackBox_timerIndex, 1);
+	}
+
+	return 1;
+}
+
+void BlackBox_Record(const BlackBox_Sample_t *sample) {
+	uint8_t head;
+
+	if(BlackBox_ring.isFrozen) {
+		return;
+	}
+
+	head = BlackBox_ring.head;
+	if(head >= BLACKBOX_SAMPLE_COUNT) {
+		head = 0;
+	}
+	BlackBox_ring.sample[head] = *sample;
+	BlackBox_ring.head = head + 1 == BLACKBOX_SAMPLE_COUNT ? 0 : head + 1;
+	if(BlackBox_ring.count < BLACKBOX_SAMPLE_COUNT) {
+		BlackBox_ring.count++;
+	}
+}
+
+void BlackBox_Trigger(BlackBox_Reason_t reason) {
+	uint32_t lock;
+
+	if(BlackBox_baseAddr == 0) {
+		return;
+	}
+
+	// Recording runs at atomizer priority
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	if(BlackBox_ring.isFrozen) {
+		Interrupt_Unlock(lock);
+		return;
+	}
+	BlackBox_ring.isFrozen = 1;
+	Interrupt_Unlock(lock);
+
+	BlackBox_pendingUptime = Timer_GetMillis();
+	BlackBox_pendingReason = reason;
+	Deferred_Post(BlackBox_SaveCallback, 0);
+}
+
+void BlackBox_HandlePowerLoss() {
+	uint32_t lock;
+
+	if(BlackBox_baseAddr == 0) {
+		return;
+	}
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	if(BlackBox_ring.isFrozen) {
+		Interrupt_Unlock(lock);
+		return;
+	}
+	BlackBox_ring.isFrozen = 1;
+	Interrupt_Unlock(lock);
+
+	BlackBox_pendingUptime = Timer_GetMillis();
+	BlackBox_pendingReason = BLACKBOX_BROWNOUT;
+
+	// No time to wait for deferred work. Programming takes about
+	// 10ms, erasing is left for when power comes back. Nothing is
+	// written while firing (the brown-out may be a load sag) or on
+	// top of a flash write this preempted: the deferred save picks
+	// the dump up once the atomizer is off and the writer is done.
+	if(!Atomizer_IsOn() && BlackBox_Save(BLACKBOX_BROWNOUT, BlackBox_pendingUptime, 0)) {
+		BlackBox_pendingReason = BLACKBOX_REASON_NONE;
+	}
+	Deferred_Post(BlackBox_SaveCallback, 0);
+}
+
+const BlackBox_Dump_t *BlackBox_GetDump() {
+	if(BlackBox_baseAddr == 0 || BlackBox_newestPage < 0) {
+		return NULL;
+	}
+
+	return BLACKBOX_PAGE_DUMP(BlackBox_newestPage);
+}
+
+uint8_t BlackBox_Clear() {
+	uint8_t page;
+
+	if(BlackBox_baseAddr == 0 || Atomizer_IsOn() || !Dataflash_BeginWrite()) {
+		return 0;
+	}
+
+	for(page = 0; page < 2; page++) {
+		Dataflash_ErasePage(BLACKBOX_PAGE_ADDR(page));
+	}
+	Dataflash_EndWrite();
+
+	BlackBox_newestPage = -1;
+	BlackBox_freePage = 0;
+
+	return 1;
+}
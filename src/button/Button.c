@@ -26,10 +26,63 @@
  * - PE.0 (Fire button)
  * - PD.2 (Right button)
  * - PD.3 (Left button)
+ *
+ * The gesture recognizer tracks one button combination at a time.
+ * Pressing more buttons while holding turns the gesture into a
+ * combination gesture. Releasing only some of them ends it, and
+ * the rest is ignored until all buttons are released.
+ * Edges are timestamped with the SDK clock. Hold, long hold and
+ * repeat timing is done with a one-shot software timer, and a
+ * second one times the gap between clicks.
  */
 
 #include <M451Series.h>
 #include <Button.h>
+#include <Atomizer.h>
+#include <Deferred.h>
+#include <Event.h>
+#include <GPIOInt.h>
+#include <Interrupt.h>
+#include <TimerUtils.h>
+#include <TimerWheel.h>
+
+/**
+ * Gesture recognizer state.
+ */
+typedef struct {
+	/**< Time the current combination was pressed, in ms. */
+	uint32_t pressTime;
+	/**< Time of the next repeat, in ms. */
+	uint32_t nextRepeat;
+	/**< Current repeat interval, in ms. */
+	uint16_t repeatInterval;
+	/**< Combination being tracked, 0 if none. */
+	uint8_t mask;
+	/**< Combination the pending clicks belong to. */
+	uint8_t clickMask;
+	/**< Number of pending clicks. */
+	uint8_t clickCount;
+	/**< 0 before hold, 1 after hold, 2 after long hold. */
+	uint8_t holdLevel;
+	/**< Number of repeats so far. */
+	uint8_t repeatCount;
+	/**< True after a partial release, until all buttons are released. */
+	uint8_t isBroken;
+} Button_GestureState_t;
+
+/**
+ * Structure for a gesture waiting to be sent.
+ */
+typedef struct {
+	uint8_t mask;
+	uint8_t gesture;
+	uint8_t count;
+} Button_GestureEvent_t;
+
+/**
+ * Maximum number of gestures a single recognizer step can produce.
+ */
+#define BUTTON_GESTURE_MAX_EVENTS 3
 
 /**
  * Button callback function pointers.
@@ -41,15 +94,56 @@ static Button_Callback_t Button_callbackPtr[3] = {NULL};
  */
 static uint8_t Button_callbackMask[3];
 
+/**
+ * Deferred delivery flags.
+ * Bits 0-2 are assigned to callbacks 0-2.
+ */
+static volatile uint8_t Button_callbackDeferred;
+
 /**
  * Global button state.
  */
 static volatile uint8_t Button_state;
 
 /**
- * Dirty hack: soft PD.7 interrupt handler.
+ * Gesture callback function pointer.
+ * NULL when gestures are not used.
+ */
+static volatile Button_GestureCallback_t Button_gestureCallback;
+
+/**
+ * True if the gesture callback is deferred.
+ */
+static volatile uint8_t Button_isGestureDeferred;
+
+/**
+ * Gesture recognizer timings.
+ */
+static Button_GestureConfig_t Button_gestureConfig = {
+	.clickGap = 250,
+	.holdTime = 500,
+	.longHoldTime = 1000,
+	.repeatStart = 300,
+	.repeatMin = 40,
+	.repeatAccel = 80
+};
+
+/**
+ * Gesture recognizer state.
+ * Shared between the GPIO and the tick interrupt handlers,
+ * only accessed with interrupts locked at INTERRUPT_PRIO_GPIO.
  */
-extern void GPD7_IRQHandler();
+static Button_GestureState_t Button_gesture;
+
+/**
+ * Software timer for hold, long hold and repeat.
+ */
+static int8_t Button_holdTimer;
+
+/**
+ * Software timer for the click gap.
+ */
+static int8_t Button_clickTimer;
 
 /**
  * Updates the global button state for the specified
@@ -70,43 +164,293 @@ static void Button_UpdateState(uint8_t mask) {
 }
 
 /**
- * GPD/GPE interrupt handler.
+ * Runs a deferred button callback.
+ * This is an internal function.
+ *
+ * @param data Callback index in bits 8-15, button state in bits 0-7.
+ */
+static void Button_DeferredTrampoline(uint32_t data) {
+	Button_Callback_t callback;
+
+	// The callback could have been deleted in the meantime
+	callback = Button_callbackPtr[data >> 8];
+	if(callback != NULL) {
+		callback(data & 0xFF);
+	}
+}
+
+/**
+ * Runs the deferred gesture callback.
+ * This is an internal function.
+ *
+ * @param data Mask in bits 0-7, gesture in bits 8-15, count in bits 16-23.
+ */
+static void Button_GestureTrampoline(uint32_t data) {
+	Button_GestureCallback_t callback;
+
+	// The callback could have been removed in the meantime
+	callback = Button_gestureCallback;
+	if(callback != NULL) {
+		callback(data & 0xFF, (Button_Gesture_t) ((data >> 8) & 0xFF), (data >> 16) & 0xFF);
+	}
+}
+
+/**
+ * Sends gestures to the callback.
+ * Must be called with interrupts enabled.
+ * This is an internal function.
+ *
+ * @param events Gestures to send.
+ * @param count  Number of gestures.
+ */
+static void Button_SendGestures(const Button_GestureEvent_t *events, uint8_t count) {
+	Button_GestureCallback_t callback;
+	uint8_t i;
+
+	callback = Button_gestureCallback;
+	if(callback == NULL) {
+		return;
+	}
+
+	for(i = 0; i < count; i++) {
+		if(Button_isGestureDeferred) {
+			Deferred_Post(Button_GestureTrampoline, events[i].mask |
+				(events[i].gesture << 8) | (events[i].count << 16));
+		}
+		else {
+			callback(events[i].mask, (Button_Gesture_t) events[i].gesture, events[i].count);
+		}
+	}
+}
+
+/**
+ * Convenience macro to queue a gesture in a local events array.
+ */
+#define BUTTON_GESTURE_PUSH(ev, n, m, g, c) do { \
+	(ev)[n].mask = (m); \
+	(ev)[n].gesture = (g); \
+	(ev)[n].count = (c); \
+	(n)++; \
+} while(0)
+
+/**
+ * Queues the pending clicks, if any.
+ * Must be called with interrupts locked at INTERRUPT_PRIO_GPIO.
+ * This is an internal function.
+ *
+ * @param events Events array.
+ * @param count  Pointer to the number of events in the array.
+ */
+static void Button_FlushClicks(Button_GestureEvent_t *events, uint8_t *count) {
+	if(Button_gesture.clickCount != 0) {
+		BUTTON_GESTURE_PUSH(events, *count, Button_gesture.clickMask,
+			BUTTON_GESTURE_CLICK, Button_gesture.clickCount);
+		Button_gesture.clickCount = 0;
+	}
+	TimerWheel_StopTimer(Button_clickTimer);
+}
+
+/**
+ * Ends the current combination gesture.
+ * Must be called with interrupts locked at INTERRUPT_PRIO_GPIO.
+ * This is an internal function.
+ *
+ * @param events Events array.
+ * @param count  Pointer to the number of events in the array.
+ */
+static void Button_EndGesture(Button_GestureEvent_t *events, uint8_t *count) {
+	TimerWheel_StopTimer(Button_holdTimer);
+
+	if(Button_gesture.holdLevel == 0) {
+		// Short press: count the click and wait for the next one
+		Button_gesture.clickMask = Button_gesture.mask;
+		if(Button_gesture.clickCount != 255) {
+			Button_gesture.clickCount++;
+		}
+		TimerWheel_RestartTimer(Button_clickTimer, Button_gestureConfig.clickGap);
+	}
+	else {
+		BUTTON_GESTURE_PUSH(events, *count, Button_gesture.mask, BUTTON_GESTURE_RELEASE, 0);
+	}
+
+	Button_gesture.mask = 0;
+}
+
+/**
+ * Feeds a button state change to the gesture recognizer.
+ * This is an internal function.
+ *
+ * @param state New button state.
+ */
+static void Button_GestureEdge(uint8_t state) {
+	Button_GestureEvent_t events[BUTTON_GESTURE_MAX_EVENTS];
+	uint32_t lock, now;
+	uint8_t count;
+
+	count = 0;
+	now = Timer_GetMillis();
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(state == 0) {
+		// All released
+		if(!Button_gesture.isBroken && Button_gesture.mask != 0) {
+			Button_EndGesture(events, &count);
+		}
+		Button_gesture.isBroken = 0;
+	}
+	else if(Button_gesture.isBroken) {
+		// Wait for all buttons to be released
+	}
+	else if((state & Button_gesture.mask) != Button_gesture.mask) {
+		// Partial release
+		Button_EndGesture(events, &count);
+		Button_gesture.isBroken = 1;
+	}
+	else if(state != Button_gesture.mask) {
+		// New press, or more buttons joined the combination
+		if(Button_gesture.clickMask != state) {
+			Button_FlushClicks(events, &count);
+		}
+		else {
+			// Same combination again: keep counting clicks
+			TimerWheel_StopTimer(Button_clickTimer);
+		}
+
+		Button_gesture.mask = state;
+		Button_gesture.pressTime = now;
+		Button_gesture.holdLevel = 0;
+		Button_gesture.repeatCount = 0;
+		TimerWheel_RestartTimer(Button_holdTimer, Button_gestureConfig.holdTime);
+	}
+	Interrupt_Unlock(lock);
+
+	Button_SendGestures(events, count);
+}
+
+/**
+ * Hold timer callback: handles hold, long hold and repeat.
  * This is an internal function.
+ *
+ * @param unused Unused.
  */
-void Button_IRQHandler() {
+static void Button_GestureHoldTimeout(uint32_t unused) {
+	Button_GestureEvent_t events[BUTTON_GESTURE_MAX_EVENTS];
+	uint32_t lock, now, next, longHoldEnd;
+	uint8_t count;
+
+	count = 0;
+	now = Timer_GetMillis();
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(Button_gesture.mask == 0 || Button_gesture.isBroken) {
+		// Released in the meantime
+		Interrupt_Unlock(lock);
+		return;
+	}
+
+	if(Button_gesture.holdLevel == 0) {
+		// Clicks followed by a hold: send the clicks first
+		Button_FlushClicks(events, &count);
+		BUTTON_GESTURE_PUSH(events, count, Button_gesture.mask, BUTTON_GESTURE_HOLD, 0);
+		Button_gesture.holdLevel = 1;
+		Button_gesture.repeatInterval = Button_gestureConfig.repeatStart;
+		Button_gesture.nextRepeat = now + Button_gesture.repeatInterval;
+	}
+	else if((int32_t) (now - Button_gesture.nextRepeat) >= 0) {
+		if(Button_gesture.repeatCount != 255) {
+			Button_gesture.repeatCount++;
+		}
+		BUTTON_GESTURE_PUSH(events, count, Button_gesture.mask,
+			BUTTON_GESTURE_REPEAT, Button_gesture.repeatCount);
+
+		// Speed up
+		Button_gesture.repeatInterval = Button_gesture.repeatInterval * Button_gestureConfig.repeatAccel / 100;
+		if(Button_gesture.repeatInterval < Button_gestureConfig.repeatMin) {
+			Button_gesture.repeatInterval = Button_gestureConfig.repeatMin;
+		}
+		Button_gesture.nextRepeat = now + Button_gesture.repeatInterval;
+	}
+
+	longHoldEnd = Button_gesture.pressTime + Button_gestureConfig.longHoldTime;
+	if(Button_gesture.holdLevel == 1 && (int32_t) (now - longHoldEnd) >= 0) {
+		BUTTON_GESTURE_PUSH(events, count, Button_gesture.mask, BUTTON_GESTURE_LONGHOLD, 0);
+		Button_gesture.holdLevel = 2;
+	}
+
+	// Wake up for whatever comes first
+	next = Button_gesture.nextRepeat - now;
+	if(Button_gesture.holdLevel == 1 && longHoldEnd - now < next) {
+		next = longHoldEnd - now;
+	}
+	TimerWheel_RestartTimer(Button_holdTimer, next);
+	Interrupt_Unlock(lock);
+
+	Button_SendGestures(events, count);
+}
+
+/**
+ * Click gap timer callback: sends the pending clicks.
+ * This is an internal function.
+ *
+ * @param unused Unused.
+ */
+static void Button_GestureClickTimeout(uint32_t unused) {
+	Button_GestureEvent_t events[BUTTON_GESTURE_MAX_EVENTS];
+	uint32_t lock;
+	uint8_t count;
+
+	count = 0;
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	Button_FlushClicks(events, &count);
+	Interrupt_Unlock(lock);
+
+	Button_SendGestures(events, count);
+}
+
+/**
+ * Button pin interrupt handler.
+ * Takes parameters as a GPIO interrupt handler.
+ * This is an internal function.
+ *
+ * @param mask Mask of the button that changed.
+ */
+static void Button_PinHandler(uint32_t mask) {
 	int i;
-	uint8_t mask;
 
-	// Dirty hack: invoke soft PD.7 interrupt handler
-	if(GPIO_GET_INT_FLAG(PD, BIT7)) {
-		GPD7_IRQHandler();
+	Button_UpdateState(mask);
+
+	// Fire on button goes first, for latency
+	if(mask & BUTTON_MASK_FIRE) {
+		Atomizer_HandleFireButton();
 	}
 
-	// Build callback mask
-	mask  = GPIO_GET_INT_FLAG(PE, BIT0) ? BUTTON_MASK_FIRE : 0;
-	mask |= GPIO_GET_INT_FLAG(PD, BIT2) ? BUTTON_MASK_RIGHT : 0;
-	mask |= GPIO_GET_INT_FLAG(PD, BIT3) ? BUTTON_MASK_LEFT : 0;
+	Event_Post(EVENT_BUTTON, Button_state);
 
-	if(mask) {
-		Button_UpdateState(mask);
+	if(Button_gestureCallback != NULL) {
+		Button_GestureEdge(Button_state);
+	}
 
-		for(i = 0; i < 3; i++) {
-			if(Button_callbackPtr[i] != NULL && Button_callbackMask[i] & mask) {
+	for(i = 0; i < 3; i++) {
+		if(Button_callbackPtr[i] != NULL && Button_callbackMask[i] & mask) {
+			if(Button_callbackDeferred & (1 << i)) {
+				Deferred_Post(Button_DeferredTrampoline, (i << 8) | Button_state);
+			}
+			else {
 				Button_callbackPtr[i](Button_state);
 			}
 		}
 	}
-
-	// Clear all PD/PE interrupts
-	PD->INTSRC = PD->INTSRC;
-	PE->INTSRC = PE->INTSRC;
 }
-__attribute((alias("Button_IRQHandler"))) void GPD_IRQHandler();
-__attribute((alias("Button_IRQHandler"))) void GPE_IRQHandler();
 
 void Button_Init() {
 	Button_state = 0;
 
+	// Setup gesture timers, stopped until needed
+	Button_holdTimer = TimerWheel_CreateTimer(1, 0, Button_GestureHoldTimeout, 0);
+	TimerWheel_StopTimer(Button_holdTimer);
+	Button_clickTimer = TimerWheel_CreateTimer(1, 0, Button_GestureClickTimeout, 0);
+	TimerWheel_StopTimer(Button_clickTimer);
+
 	// Setup GPIOs
 	GPIO_SetMode(PE, BIT0, GPIO_MODE_INPUT);
 	GPIO_SetMode(PD, BIT2, GPIO_MODE_INPUT);
@@ -120,11 +464,9 @@ void Button_Init() {
 	// Enable all interrupts, regardless of which are actually used.
 	// Enabling/disabling selectively increases complexity and is not
 	// worth the extremely small performance gain.
-	GPIO_EnableInt(PE, 0, GPIO_INT_BOTH_EDGE);
-	GPIO_EnableInt(PD, 2, GPIO_INT_BOTH_EDGE);
-	GPIO_EnableInt(PD, 3, GPIO_INT_BOTH_EDGE);
-	NVIC_EnableIRQ(GPE_IRQn);
-	NVIC_EnableIRQ(GPD_IRQn);
+	GPIOInt_Register(PE, 0, GPIO_INT_BOTH_EDGE, Button_PinHandler, BUTTON_MASK_FIRE);
+	GPIOInt_Register(PD, 2, GPIO_INT_BOTH_EDGE, Button_PinHandler, BUTTON_MASK_RIGHT);
+	GPIOInt_Register(PD, 3, GPIO_INT_BOTH_EDGE, Button_PinHandler, BUTTON_MASK_LEFT);
 }
 
 uint8_t Button_GetState() {
@@ -143,11 +485,52 @@ int8_t Button_CreateCallback(Button_Callback_t callback, uint8_t buttonMask) {
 	// Button_callbackPtr[i] must be set as last
 	// to avoid race conditions.
 	Button_callbackMask[i] = buttonMask;
+	Button_callbackDeferred &= ~(1 << i);
 	Button_callbackPtr[i] = callback;
 
 	return i;
 }
 
+void Button_SetCallbackDeferred(int8_t index, uint8_t isDeferred) {
+	uint32_t lock;
+
+	if(index < 0 || index > 2) {
+		// Invalid index
+		return;
+	}
+
+	// Enter critical section
+	// The flags are read by the button interrupt
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(isDeferred) {
+		Button_callbackDeferred |= 1 << index;
+	}
+	else {
+		Button_callbackDeferred &= ~(1 << index);
+	}
+	Interrupt_Unlock(lock);
+}
+
+void Button_SetGestureCallback(Button_GestureCallback_t callback) {
+	// Atomic
+	Button_gestureCallback = callback;
+}
+
+void Button_SetGestureCallbackDeferred(uint8_t isDeferred) {
+	// Atomic
+	Button_isGestureDeferred = isDeferred;
+}
+
+void Button_SetGestureConfig(const Button_GestureConfig_t *config) {
+	uint32_t lock;
+
+	// Enter critical section
+	// Gestures are tracked from the button interrupt and the tick
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	Button_gestureConfig = *config;
+	Interrupt_Unlock(lock);
+}
+
 void Button_DeleteCallback(int8_t index) {
 	if(index < 0 || index > 2) {
 		// Invalid index
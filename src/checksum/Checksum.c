@@ -0,0 +1,328 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Checksum library.
+ * Contexts hold the CRC register in the algorithm's own bit order:
+ * reflected algorithms keep it LSB-first, like the software fallback.
+ * The CRC unit always runs MSB-first (reflected input bytes, raw
+ * checksum), so the register is bit-reversed when handed over to
+ * it and back. Final XOR is only applied by Checksum_End, so that
+ * a checksum can move between hardware and software at any time.
+ */
+
+#include <stddef.h>
+#include <M451Series.h>
+#include <Checksum.h>
+#include <Interrupt.h>
+
+/**
+ * Minimum size for a PDMA transfer, in bytes.
+ * Below this, setting up the transfer costs more than it saves.
+ */
+#define CHECKSUM_PDMA_MIN_SIZE 64
+
+/**
+ * Maximum PDMA transfer count, in words.
+ */
+#define CHECKSUM_PDMA_MAX_WORDS 16384
+
+/**
+ * Sets the CRC unit write data length, without resetting it.
+ */
+#define CHECKSUM_SET_DATLEN(len) (CRC->CTL = (CRC->CTL & ~CRC_CTL_DATLEN_Msk) | (len))
+
+/**
+ * Structure for checksum algorithm parameters.
+ * This is an internal structure.
+ */
+typedef struct {
+	/**< CRC unit mode. */
+	uint32_t hwMode;
+	/**< Initial register value. */
+	uint32_t init;
+	/**< Final XOR value. */
+	uint32_t xorOut;
+	/**< Width, in bits. */
+	uint8_t width;
+	/**< True if input and output are reflected. */
+	uint8_t isReflected;
+} Checksum_Params_t;
+
+/**
+ * Algorithm parameters, indexed by Checksum_Type_t.
+ */
+static const Checksum_Params_t Checksum_params[] = {
+	{ CRC_8,     0x00,       0x00,       8,  0 },
+	{ CRC_CCITT, 0xFFFF,     0x0000,     16, 0 },
+	{ CRC_16,    0x0000,     0x0000,     16, 1 },
+	{ CRC_32,    0xFFFFFFFF, 0xFFFFFFFF, 32, 1 }
+};
+
+/**
+ * Software fallback tables, indexed by Checksum_Type_t.
+ * Each one holds the register update for a 4-bit nibble,
+ * which keeps them at 64 bytes each.
+ */
+static const uint32_t Checksum_table[][16] = {
+	{
+		0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+		0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D
+	},
+	{
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+		0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+	},
+	{
+		0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+		0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+	},
+	{
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	}
+};
+
+/**
+ * Context currently holding the CRC unit, NULL if free.
+ */
+static Checksum_Context_t * volatile Checksum_hwOwner;
+
+/**
+ * Converts a register value between the context
+ * bit order and the CRC unit bit order.
+ * This is an internal function.
+ *
+ * @param params Algorithm parameters.
+ * @param value  Register value.
+ *
+ * @return Converted register value.
+ */
+static uint32_t Checksum_Reflect(const Checksum_Params_t *params, uint32_t value) {
+	return params->isReflected ? __RBIT(value) >> (32 - params->width) : value;
+}
+
+/**
+ * Tries to take the CRC unit.
+ * This is an internal function.
+ *
+ * @param ctx Context taking the CRC unit.
+ *
+ * @return True on success, false if the unit is busy.
+ */
+static uint8_t Checksum_Acquire(Checksum_Context_t *ctx) {
+	uint32_t lock;
+	uint8_t isAcquired;
+
+	// Callers can be at any priority
+	lock = Interrupt_Lock(INTERRUPT_PRIO_ATOMIZER);
+	isAcquired = Checksum_hwOwner == NULL;
+	if(isAcquired) {
+		Checksum_hwOwner = ctx;
+	}
+	Interrupt_Unlock(lock);
+
+	return isAcquired;
+}
+
+/**
+ * Loads a context into the CRC unit.
+ * The unit must be held by the context.
+ * This is an internal function.
+ *
+ * @param ctx Checksum context.
+ */
+static void Checksum_HwStart(Checksum_Context_t *ctx) {
+	const Checksum_Params_t *params = &Checksum_params[ctx->type];
+
+	CRC_Open(params->hwMode, params->isReflected ? CRC_WDATA_RVS : 0,
+		Checksum_Reflect(params, ctx->state), CRC_CPU_WDATA_8);
+}
+
+/**
+ * Feeds data to the CRC unit from the CPU.
+ * The unit must be in 8-bit mode. Aligned data
+ * is written a word at a time.
+ * This is an internal function.
+ *
+ * @param buf  Data to feed.
+ * @param size Data size, in bytes.
+ */
+static void Checksum_HwFeed(const uint8_t *buf, uint32_t size) {
+	// Bytes up to word alignment
+	while(size != 0 && ((uint32_t) buf & 0x3)) {
+		CRC_WRITE_DATA(*buf++);
+		size--;
+	}
+
+	if(size >= 4) {
+		CHECKSUM_SET_DATLEN(CRC_CPU_WDATA_32);
+		while(size >= 4) {
+			// Little-endian: the unit takes the low byte first
+			CRC_WRITE_DATA(*(const uint32_t *) buf);
+			buf += 4;
+			size -= 4;
+		}
+		CHECKSUM_SET_DATLEN(CRC_CPU_WDATA_8);
+	}
+
+	while(size != 0) {
+		CRC_WRITE_DATA(*buf++);
+		size--;
+	}
+}
+
+/**
+ * Saves the CRC unit register to the context and releases the unit.
+ * This is an internal function.
+ *
+ * @param ctx Checksum context.
+ */
+static void Checksum_HwStop(Checksum_Context_t *ctx) {
+	ctx->state = Checksum_Reflect(&Checksum_params[ctx->type], CRC_GetChecksum());
+	Checksum_hwOwner = NULL;
+}
+
+/**
+ * Waits for the PDMA transfer on a context, if any,
+ * and feeds the data left after it.
+ * This is an internal function.
+ *
+ * @param ctx Checksum context.
+ */
+static void Checksum_Sync(Checksum_Context_t *ctx) {
+	if(!ctx->isPending) {
+		return;
+	}
+
+	while(!(PDMA_GET_TD_STS() & (1 << CHECKSUM_PDMA_CHANNEL)));
+	PDMA_CLR_TD_FLAG(1 << CHECKSUM_PDMA_CHANNEL);
+	ctx->isPending = 0;
+
+	CHECKSUM_SET_DATLEN(CRC_CPU_WDATA_8);
+	Checksum_HwFeed(ctx->tail, ctx->tailSize);
+	Checksum_HwStop(ctx);
+}
+
+void Checksum_Begin(Checksum_Context_t *ctx, Checksum_Type_t type) {
+	ctx->type = type;
+	ctx->state = Checksum_params[type].init;
+	ctx->isPending = 0;
+}
+
+void Checksum_Update(Checksum_Context_t *ctx, const void *data, uint32_t size) {
+	Checksum_Sync(ctx);
+
+	if(!Checksum_Acquire(ctx)) {
+		Checksum_UpdateSoftware(ctx, data, size);
+		return;
+	}
+
+	Checksum_HwStart(ctx);
+	Checksum_HwFeed(data, size);
+	Checksum_HwStop(ctx);
+}
+
+void Checksum_UpdateSoftware(Checksum_Context_t *ctx, const void *data, uint32_t size) {
+	const Checksum_Params_t *params;
+	const uint32_t *table;
+	const uint8_t *buf;
+	uint32_t crc, mask;
+	uint8_t shift;
+
+	Checksum_Sync(ctx);
+
+	params = &Checksum_params[ctx->type];
+	table = Checksum_table[ctx->type];
+	buf = data;
+	crc = ctx->state;
+
+	if(params->isReflected) {
+		while(size-- != 0) {
+			crc ^= *buf++;
+			crc = (crc >> 4) ^ table[crc & 0xF];
+			crc = (crc >> 4) ^ table[crc & 0xF];
+		}
+	}
+	else {
+		// Non-reflected algorithms are at most 16 bits wide
+		shift = params->width - 4;
+		mask = (1UL << params->width) - 1;
+		while(size-- != 0) {
+			crc ^= (uint32_t) *buf++ << (params->width - 8);
+			crc = ((crc << 4) & mask) ^ table[crc >> shift];
+			crc = ((crc << 4) & mask) ^ table[crc >> shift];
+		}
+	}
+
+	ctx->state = crc;
+}
+
+void Checksum_UpdateAsync(Checksum_Context_t *ctx, const void *data, uint32_t size) {
+	const uint8_t *buf = data;
+	uint32_t words;
+
+	Checksum_Sync(ctx);
+
+	if(size < CHECKSUM_PDMA_MIN_SIZE || !Checksum_Acquire(ctx)) {
+		Checksum_Update(ctx, data, size);
+		return;
+	}
+
+	Checksum_HwStart(ctx);
+
+	// PDMA moves whole words
+	while((uint32_t) buf & 0x3) {
+		CRC_WRITE_DATA(*buf++);
+		size--;
+	}
+	words = size / 4;
+	if(words > CHECKSUM_PDMA_MAX_WORDS) {
+		words = CHECKSUM_PDMA_MAX_WORDS;
+	}
+	ctx->tail = buf + words * 4;
+	ctx->tailSize = size - words * 4;
+	ctx->isPending = 1;
+
+	CHECKSUM_SET_DATLEN(CRC_CPU_WDATA_32);
+	PDMA_Open(1 << CHECKSUM_PDMA_CHANNEL);
+	PDMA_SetTransferCnt(CHECKSUM_PDMA_CHANNEL, PDMA_WIDTH_32, words);
+	PDMA_SetTransferAddr(CHECKSUM_PDMA_CHANNEL, (uint32_t) buf, PDMA_SAR_INC, (uint32_t) &CRC->DAT, PDMA_DAR_FIX);
+	PDMA_SetTransferMode(CHECKSUM_PDMA_CHANNEL, PDMA_MEM, 0, 0);
+	PDMA_SetBurstType(CHECKSUM_PDMA_CHANNEL, PDMA_REQ_BURST, PDMA_BURST_4);
+	PDMA_Trigger(CHECKSUM_PDMA_CHANNEL);
+}
+
+uint32_t Checksum_End(Checksum_Context_t *ctx) {
+	Checksum_Sync(ctx);
+
+	return ctx->state ^ Checksum_params[ctx->type].xorOut;
+}
+
+uint32_t Checksum_Compute(Checksum_Type_t type, const void *data, uint32_t size) {
+	Checksum_Context_t ctx;
+
+	Checksum_Begin(&ctx, type);
+	Checksum_Update(&ctx, data, size);
+
+	return Checksum_End(&ctx);
+}
@@ -20,82 +20,155 @@
 
 #include <M451Series.h>
 #include <Dataflash.h>
+#include <Interrupt.h>
 
 /* Offsets in the dataflash */
 #define DATAFLASH_OFFSET_HWVER       0x04
 #define DATAFLASH_OFFSET_STATUS      0x78
 #define DATAFLASH_OFFSET_BOOTFLAG    0x09
 
+/* Parameter records, appended one after the other */
+#define DATAFLASH_RECORD_COUNT       16
+
+/**
+ * Reads a word from flash through the memory map.
+ * This is much faster than an ISP read.
+ */
+#define DATAFLASH_READ_WORD(addr) (*(volatile uint32_t *) (addr))
+
+/**
+ * Checks whether a parameter record slot is blank.
+ */
+#define DATAFLASH_IS_BLANK(addr) (DATAFLASH_READ_WORD(addr) == 0xFFFFFFFF && \
+	DATAFLASH_READ_WORD((addr) + 4) == 0xFFFFFFFF)
+
+/**
+ * Checks whether a word is a storage page owner magic.
+ */
+#define DATAFLASH_IS_OWNER(word) ((word) == DATAFLASH_OWNER_BLACKBOX || \
+	(word) == DATAFLASH_OWNER_KVSTORE || (word) == DATAFLASH_OWNER_PUFFLOG)
+
 Dataflash_Info_t Dataflash_info;
 
 static uint32_t Dataflash_baseAddr;
 
 /**
- * Finds the dataflash base address.
+ * Lowest address handed out by Dataflash_AllocPages.
+ */
+static uint32_t Dataflash_allocAddr;
+
+/**
+ * RAM copy of the active parameter record.
+ */
+static uint32_t Dataflash_params[DATAFLASH_PARAMS_SIZE / 4];
+
+/**
+ * Flash ownership nesting count. Zero if the flash is free.
+ */
+static uint8_t Dataflash_writeCount;
+
+/**
+ * Flash owner context (IPSR value, 0 for thread mode).
+ */
+static uint32_t Dataflash_writeOwner;
+
+/**
+ * True if the system control registers were locked
+ * when the flash was taken.
+ */
+static uint8_t Dataflash_wasLocked;
+
+/**
+ * Active record address from the previous boot.
+ * Valid if check is its bitwise NOT. Survives resets.
+ */
+static struct {
+	uint32_t addr;
+	uint32_t check;
+} Dataflash_cache __attribute((section(".noinit")));
+
+/**
+ * Finds the dataflash base address, i.e. the active parameter record.
+ * Records are appended in order, so the active one is the one before
+ * the first blank slot. On a warm reset, the record from the previous
+ * boot is still active if it is still written (the page may have been
+ * erased since) and the slot after it is blank. Otherwise, the first
+ * blank slot is found with a binary search.
  * This is an internal function.
  *
  * @return The dataflash base address.
  */
 static uint32_t Dataflash_GetBaseAddress() {
-	uint32_t base, offset;
+	uint32_t base, end, addr;
+	uint8_t lo, hi, mid;
 
 	base = FMC_ReadDataFlashBaseAddr();
-	for(offset = 0; offset < 0x1000; offset += 0x100) {
-		if(FMC_Read(base + offset) == 0xFFFFFFFF && FMC_Read(base + offset + 4) == 0xFFFFFFFF) {
-			break;
-		}
+	end = base + DATAFLASH_RECORD_COUNT * DATAFLASH_PARAMS_SIZE;
+
+	addr = Dataflash_cache.addr;
+	if(Dataflash_cache.check == ~addr && addr >= base && addr < end &&
+		(addr - base) % DATAFLASH_PARAMS_SIZE == 0 &&
+		(addr == base || !DATAFLASH_IS_BLANK(addr)) &&
+		(addr + DATAFLASH_PARAMS_SIZE == end || DATAFLASH_IS_BLANK(addr + DATAFLASH_PARAMS_SIZE))) {
+		return addr;
 	}
 
-	if(offset != 0) {
-		base += offset - 0x100;
+	// First blank slot is in [lo, hi], hi meaning none
+	lo = 0;
+	hi = DATAFLASH_RECORD_COUNT;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(DATAFLASH_IS_BLANK(base + mid * DATAFLASH_PARAMS_SIZE)) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
 	}
 
-	return base;
+	addr = base + (lo == 0 ? 0 : lo - 1) * DATAFLASH_PARAMS_SIZE;
+	Dataflash_cache.addr = addr;
+	Dataflash_cache.check = ~addr;
+
+	return addr;
 }
 
 /**
- * Reads a single byte from the dataflash.
+ * Copies the active parameter record to RAM.
  * This is an internal function.
- *
- * @param addr Address to read from.
- *
- * @return Read byte.
  */
-static uint8_t Dataflash_ReadByte(uint32_t addr) {
-	uint32_t data;
-	uint8_t shift;
-
-	// Read the word containing the byte
-	data = FMC_Read(addr & 0xFFFFFFFC);
-
-	// Little-endian
-	shift = (addr & 0x3) * 8;
+static void Dataflash_ReadParams() {
+	uint8_t i;
 
-	return (data >> shift) & 0xFF;
+	for(i = 0; i < DATAFLASH_PARAMS_SIZE / 4; i++) {
+		Dataflash_params[i] = DATAFLASH_READ_WORD(Dataflash_baseAddr + i * 4);
+	}
 }
 
 /**
  * Writes a byte to the dataflash.
+ * The RAM copy of the parameters is updated too.
  * This is an internal function.
  *
- * @param addr  Address to write to.
- * @param value Byte to write.
+ * @param offset Offset in the parameter record.
+ * @param value  Byte to write.
  */
-static void Dataflash_WriteByte(uint32_t addr, uint8_t value) {
-	uint32_t alignedAddr, data;
+static void Dataflash_WriteByte(uint32_t offset, uint8_t value) {
+	uint32_t alignedOffset, data;
 	uint8_t shift;
 
 	// Read the word containing the byte
-	alignedAddr = addr & 0xFFFFFFFC;
-	data = FMC_Read(alignedAddr);
+	alignedOffset = offset & 0xFFFFFFFC;
+	data = Dataflash_params[alignedOffset / 4];
 
 	// Little-endian
-	shift = (addr & 0x3) * 8;
+	shift = (offset & 0x3) * 8;
 
 	// Write the updated word
 	data &= ~(0xFF << shift);
 	data |= value << shift;
-	FMC_Write(alignedAddr, data);
+	Dataflash_Program(Dataflash_baseAddr + alignedOffset, data);
+	Dataflash_params[alignedOffset / 4] = DATAFLASH_READ_WORD(Dataflash_baseAddr + alignedOffset);
 }
 
 /**
@@ -107,25 +180,125 @@ static void Dataflash_SetBootAPROM() {
 	// An erased flash bit is 1, programmed is 0.
 	// Since the APROM boot flag is zero, erasing is not required.
 	// From datasheet: "minimum program bit size is 32 bits", so we're in the clear.
-	Dataflash_WriteByte(Dataflash_baseAddr + DATAFLASH_OFFSET_BOOTFLAG, DATAFLASH_BOOTFLAG_APROM);
-	Dataflash_info.bootFlag = Dataflash_ReadByte(Dataflash_baseAddr + DATAFLASH_OFFSET_BOOTFLAG);
+	if(!Dataflash_BeginWrite()) {
+		return;
+	}
+	Dataflash_WriteByte(DATAFLASH_OFFSET_BOOTFLAG, DATAFLASH_BOOTFLAG_APROM);
+	Dataflash_EndWrite();
+	Dataflash_info.bootFlag = Dataflash_GetParams()[DATAFLASH_OFFSET_BOOTFLAG];
 }
 
 void Dataflash_Init() {
-	// Init FMC and find base
-	FMC_Open();
+	const uint8_t *params;
+
+	// Find base and read the parameters in one go
 	Dataflash_baseAddr = Dataflash_GetBaseAddress();
+	Dataflash_ReadParams();
 
 	// Populate info structure
-	Dataflash_info.hwVersion = Dataflash_ReadByte(Dataflash_baseAddr + DATAFLASH_OFFSET_HWVER);
-	Dataflash_info.status = FMC_Read(Dataflash_baseAddr + DATAFLASH_OFFSET_STATUS);
-	Dataflash_info.bootFlag = Dataflash_ReadByte(Dataflash_baseAddr + DATAFLASH_OFFSET_BOOTFLAG);
+	params = Dataflash_GetParams();
+	Dataflash_info.hwVersion = params[DATAFLASH_OFFSET_HWVER];
+	Dataflash_info.status = Dataflash_params[DATAFLASH_OFFSET_STATUS / 4];
+	Dataflash_info.bootFlag = params[DATAFLASH_OFFSET_BOOTFLAG];
 
 	// Update boot flag
 	if(Dataflash_info.bootFlag != DATAFLASH_BOOTFLAG_APROM) {
 		Dataflash_SetBootAPROM();
 	}
 
-	// Close FMC
-	FMC_Close();
+	// Storage pages go right below the dataflash
+	Dataflash_allocAddr = FMC_ReadDataFlashBaseAddr() & ~(FMC_FLASH_PAGE_SIZE - 1);
+}
+
+uint32_t Dataflash_AllocPages(uint8_t count, uint32_t owner) {
+	// Defined by linker script
+	extern char Data_Start_ROM;
+	extern char Data_Size;
+	uint32_t addr, page, pageOwner;
+
+	addr = Dataflash_allocAddr - count * FMC_FLASH_PAGE_SIZE;
+	if(count == 0 || addr > Dataflash_allocAddr ||
+		addr < (uint32_t) &Data_Start_ROM + (uint32_t) &Data_Size) {
+		return 0;
+	}
+
+	// Don't hand out another store's pages
+	for(page = addr; page < Dataflash_allocAddr; page += FMC_FLASH_PAGE_SIZE) {
+		pageOwner = DATAFLASH_READ_WORD(page);
+		if(pageOwner != owner && DATAFLASH_IS_OWNER(pageOwner)) {
+			return 0;
+		}
+	}
+
+	Dataflash_allocAddr = addr;
+	return addr;
+}
+
+uint8_t Dataflash_BeginWrite() {
+	uint32_t lock, context;
+
+	// Flash writers run at GPIO priority at most
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+
+	context = __get_IPSR();
+	if(Dataflash_writeCount != 0 && Dataflash_writeOwner != context) {
+		Interrupt_Unlock(lock);
+		return 0;
+	}
+
+	if(Dataflash_writeCount++ == 0) {
+		Dataflash_writeOwner = context;
+		Dataflash_wasLocked = SYS_IsRegLocked();
+		if(Dataflash_wasLocked) {
+			SYS_UnlockReg();
+		}
+
+		FMC_Open();
+		FMC_ENABLE_AP_UPDATE();
+	}
+
+	Interrupt_Unlock(lock);
+
+	return 1;
+}
+
+void Dataflash_EndWrite() {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+
+	if(Dataflash_writeCount != 0 && --Dataflash_writeCount == 0) {
+		FMC_DISABLE_AP_UPDATE();
+		FMC_Close();
+
+		if(Dataflash_wasLocked) {
+			SYS_LockReg();
+		}
+	}
+
+	Interrupt_Unlock(lock);
+}
+
+void Dataflash_Program(uint32_t addr, uint32_t data) {
+	uint32_t lock;
+
+	// ISP registers are written in several steps
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	FMC_Write(addr, data);
+	Interrupt_Unlock(lock);
+}
+
+uint8_t Dataflash_ErasePage(uint32_t addr) {
+	uint32_t lock;
+	int32_t ret;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	ret = FMC_Erase(addr);
+	Interrupt_Unlock(lock);
+
+	return ret == 0;
+}
+
+const uint8_t *Dataflash_GetParams() {
+	return (const uint8_t *) Dataflash_params;
 }
@@ -0,0 +1,125 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Deferred work queue.
+ * Producers (any context) reserve a slot by bumping the write index
+ * with LDREX/STREX, fill it and then mark it ready. The only consumer
+ * is the PendSV handler, which runs ready slots in order and stops at
+ * the first reserved-but-unfilled one. The producer that fills it pends
+ * PendSV again, so nothing is left behind.
+ */
+
+#include <M451Series.h>
+#include <Deferred.h>
+#include <Interrupt.h>
+
+/**
+ * Structure for a queue slot.
+ */
+typedef struct {
+	/**< Work function. */
+	Deferred_Callback_t callback;
+	/**< Work function argument. */
+	uint32_t callbackData;
+	/**< True when the slot has been filled. */
+	volatile uint8_t isReady;
+} Deferred_Item_t;
+
+/**
+ * Work queue.
+ */
+static Deferred_Item_t Deferred_queue[DEFERRED_QUEUE_SIZE];
+
+/**
+ * Write index. Free running, bumped by producers.
+ */
+static volatile uint32_t Deferred_writeIndex;
+
+/**
+ * Read index. Free running, only written by PendSV.
+ */
+static volatile uint32_t Deferred_readIndex;
+
+/**
+ * Number of dropped work items.
+ */
+static volatile uint32_t Deferred_dropCount;
+
+/**
+ * PendSV handler: runs all ready work items.
+ */
+void PendSV_Handler() {
+	Deferred_Item_t *item;
+	Deferred_Callback_t callback;
+	uint32_t callbackData;
+
+	while(1) {
+		item = &Deferred_queue[Deferred_readIndex & (DEFERRED_QUEUE_SIZE - 1)];
+		if(!item->isReady) {
+			break;
+		}
+
+		// Release the slot before running the work, so
+		// that the work itself can post more items
+		callback = item->callback;
+		callbackData = item->callbackData;
+		item->isReady = 0;
+		__DMB();
+		Deferred_readIndex++;
+
+		callback(callbackData);
+	}
+}
+
+void Deferred_Init() {
+	// Lowest priority, so that work never delays other ISRs
+	NVIC_SetPriority(PendSV_IRQn, INTERRUPT_PRIO_LOWEST);
+}
+
+uint8_t Deferred_Post(Deferred_Callback_t callback, uint32_t callbackData) {
+	Deferred_Item_t *item;
+	uint32_t index;
+
+	// Reserve a slot
+	do {
+		index = __LDREXW(&Deferred_writeIndex);
+		if(index - Deferred_readIndex >= DEFERRED_QUEUE_SIZE) {
+			__CLREX();
+			Deferred_dropCount++;
+			return 0;
+		}
+	} while(__STREXW(index + 1, &Deferred_writeIndex));
+
+	// Fill it and publish it
+	item = &Deferred_queue[index & (DEFERRED_QUEUE_SIZE - 1)];
+	item->callback = callback;
+	item->callbackData = callbackData;
+	__DMB();
+	item->isReady = 1;
+
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+	return 1;
+}
+
+uint32_t Deferred_GetDropCount() {
+	return Deferred_dropCount;
+}
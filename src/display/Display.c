@@ -38,14 +38,68 @@
 #include <Display_SSD.h>
 #include <Font.h>
 #include <Dataflash.h>
+#include <TimerUtils.h>
 
 /**
  * Global framebuffer.
  */
 static uint8_t Display_framebuf[DISPLAY_FRAMEBUFFER_SIZE];
 
+/**
+ * Copy of the controller GDDRAM contents, in framebuffer format.
+ */
+static uint8_t Display_shadowbuf[DISPLAY_FRAMEBUFFER_SIZE];
+
+/**
+ * True if Display_shadowbuf matches the controller.
+ */
+static uint8_t Display_isShadowValid;
+
+/**
+ * Framebuffer region changed since the last update.
+ * Clean pages have startX = DISPLAY_WIDTH and endX = 0,
+ * so that marking a range only needs a min and a max.
+ */
+static Display_SSD_Dirty_t Display_dirty;
+
+/**
+ * Update statistics.
+ */
+static Display_Stats_t Display_stats;
+
 static Display_Type_t Display_type;
 
+/**
+ * Marks a framebuffer region as changed.
+ * This is an internal function.
+ *
+ * @param startX    First column.
+ * @param endX      Last column.
+ * @param startPage First page.
+ * @param endPage   Last page.
+ */
+static void Display_MarkDirty(int startX, int endX, int startPage, int endPage) {
+	int page;
+
+	for(page = startPage; page <= endPage; page++) {
+		if(startX < Display_dirty.startX[page]) {
+			Display_dirty.startX[page] = startX;
+		}
+		if(endX > Display_dirty.endX[page]) {
+			Display_dirty.endX[page] = endX;
+		}
+	}
+}
+
+/**
+ * Forces the next update to send the whole framebuffer.
+ * This is an internal function.
+ */
+static void Display_Invalidate() {
+	Display_isShadowValid = 0;
+	Display_MarkDirty(0, DISPLAY_WIDTH - 1, 0, DISPLAY_HEIGHT / 8 - 1);
+}
+
 void Display_SetupSPI() {
 	// Setup output pins
 	PA0 = 0;
@@ -64,6 +118,7 @@ void Display_SetupSPI() {
 	SYS->GPE_MFPH |= SYS_GPE_MFPH_PE11MFP_SPI0_MOSI0 | SYS_GPE_MFPH_PE12MFP_SPI0_SS | SYS_GPE_MFPH_PE13MFP_SPI0_CLK;
 
 	// SPI0 master, MSB first, 8bit transaction, SPI Mode-0 timing, 4MHz clock
+	// The clock is raised once the controller type is known
 	SPI_Open(SPI0, SPI_MASTER, SPI_MODE_0, 8, 4000000);
 
 	// Low level active
@@ -87,7 +142,9 @@ void Display_Init() {
 			Display_type = DISPLAY_SSD1306;
 			break;
 	}
+	// GDDRAM contents are unknown
 	Display_Clear();
+	Display_Invalidate();
 	Display_SSD_Init();
 }
 
@@ -107,7 +164,8 @@ void Display_Flip() {
 	Dataflash_info.status ^= DATAFLASH_STATUS_FLIP;
 	Display_SSD_SetOn(0);
 	Display_SSD_Flip();
-	Display_SSD_Update(Display_framebuf);
+	Display_Invalidate();
+	Display_Update();
 	Display_SSD_SetOn(1);
 }
 
@@ -116,10 +174,76 @@ void Display_SetInverted(bool invert) {
 }
 
 void Display_Update() {
-	Display_SSD_Update(Display_framebuf);
+	uint32_t byteCount;
+	uint64_t startTime;
+	int page, x, offset;
+
+	if(Display_isShadowValid) {
+		// Trim dirty columns that match the controller
+		for(page = 0; page < DISPLAY_HEIGHT / 8; page++) {
+			while(Display_dirty.startX[page] <= Display_dirty.endX[page]) {
+				offset = Display_dirty.startX[page] * (DISPLAY_HEIGHT / 8) + page;
+				if(Display_framebuf[offset] != Display_shadowbuf[offset]) {
+					break;
+				}
+				Display_dirty.startX[page]++;
+			}
+			while(Display_dirty.startX[page] <= Display_dirty.endX[page]) {
+				offset = Display_dirty.endX[page] * (DISPLAY_HEIGHT / 8) + page;
+				if(Display_framebuf[offset] != Display_shadowbuf[offset]) {
+					break;
+				}
+				Display_dirty.endX[page]--;
+			}
+		}
+	}
+
+	byteCount = Display_SSD_GetByteCount();
+	startTime = Timer_GetMicros();
+	Display_SSD_Update(Display_framebuf, &Display_dirty);
+	Display_stats.lastFrameMicros = Timer_GetMicros() - startTime;
+	byteCount = Display_SSD_GetByteCount() - byteCount;
+
+	// Sync shadow and mark everything clean
+	for(page = 0; page < DISPLAY_HEIGHT / 8; page++) {
+		for(x = Display_dirty.startX[page]; x <= Display_dirty.endX[page]; x++) {
+			offset = x * (DISPLAY_HEIGHT / 8) + page;
+			Display_shadowbuf[offset] = Display_framebuf[offset];
+		}
+		Display_dirty.startX[page] = DISPLAY_WIDTH;
+		Display_dirty.endX[page] = 0;
+	}
+	Display_isShadowValid = 1;
+
+	Display_stats.frameCount++;
+	Display_stats.lastFrameBytes = byteCount;
+	Display_stats.totalBytes += byteCount;
+}
+
+void Display_GetStats(Display_Stats_t *stats) {
+	*stats = Display_stats;
 }
 
 void Display_Clear() {
+	int page, x, startX, endX;
+
+	// Only lit columns change
+	for(page = 0; page < DISPLAY_HEIGHT / 8; page++) {
+		startX = DISPLAY_WIDTH;
+		endX = -1;
+		for(x = 0; x < DISPLAY_WIDTH; x++) {
+			if(Display_framebuf[x * (DISPLAY_HEIGHT / 8) + page] != 0x00) {
+				if(startX == DISPLAY_WIDTH) {
+					startX = x;
+				}
+				endX = x;
+			}
+		}
+		if(endX >= 0) {
+			Display_MarkDirty(startX, endX, page, page);
+		}
+	}
+
 	memset(Display_framebuf, 0x00, DISPLAY_FRAMEBUFFER_SIZE);
 }
 
@@ -218,6 +342,8 @@ void Display_PutPixels(int x, int y, const uint8_t *bitmap, int w, int h) {
 	// Row containing the first point of the bitmap
 	startRow = y / 8;
 
+	Display_MarkDirty(x, x + w - 1, startRow, (y + h - 1) / 8);
+
 	for(curX = 0; curX < w; curX++) {
 		// Copy column
 		Display_BitCopy(&Display_framebuf[(x + curX) * (DISPLAY_HEIGHT / 8) + startRow],
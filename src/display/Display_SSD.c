@@ -25,17 +25,32 @@
 #include <Display_SSD1306.h>
 #include <Display_SSD1327.h>
 
+/**
+ * Number of bytes sent to the controller.
+ */
+static uint32_t Display_SSD_byteCount;
+
 void Display_SSD_Write(uint8_t isData, const uint8_t *buf, uint32_t len) {
-	int i;
+	uint32_t i;
 
-	// Set D/C#
-	DISPLAY_SSD_DC = isData ? 1 : 0;
+	isData = isData ? 1 : 0;
+	if(DISPLAY_SSD_DC != isData) {
+		// D/C# is sampled with each byte: let queued bytes out first
+		Display_SSD_Flush();
+		DISPLAY_SSD_DC = isData;
+	}
 
 	for(i = 0; i < len; i++) {
-		// Send byte, wait until it is transmitted
+		// Queue byte, only waiting when the TX FIFO is full
+		while(SPI_GET_TX_FIFO_FULL_FLAG(SPI0));
 		SPI_WRITE_TX(SPI0, buf[i]);
-		while(SPI_IS_BUSY(SPI0));
 	}
+
+	Display_SSD_byteCount += len;
+}
+
+void Display_SSD_Flush() {
+	while(!SPI_GET_TX_FIFO_EMPTY_FLAG(SPI0) || SPI_IS_BUSY(SPI0));
 }
 
 void Display_SSD_SendCommand(uint8_t cmd) {
@@ -60,22 +75,26 @@ void Display_SSD_SetInverted(bool invert) {
 	}
 }
 
-void Display_SSD_Update(const uint8_t *framebuf) {
+void Display_SSD_Update(const uint8_t *framebuf, const Display_SSD_Dirty_t *dirty) {
 	if(Display_GetType() == DISPLAY_SSD1327) {
-		Display_SSD1327_Update(framebuf);
+		Display_SSD1327_Update(framebuf, dirty);
 	}
 	else {
-		Display_SSD1306_Update(framebuf);
+		Display_SSD1306_Update(framebuf, dirty);
 	}
+
+	Display_SSD_Flush();
 }
 
 void Display_SSD_Init() {
 	// Power on and initialize controller
 	if(Display_GetType() == DISPLAY_SSD1327) {
+		SPI_SetBusClock(SPI0, DISPLAY_SSD1327_SPI_CLOCK);
 		Display_SSD1327_PowerOn();
 		Display_SSD1327_SendInitCmds();
 	}
 	else {
+		SPI_SetBusClock(SPI0, DISPLAY_SSD1306_SPI_CLOCK);
 		Display_SSD1306_PowerOn();
 		Display_SSD1306_SendInitCmds();
 	}
@@ -96,4 +115,9 @@ void Display_SSD_Init() {
 
 void Display_SSD_SetOn(uint8_t isOn) {
 	Display_SSD_SendCommand(isOn ? SSD_DISPLAY_ON : SSD_DISPLAY_OFF);
+	Display_SSD_Flush();
+}
+
+uint32_t Display_SSD_GetByteCount() {
+	return Display_SSD_byteCount;
 }
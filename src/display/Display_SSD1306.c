@@ -57,19 +57,27 @@ void Display_SSD1306_SendInitCmds() {
 	Display_SSD_Write(0, Display_SSD1306_initCmds, sizeof(Display_SSD1306_initCmds));
 }
 
-void Display_SSD1306_Update(const uint8_t *framebuf) {
-	int page, x;
+void Display_SSD1306_Update(const uint8_t *framebuf, const Display_SSD_Dirty_t *dirty) {
+	uint8_t buf[DISPLAY_WIDTH];
+	int page, x, col;
 
 	for(page = 0; page < SSD1306_NUM_PAGES; page++) {
-		// Set page start address (start 0x00, end 0x12/0x10)
+		if(dirty->startX[page] > dirty->endX[page]) {
+			continue;
+		}
+
+		// Set page and column start address.
+		// Columns start at 32 when flipped.
+		col = dirty->startX[page] + (Display_IsFlipped() ? 32 : 0);
 		Display_SSD_SendCommand(SSD1306_PAGE_START_ADDRESS | page);
-		Display_SSD_SendCommand(0x00);
-		Display_SSD_SendCommand(Display_IsFlipped() ? 0x12 : 0x10);
+		Display_SSD_SendCommand(SSD1306_SET_COL_LOW | (col & 0x0F));
+		Display_SSD_SendCommand(SSD1306_SET_COL_HIGH | (col >> 4));
 
-		// Write page to GDDRAM
-		for(x = 0; x < DISPLAY_WIDTH; x++) {
-			Display_SSD_Write(1, &framebuf[x * (DISPLAY_HEIGHT / 8) + page], 1);
+		// Gather the page bytes, then write them to GDDRAM
+		for(x = dirty->startX[page]; x <= dirty->endX[page]; x++) {
+			buf[x - dirty->startX[page]] = framebuf[x * (DISPLAY_HEIGHT / 8) + page];
 		}
+		Display_SSD_Write(1, buf, dirty->endX[page] - dirty->startX[page] + 1);
 	}
 }
 
@@ -66,32 +66,41 @@ void Display_SSD1327_SendInitCmds() {
 	Display_SSD_Write(0, Display_SSD1327_initCmds, sizeof(Display_SSD1327_initCmds));
 }
 
-void Display_SSD1327_Update(const uint8_t *framebuf) {
-	int col, row, bit;
-	uint8_t value, pixelOne, pixelTwo;
+void Display_SSD1327_Update(const uint8_t *framebuf, const Display_SSD_Dirty_t *dirty) {
+	int col, row, bit, startCol, endCol;
+	uint8_t value[8], pixelOne, pixelTwo;
 
-	Display_SSD_SendCommand(SSD1327_SET_ROW_ADDRESS);
-	Display_SSD_SendCommand(0x00); // Start
-	Display_SSD_SendCommand(0x7F); // End
+	for(row = 0; row < (DISPLAY_HEIGHT / 8); row++) {
+		if(dirty->startX[row] > dirty->endX[row]) {
+			continue;
+		}
+
+		// Each GDDRAM column holds two pixels
+		startCol = dirty->startX[row] & ~1;
+		endCol = dirty->endX[row] | 1;
 
-	Display_SSD_SendCommand(SSD1327_SET_COL_ADDRESS);
-	Display_SSD_SendCommand(0x10); // Start
-	Display_SSD_SendCommand(0x2F); // End
+		// Window over the 8 pixel rows of the page. GDDRAM
+		// is set up for vertical address increment.
+		Display_SSD_SendCommand(SSD1327_SET_ROW_ADDRESS);
+		Display_SSD_SendCommand(row * 8);     // Start
+		Display_SSD_SendCommand(row * 8 + 7); // End
 
-	// SSD1327 uses 4 bits per pixel but framebuffer is 1 bit per pixel.
-	for(col = 0; col < DISPLAY_WIDTH; col += 2) {
-		for(row = 0; row < (DISPLAY_HEIGHT / 8); row++) {
+		Display_SSD_SendCommand(SSD1327_SET_COL_ADDRESS);
+		Display_SSD_SendCommand(0x10 + startCol / 2); // Start
+		Display_SSD_SendCommand(0x10 + endCol / 2);   // End
+
+		// SSD1327 uses 4 bits per pixel but framebuffer is 1 bit per pixel.
+		for(col = startCol; col < endCol; col += 2) {
 			for(bit = 0; bit < 8; bit++) {
-				value = 0x0;
+				value[bit] = 0x0;
 
 				pixelOne = framebuf[row + ((DISPLAY_HEIGHT / 8) * col)] >> bit & 0x01;
 				pixelTwo = framebuf[row + ((DISPLAY_HEIGHT / 8) * (col + 1))] >> bit & 0x01;
 
-				value |= (pixelOne) ? GRAYLOW   : 0x00;
-				value |= (pixelTwo) ? GRAYHIGH  : 0x00;
-
-				Display_SSD_Write(1, &value, 1);
+				value[bit] |= (pixelOne) ? GRAYLOW   : 0x00;
+				value[bit] |= (pixelTwo) ? GRAYHIGH  : 0x00;
 			}
+			Display_SSD_Write(1, value, 8);
 		}
 	}
 }
@@ -0,0 +1,133 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Event queue.
+ * This is a multi-producer, single-consumer ring with the same
+ * reserve/fill/publish scheme as the deferred work queue: producers
+ * bump the write index with LDREX/STREX, fill the slot and mark it
+ * ready. The consumer stops at the first slot that isn't ready yet.
+ */
+
+#include <M451Series.h>
+#include <Event.h>
+#include <TimerUtils.h>
+#include <Idle.h>
+
+/**
+ * Structure for a queue slot.
+ */
+typedef struct {
+	/**< Event. */
+	Event_t event;
+	/**< True when the slot has been filled. */
+	volatile uint8_t isReady;
+} Event_Item_t;
+
+/**
+ * Event queue.
+ */
+static Event_Item_t Event_queue[EVENT_QUEUE_SIZE];
+
+/**
+ * Write index. Free running, bumped by producers.
+ */
+static volatile uint32_t Event_writeIndex;
+
+/**
+ * Read index. Free running, only written by the consumer.
+ */
+static volatile uint32_t Event_readIndex;
+
+/**
+ * Mask of SDK event types to queue.
+ */
+static volatile uint32_t Event_mask;
+
+/**
+ * Number of dropped events.
+ */
+static volatile uint32_t Event_dropCount;
+
+void Event_SetMask(uint32_t mask) {
+	Event_mask = mask;
+}
+
+uint8_t Event_Post(uint8_t type, uint16_t data) {
+	Event_Item_t *item;
+	uint32_t index;
+
+	if(type < EVENT_USER && !(Event_mask & EVENT_MASK(type))) {
+		return 0;
+	}
+
+	// Reserve a slot
+	do {
+		index = __LDREXW(&Event_writeIndex);
+		if(index - Event_readIndex >= EVENT_QUEUE_SIZE) {
+			__CLREX();
+			Event_dropCount++;
+			return 0;
+		}
+	} while(__STREXW(index + 1, &Event_writeIndex));
+
+	// Fill it and publish it
+	item = &Event_queue[index & (EVENT_QUEUE_SIZE - 1)];
+	item->event.type = type;
+	item->event.data = data;
+	item->event.timestamp = Timer_GetMillis();
+	__DMB();
+	item->isReady = 1;
+
+	return 1;
+}
+
+uint8_t Event_Poll(Event_t *event) {
+	Event_Item_t *item;
+
+	item = &Event_queue[Event_readIndex & (EVENT_QUEUE_SIZE - 1)];
+	if(!item->isReady) {
+		return 0;
+	}
+
+	*event = item->event;
+	item->isReady = 0;
+	__DMB();
+	Event_readIndex++;
+
+	return 1;
+}
+
+void Event_Wait(Event_t *event) {
+	while(1) {
+		// Check and sleep with PRIMASK set, so that an event
+		// posted in between wakes up the core right away
+		__set_PRIMASK(1);
+		if(Event_Poll(event)) {
+			__set_PRIMASK(0);
+			return;
+		}
+		Idle_Sleep();
+	}
+}
+
+uint32_t Event_GetDropCount() {
+	return Event_dropCount;
+}
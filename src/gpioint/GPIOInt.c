@@ -0,0 +1,174 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * GPIO interrupt dispatcher.
+ * Each port interrupt handler snapshots the pending flags, clears
+ * exactly those, and then runs the handlers for the pending pins
+ * only. Edges that come in while handlers run stay pending and
+ * re-trigger the interrupt, so nothing is lost.
+ */
+
+#include <M451Series.h>
+#include <GPIOInt.h>
+#include <Interrupt.h>
+
+/**
+ * Number of GPIO ports with an interrupt (PA to PF).
+ */
+#define GPIOINT_PORT_COUNT 6
+
+/**
+ * Gets the index (0 for PA) of a GPIO port.
+ */
+#define GPIOINT_PORT_INDEX(port) (((uint32_t) (port) - PA_BASE) / (PB_BASE - PA_BASE))
+
+/**
+ * Gets a GPIO port from its index.
+ */
+#define GPIOINT_PORT(index) ((GPIO_T *) (PA_BASE + (index) * (PB_BASE - PA_BASE)))
+
+/**
+ * Checks whether a port (PA to PF) and pin number are valid.
+ */
+#define GPIOINT_IS_VALID(port, pin) ((uint32_t) (port) >= PA_BASE && \
+	GPIOINT_PORT_INDEX(port) < GPIOINT_PORT_COUNT && \
+	GPIOINT_PORT(GPIOINT_PORT_INDEX(port)) == (port) && (pin) < 16)
+
+/**
+ * Structure for a pin handler.
+ */
+typedef struct {
+	/**< Handler function. NULL if the slot is free. */
+	volatile GPIOInt_Callback_t callback;
+	/**< Handler function argument. */
+	uint32_t callbackData;
+} GPIOInt_Handler_t;
+
+/**
+ * Pin handlers.
+ */
+static GPIOInt_Handler_t GPIOInt_handler[GPIOINT_MAX_HANDLERS];
+
+/**
+ * Handler index + 1 for each pin, 0 if none.
+ */
+static volatile uint8_t GPIOInt_pinSlot[GPIOINT_PORT_COUNT][16];
+
+/**
+ * Runs the handlers for the pending pins of a port.
+ * This is an internal function.
+ *
+ * @param portIndex Port index (0 for PA).
+ */
+static void GPIOInt_Dispatch(uint8_t portIndex) {
+	GPIO_T *port;
+	GPIOInt_Handler_t *handler;
+	uint32_t pending;
+	uint8_t pin, slot;
+
+	// Clear only the flags we are going to service
+	port = GPIOINT_PORT(portIndex);
+	pending = port->INTSRC;
+	port->INTSRC = pending;
+
+	while(pending) {
+		pin = 31 - __CLZ(pending);
+		pending &= ~(1UL << pin);
+
+		slot = GPIOInt_pinSlot[portIndex][pin];
+		if(slot != 0) {
+			handler = &GPIOInt_handler[slot - 1];
+			handler->callback(handler->callbackData);
+		}
+	}
+}
+
+/**
+ * Defines the interrupt handler for a GPIO port.
+ */
+#define GPIOINT_DEFINE_IRQ_HANDLER(p, n) void GP ## p ## _IRQHandler() { \
+	GPIOInt_Dispatch(n); \
+}
+
+GPIOINT_DEFINE_IRQ_HANDLER(A, 0)
+GPIOINT_DEFINE_IRQ_HANDLER(B, 1)
+GPIOINT_DEFINE_IRQ_HANDLER(C, 2)
+GPIOINT_DEFINE_IRQ_HANDLER(D, 3)
+GPIOINT_DEFINE_IRQ_HANDLER(E, 4)
+GPIOINT_DEFINE_IRQ_HANDLER(F, 5)
+
+int8_t GPIOInt_Register(GPIO_T *port, uint8_t pin, uint32_t intAttr, GPIOInt_Callback_t callback, uint32_t callbackData) {
+	uint32_t lock;
+	uint8_t i, portIndex;
+
+	if(!GPIOINT_IS_VALID(port, pin) || callback == NULL) {
+		return -1;
+	}
+	portIndex = GPIOINT_PORT_INDEX(port);
+
+	// Enter critical section
+	// Handlers can be registered from interrupts, up to GPIO priority
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(GPIOInt_pinSlot[portIndex][pin] != 0) {
+		Interrupt_Unlock(lock);
+		return -1;
+	}
+
+	// Find an unused handler
+	for(i = 0; i < GPIOINT_MAX_HANDLERS && GPIOInt_handler[i].callback != NULL; i++);
+	if(i == GPIOINT_MAX_HANDLERS) {
+		Interrupt_Unlock(lock);
+		return -1;
+	}
+
+	// The pin slot must be set as last
+	GPIOInt_handler[i].callbackData = callbackData;
+	GPIOInt_handler[i].callback = callback;
+	GPIOInt_pinSlot[portIndex][pin] = i + 1;
+
+	GPIO_EnableInt(port, pin, intAttr);
+	Interrupt_Unlock(lock);
+
+	NVIC_SetPriority((IRQn_Type) (GPA_IRQn + portIndex), INTERRUPT_PRIO_GPIO);
+	NVIC_EnableIRQ((IRQn_Type) (GPA_IRQn + portIndex));
+
+	return i;
+}
+
+void GPIOInt_Unregister(GPIO_T *port, uint8_t pin) {
+	uint32_t lock;
+	uint8_t slot, portIndex;
+
+	if(!GPIOINT_IS_VALID(port, pin)) {
+		return;
+	}
+	portIndex = GPIOINT_PORT_INDEX(port);
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	slot = GPIOInt_pinSlot[portIndex][pin];
+	if(slot != 0) {
+		// Disable the interrupt before freeing the handler
+		GPIO_DisableInt(port, pin);
+		GPIOInt_pinSlot[portIndex][pin] = 0;
+		GPIOInt_handler[slot - 1].callback = NULL;
+	}
+	Interrupt_Unlock(lock);
+}
@@ -0,0 +1,171 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Idle manager.
+ * The sleep decision and WFI happen with PRIMASK set: a pending
+ * interrupt still wakes the core, and it is served once PRIMASK
+ * is cleared on the way out. This way an interrupt that comes in
+ * after the decision can't be missed.
+ * Wakeup from power-down is signaled by the PWRWU interrupt.
+ * GPIO interrupts for buttons and PD.7 are enabled by their
+ * libraries, and the USB wakeup is enabled here.
+ */
+
+#include <M451Series.h>
+#include <Idle.h>
+#include <TimerUtils.h>
+#include <TimerWheel.h>
+#include <Atomizer.h>
+#include <Interrupt.h>
+
+/**
+ * True if power-down is allowed.
+ */
+static uint8_t Idle_isPowerDownEnabled;
+
+/**
+ * Time spent in sleep mode, in us.
+ */
+static uint64_t Idle_sleepTime;
+
+/**
+ * Number of sleeps.
+ */
+static uint32_t Idle_sleepCount;
+
+/**
+ * Number of power-downs.
+ */
+static uint32_t Idle_powerDownCount;
+
+/**
+ * Power-down wakeup interrupt handler.
+ */
+void PWRWU_IRQHandler() {
+	// Write 1 to clear
+	CLK->PWRCTL |= CLK_PWRCTL_PDWKIF_Msk;
+}
+
+/**
+ * Enters power-down mode, and returns after wakeup.
+ * Must be called with PRIMASK set.
+ * This is an internal function.
+ */
+static void Idle_PowerDown() {
+	SYS_UnlockReg();
+
+	CLK->PWRCTL |= CLK_PWRCTL_PDWKIEN_Msk;
+	NVIC_EnableIRQ(PWRWU_IRQn);
+
+	// Wake up on USB attach, if USB is in use
+	if(NVIC->ISER[USBD_IRQn >> 5] & (1UL << (USBD_IRQn & 0x1F))) {
+		USBD->INTEN |= USBD_INTEN_WKEN_Msk;
+	}
+
+	CLK_PowerDown();
+
+	// CLK_PowerDown leaves deep sleep selected,
+	// but the next WFI must be a plain sleep
+	SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+
+	SYS_LockReg();
+}
+
+void Idle_Sleep() {
+	uint64_t start;
+	uint32_t nextExpiry;
+	uint8_t isAtomizerSuspended;
+
+	__set_PRIMASK(1);
+
+	nextExpiry = TimerWheel_GetNextExpiry();
+	if(nextExpiry == 0) {
+		// A software timer is due right now
+		__set_PRIMASK(0);
+		return;
+	}
+
+	isAtomizerSuspended = Atomizer_Suspend();
+
+	if(Idle_isPowerDownEnabled && isAtomizerSuspended && nextExpiry == UINT32_MAX &&
+		!Timer_GetRunningMask() && !USBD_IS_ATTACHED()) {
+		Idle_PowerDown();
+		Idle_powerDownCount++;
+	}
+	else {
+		// The atomizer interrupt wakes the core every 40us
+		// anyway, so only hold the tick back when it's paused
+		if(isAtomizerSuspended) {
+			Timer_SuspendTick(nextExpiry < IDLE_MAX_TICKLESS_MS ? nextExpiry : IDLE_MAX_TICKLESS_MS);
+		}
+
+		start = Timer_GetMicros();
+		__WFI();
+		Idle_sleepTime += Timer_GetMicros() - start;
+		Idle_sleepCount++;
+
+		Timer_ResumeTick();
+	}
+
+	if(isAtomizerSuspended) {
+		Atomizer_Resume();
+	}
+
+	// Serve the interrupt that woke us up
+	__set_PRIMASK(0);
+}
+
+void Idle_SetPowerDownEnabled(uint8_t isEnabled) {
+	Idle_isPowerDownEnabled = isEnabled;
+}
+
+void Idle_GetStats(Idle_Stats_t *stats) {
+	uint32_t lock;
+
+	// Enter critical section
+	// Stats are only updated by Idle_Sleep, which runs from the
+	// main loop or deferred work: no need to mask real interrupts
+	lock = Interrupt_Lock(INTERRUPT_PRIO_LOWEST);
+	stats->uptime = Timer_GetMicros();
+	stats->sleepTime = Idle_sleepTime;
+	stats->sleepCount = Idle_sleepCount;
+	stats->powerDownCount = Idle_powerDownCount;
+	Interrupt_Unlock(lock);
+
+	stats->sleepPercent = stats->uptime == 0 ? 0 : stats->sleepTime * 100 / stats->uptime;
+}
+
+uint32_t Idle_GetEstimatedBatteryLife(uint16_t capacity) {
+	Idle_Stats_t stats;
+	uint32_t avgCurrent;
+
+	Idle_GetStats(&stats);
+	if(stats.uptime == 0) {
+		return 0;
+	}
+
+	// Weighted average current, in uA
+	avgCurrent = ((stats.uptime - stats.sleepTime) * IDLE_CURRENT_RUN_UA +
+		stats.sleepTime * IDLE_CURRENT_SLEEP_UA) / stats.uptime;
+
+	// mAh * 1000 / uA = h
+	return capacity * 1000UL / avgCurrent;
+}
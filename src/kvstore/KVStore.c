@@ -0,0 +1,607 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Log-structured key/value store.
+ * Pages are used in ring order. Each page starts with a header:
+ * magic (written last, see Dataflash_AllocPages), sequence number
+ * and stale marker. Records
+ * follow, word-aligned: header word (marker, length, key), value
+ * words (padded with 0xFF) and a check word (hash of the previous
+ * words, written last). Deletions are records with no value.
+ *
+ * The page after the head page is always either erased (the spare)
+ * or stale. When the head page fills up, writing moves to the spare,
+ * and the live records from the page after it (the oldest one) are
+ * copied over. The oldest page is then marked stale, and erased later
+ * by KVStore_Maintain. Since all live records fit in one page, they
+ * always fit in the new head page.
+ *
+ * On init, valid pages are replayed in sequence order to rebuild the
+ * RAM index. A copy interrupted by power loss is resumed, since the
+ * page after the head is still valid.
+ */
+
+#include <M451Series.h>
+#include <KVStore.h>
+#include <Dataflash.h>
+#include <Atomizer.h>
+
+/**
+ * Page magic, also the page owner for Dataflash_AllocPages.
+ */
+#define KVSTORE_PAGE_MAGIC DATAFLASH_OWNER_KVSTORE
+
+/**
+ * Page header word offsets.
+ */
+#define KVSTORE_PAGE_OFFSET_MAGIC 0x0
+#define KVSTORE_PAGE_OFFSET_SEQ   0x4
+#define KVSTORE_PAGE_OFFSET_STALE 0x8
+
+/**
+ * Page header size, in bytes.
+ */
+#define KVSTORE_PAGE_HEADER_SIZE 12
+
+/**
+ * Record marker, in the upper half of the record header word.
+ */
+#define KVSTORE_RECORD_MARKER 0x4B56
+
+/**
+ * Record length for deletions.
+ */
+#define KVSTORE_LEN_DELETED 0xFF
+
+/**
+ * Builds a record header word.
+ */
+#define KVSTORE_RECORD_HEADER(key, len) (((uint32_t) KVSTORE_RECORD_MARKER << 16) | ((len) << 8) | (key))
+
+/**
+ * Gets the record size, in bytes, from its value length.
+ */
+#define KVSTORE_RECORD_SIZE(len) (4 + ((len) == KVSTORE_LEN_DELETED ? 0 : ((len) + 3) & ~3) + 4)
+
+/**
+ * Gets the page index for an address in the store.
+ */
+#define KVSTORE_PAGE_INDEX(addr) (((addr) - KVStore_baseAddr) / FMC_FLASH_PAGE_SIZE)
+
+/**
+ * Gets the address of a page.
+ */
+#define KVSTORE_PAGE_ADDR(page) (KVStore_baseAddr + (page) * FMC_FLASH_PAGE_SIZE)
+
+/**
+ * Reads a word from flash through the memory map.
+ * This needs no ISP command, so reads don't have to own the flash.
+ */
+#define KVSTORE_READ_WORD(addr) (*(volatile uint32_t *) (addr))
+
+/**
+ * Page states.
+ */
+typedef enum {
+	/**< Page is blank. */
+	KVSTORE_PAGE_ERASED,
+	/**< Page holds records. */
+	KVSTORE_PAGE_VALID,
+	/**< Page has to be erased. */
+	KVSTORE_PAGE_STALE
+} KVStore_PageState_t;
+
+/**
+ * Store base address. Zero if not initialized.
+ */
+static uint32_t KVStore_baseAddr;
+
+/**
+ * Number of pages.
+ */
+static uint8_t KVStore_pageCount;
+
+/**
+ * Page states.
+ */
+static KVStore_PageState_t KVStore_pageState[KVSTORE_MAX_PAGE_COUNT];
+
+/**
+ * Page sequence numbers, for valid pages.
+ */
+static uint32_t KVStore_pageSeq[KVSTORE_MAX_PAGE_COUNT];
+
+/**
+ * Index of the page being written to.
+ */
+static uint8_t KVStore_headPage;
+
+/**
+ * Next write address in the head page.
+ */
+static uint32_t KVStore_writeAddr;
+
+/**
+ * Record address for each key. Zero if the key has no record.
+ */
+static uint32_t KVStore_index[KVSTORE_MAX_KEYS];
+
+/**
+ * Value length for each key, KVSTORE_LEN_DELETED if deleted.
+ */
+static uint8_t KVStore_length[KVSTORE_MAX_KEYS];
+
+/**
+ * Updates a record check word with a new word (FNV-1a).
+ * This is an internal function.
+ *
+ * @param hash Check word so far.
+ * @param word Word to add.
+ *
+ * @return Updated check word.
+ */
+static uint32_t KVStore_Hash(uint32_t hash, uint32_t word) {
+	return (hash ^ word) * 16777619UL;
+}
+
+/**
+ * Computes the check word for a record in flash.
+ * An erased word never matches.
+ * This is an internal function.
+ *
+ * @param addr Record address.
+ * @param len  Value length.
+ *
+ * @return Check word.
+ */
+static uint32_t KVStore_ComputeCheck(uint32_t addr, uint8_t len) {
+	uint32_t hash, end;
+
+	hash = 2166136261UL;
+	end = addr + KVSTORE_RECORD_SIZE(len) - 4;
+	for(; addr < end; addr += 4) {
+		hash = KVStore_Hash(hash, KVSTORE_READ_WORD(addr));
+	}
+
+	return hash == 0xFFFFFFFF ? 0 : hash;
+}
+
+/**
+ * Checks whether a page is blank.
+ * This is an internal function.
+ *
+ * @param page Page index.
+ *
+ * @return True if the page is blank.
+ */
+static uint8_t KVStore_IsBlank(uint8_t page) {
+	uint32_t addr, end;
+
+	addr = KVSTORE_PAGE_ADDR(page);
+	end = addr + FMC_FLASH_PAGE_SIZE;
+	for(; addr < end; addr += 4) {
+		if(KVSTORE_READ_WORD(addr) != 0xFFFFFFFF) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Erases a page.
+ * This is an internal function.
+ *
+ * @param page Page index.
+ *
+ * @return True on success, false on failure.
+ */
+static uint8_t KVStore_ErasePage(uint8_t page) {
+	if(!Dataflash_ErasePage(KVSTORE_PAGE_ADDR(page))) {
+		return 0;
+	}
+
+	KVStore_pageState[page] = KVSTORE_PAGE_ERASED;
+	return 1;
+}
+
+/**
+ * Replays the records in a page into the index.
+ * Records that fail the check are skipped.
+ * This is an internal function.
+ *
+ * @param page Page index.
+ *
+ * @return Address after the last record.
+ */
+static uint32_t KVStore_ReplayPage(uint8_t page) {
+	uint32_t addr, end, header;
+	uint8_t key, len;
+
+	addr = KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_HEADER_SIZE;
+	end = KVSTORE_PAGE_ADDR(page) + FMC_FLASH_PAGE_SIZE;
+
+	while(addr < end) {
+		header = KVSTORE_READ_WORD(addr);
+		if(header == 0xFFFFFFFF) {
+			// End of log
+			break;
+		}
+
+		key = header & 0xFF;
+		len = (header >> 8) & 0xFF;
+		if((header >> 16) != KVSTORE_RECORD_MARKER ||
+			(len > KVSTORE_MAX_VALUE_SIZE && len != KVSTORE_LEN_DELETED)) {
+			// Torn header word, skip it
+			addr += 4;
+			continue;
+		}
+
+		if(addr + KVSTORE_RECORD_SIZE(len) > end) {
+			// Can't be a complete record
+			return end;
+		}
+
+		if(key < KVSTORE_MAX_KEYS &&
+			KVSTORE_READ_WORD(addr + KVSTORE_RECORD_SIZE(len) - 4) == KVStore_ComputeCheck(addr, len)) {
+			KVStore_index[key] = addr;
+			KVStore_length[key] = len;
+		}
+
+		addr += KVSTORE_RECORD_SIZE(len);
+	}
+
+	return addr;
+}
+
+/**
+ * Writes a record at the write address.
+ * There must be room for it in the head page.
+ * This is an internal function.
+ *
+ * @param key   Key.
+ * @param value Value. Ignored for deletions.
+ * @param len   Value length, or KVSTORE_LEN_DELETED.
+ */
+static void KVStore_WriteRecord(uint8_t key, const uint8_t *value, uint8_t len) {
+	uint32_t addr, word, hash;
+	uint8_t i, j;
+
+	addr = KVStore_writeAddr;
+	KVStore_writeAddr += KVSTORE_RECORD_SIZE(len);
+
+	word = KVSTORE_RECORD_HEADER(key, len);
+	Dataflash_Program(addr, word);
+	hash = KVStore_Hash(2166136261UL, word);
+
+	if(len != KVSTORE_LEN_DELETED) {
+		for(i = 0; i < len; i += 4) {
+			word = 0xFFFFFFFF;
+			for(j = 0; j < 4 && i + j < len; j++) {
+				// Little-endian
+				word &= ~(0xFFUL << (j * 8));
+				word |= (uint32_t) value[i + j] << (j * 8);
+			}
+			Dataflash_Program(addr + 4 + i, word);
+			hash = KVStore_Hash(hash, word);
+		}
+	}
+
+	// Commit the record
+	Dataflash_Program(KVStore_writeAddr - 4, hash == 0xFFFFFFFF ? 0 : hash);
+
+	KVStore_index[key] = addr;
+	KVStore_length[key] = len;
+}
+
+/**
+ * Reads a value from flash.
+ * This is an internal function.
+ *
+ * @param addr  Record address.
+ * @param value Buffer to fill.
+ * @param size  Number of bytes to read.
+ */
+static void KVStore_ReadValue(uint32_t addr, uint8_t *value, uint8_t size) {
+	uint32_t word;
+	uint8_t i;
+
+	word = 0;
+	for(i = 0; i < size; i++) {
+		if((i & 3) == 0) {
+			word = KVSTORE_READ_WORD(addr + 4 + i);
+		}
+		// Little-endian
+		value[i] = word >> ((i & 3) * 8);
+	}
+}
+
+/**
+ * Copies the live records from a page to the head page,
+ * and marks the page as stale.
+ * This is an internal function.
+ *
+ * @param page Page index.
+ */
+static void KVStore_Collect(uint8_t page) {
+	uint8_t value[KVSTORE_MAX_VALUE_SIZE];
+	uint8_t key;
+
+	for(key = 0; key < KVSTORE_MAX_KEYS; key++) {
+		if(KVStore_index[key] == 0 || KVSTORE_PAGE_INDEX(KVStore_index[key]) != page) {
+			continue;
+		}
+
+		if(KVStore_length[key] == KVSTORE_LEN_DELETED) {
+			// This is the oldest page, nothing left to shadow
+			KVStore_index[key] = 0;
+		}
+		else {
+			KVStore_ReadValue(KVStore_index[key], value, KVStore_length[key]);
+			KVStore_WriteRecord(key, value, KVStore_length[key]);
+		}
+	}
+
+	Dataflash_Program(KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_OFFSET_STALE, 0);
+	KVStore_pageState[page] = KVSTORE_PAGE_STALE;
+}
+
+/**
+ * Starts writing to a new page.
+ * This is an internal function.
+ *
+ * @param page Page index. Must be erased.
+ * @param seq  Page sequence number.
+ */
+static void KVStore_OpenPage(uint8_t page, uint32_t seq) {
+	Dataflash_Program(KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_OFFSET_SEQ, seq);
+	Dataflash_Program(KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_OFFSET_MAGIC, KVSTORE_PAGE_MAGIC);
+
+	KVStore_pageState[page] = KVSTORE_PAGE_VALID;
+	KVStore_pageSeq[page] = seq;
+	KVStore_headPage = page;
+	KVStore_writeAddr = KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_HEADER_SIZE;
+}
+
+/**
+ * Moves writing to the spare page, and collects the oldest page.
+ * This is an internal function.
+ *
+ * @return True on success, false if the spare page couldn't be erased.
+ */
+static uint8_t KVStore_Advance() {
+	uint8_t next, oldest;
+
+	next = (KVStore_headPage + 1) % KVStore_pageCount;
+	if(KVStore_pageState[next] != KVSTORE_PAGE_ERASED) {
+		// KVStore_Maintain wasn't called in time
+		if(Atomizer_IsOn() || !KVStore_ErasePage(next)) {
+			return 0;
+		}
+	}
+
+	KVStore_OpenPage(next, KVStore_pageSeq[KVStore_headPage] + 1);
+
+	oldest = (next + 1) % KVStore_pageCount;
+	if(KVStore_pageState[oldest] == KVSTORE_PAGE_VALID) {
+		KVStore_Collect(oldest);
+	}
+
+	return 1;
+}
+
+/**
+ * Appends a record, moving to the next page if needed.
+ * This is an internal function.
+ *
+ * @param key   Key.
+ * @param value Value. Ignored for deletions.
+ * @param len   Value length, or KVSTORE_LEN_DELETED.
+ *
+ * @return True on success, false on failure.
+ */
+static uint8_t KVStore_Append(uint8_t key, const uint8_t *value, uint8_t len) {
+	uint8_t ok;
+
+	if(!Dataflash_BeginWrite()) {
+		// Another context is writing flash
+		return 0;
+	}
+
+	ok = 1;
+
+	if(KVStore_writeAddr + KVSTORE_RECORD_SIZE(len) >
+		KVSTORE_PAGE_ADDR(KVStore_headPage) + FMC_FLASH_PAGE_SIZE) {
+		ok = KVStore_Advance();
+	}
+
+	if(ok) {
+		KVStore_WriteRecord(key, value, len);
+	}
+
+	Dataflash_EndWrite();
+
+	return ok;
+}
+
+uint8_t KVStore_Init(uint8_t pageCount) {
+	uint32_t baseAddr, magic, seq;
+	uint8_t i, page, head, next, replayed;
+
+	if(pageCount < 2 || pageCount > KVSTORE_MAX_PAGE_COUNT) {
+		return 0;
+	}
+
+	baseAddr = Dataflash_AllocPages(pageCount, KVSTORE_PAGE_MAGIC);
+	if(baseAddr == 0) {
+		return 0;
+	}
+
+	if(!Dataflash_BeginWrite()) {
+		return 0;
+	}
+
+	KVStore_baseAddr = baseAddr;
+	KVStore_pageCount = pageCount;
+	for(i = 0; i < KVSTORE_MAX_KEYS; i++) {
+		KVStore_index[i] = 0;
+	}
+
+	// Classify pages
+	head = 0xFF;
+	for(page = 0; page < pageCount; page++) {
+		magic = KVSTORE_READ_WORD(KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_OFFSET_MAGIC);
+		if(magic == KVSTORE_PAGE_MAGIC &&
+			KVSTORE_READ_WORD(KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_OFFSET_STALE) == 0xFFFFFFFF) {
+			KVStore_pageState[page] = KVSTORE_PAGE_VALID;
+			KVStore_pageSeq[page] = KVSTORE_READ_WORD(KVSTORE_PAGE_ADDR(page) + KVSTORE_PAGE_OFFSET_SEQ);
+			if(head == 0xFF || KVStore_pageSeq[page] > KVStore_pageSeq[head]) {
+				head = page;
+			}
+		}
+		else if(KVStore_IsBlank(page)) {
+			KVStore_pageState[page] = KVSTORE_PAGE_ERASED;
+		}
+		else {
+			// Marked stale, or torn by power loss
+			KVStore_pageState[page] = KVSTORE_PAGE_STALE;
+		}
+	}
+
+	if(head == 0xFF) {
+		// Empty store, start from the first page
+		if(KVStore_pageState[0] != KVSTORE_PAGE_ERASED && !KVStore_ErasePage(0)) {
+			KVStore_baseAddr = 0;
+			Dataflash_EndWrite();
+			return 0;
+		}
+		KVStore_OpenPage(0, 0);
+		Dataflash_EndWrite();
+		return 1;
+	}
+
+	// Replay valid pages, oldest first
+	seq = 0;
+	replayed = 0;
+	do {
+		page = head;
+		for(i = 0; i < pageCount; i++) {
+			if(KVStore_pageState[i] == KVSTORE_PAGE_VALID &&
+				(!replayed || KVStore_pageSeq[i] > seq) && KVStore_pageSeq[i] < KVStore_pageSeq[page]) {
+				page = i;
+			}
+		}
+		seq = KVStore_pageSeq[page];
+		replayed = 1;
+		KVStore_writeAddr = KVStore_ReplayPage(page);
+	} while(page != head);
+
+	KVStore_headPage = head;
+
+	// The page after the head must not be valid: if it is,
+	// collecting it was interrupted by power loss
+	next = (head + 1) % pageCount;
+	if(KVStore_pageState[next] == KVSTORE_PAGE_VALID) {
+		KVStore_Collect(next);
+	}
+
+	Dataflash_EndWrite();
+	return 1;
+}
+
+int8_t KVStore_Get(uint8_t key, void *value, uint8_t size) {
+	uint8_t len;
+
+	if(KVStore_baseAddr == 0 || key >= KVSTORE_MAX_KEYS ||
+		KVStore_index[key] == 0 || KVStore_length[key] == KVSTORE_LEN_DELETED) {
+		return -1;
+	}
+
+	len = KVStore_length[key];
+	KVStore_ReadValue(KVStore_index[key], value, size < len ? size : len);
+
+	return len;
+}
+
+uint8_t KVStore_Set(uint8_t key, const void *value, uint8_t size) {
+	uint8_t current[KVSTORE_MAX_VALUE_SIZE];
+	uint8_t i;
+
+	if(KVStore_baseAddr == 0 || key >= KVSTORE_MAX_KEYS || size > KVSTORE_MAX_VALUE_SIZE) {
+		return 0;
+	}
+
+	// Save flash wear if the value didn't change
+	if(KVStore_Get(key, current, size) == size) {
+		for(i = 0; i < size && current[i] == ((const uint8_t *) value)[i]; i++);
+		if(i == size) {
+			return 1;
+		}
+	}
+
+	return KVStore_Append(key, value, size);
+}
+
+uint8_t KVStore_Delete(uint8_t key) {
+	if(KVStore_baseAddr == 0 || key >= KVSTORE_MAX_KEYS) {
+		return 0;
+	}
+
+	if(KVStore_index[key] == 0 || KVStore_length[key] == KVSTORE_LEN_DELETED) {
+		// Nothing to delete
+		return 1;
+	}
+
+	return KVStore_Append(key, NULL, KVSTORE_LEN_DELETED);
+}
+
+uint8_t KVStore_NeedsMaintenance() {
+	uint8_t page;
+
+	for(page = 0; page < KVStore_pageCount; page++) {
+		if(KVStore_pageState[page] == KVSTORE_PAGE_STALE) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+uint8_t KVStore_Maintain() {
+	uint8_t page;
+
+	if(!KVStore_NeedsMaintenance()) {
+		return 1;
+	}
+
+	if(Atomizer_IsOn() || !Dataflash_BeginWrite()) {
+		return 0;
+	}
+
+	for(page = 0; page < KVStore_pageCount; page++) {
+		if(KVStore_pageState[page] == KVSTORE_PAGE_STALE) {
+			KVStore_ErasePage(page);
+		}
+	}
+	Dataflash_EndWrite();
+
+	return !KVStore_NeedsMaintenance();
+}
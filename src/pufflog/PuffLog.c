@@ -0,0 +1,631 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Puff log.
+ * Each page starts with a header: magic (written last, see
+ * Dataflash_AllocPages), sequence number, boot number and time since
+ * boot. Records follow as a byte
+ * stream. A record is a tag byte (type, error code) and, for puffs,
+ * varints: time delta (s), duration (100ms), energy (J), resistance
+ * delta (mOhm, zigzag) and board temperature delta (°C, zigzag).
+ * Deltas are taken from the previous record in the same page, and
+ * from the page header (resistance and temperature from zero) for
+ * the first one, so that every page can be decoded on its own.
+ * A boot record bumps the boot number and resets the time.
+ *
+ * Flash is programmed a word at a time. When the buffer is flushed
+ * with a partial word, the word is padded with 0xFF: the decoder
+ * skips a 0xFF tag to the next word, or stops if it's word-aligned.
+ *
+ * The buffer lives in a .noinit section, with its flash address and
+ * length packed in a single word, so that it is consistent at any
+ * point. Records buffered before a reset are written on the next
+ * init. Words programmed just before the reset are found by scanning
+ * the flash, and dropped from the buffer.
+ */
+
+#include <M451Series.h>
+#include <PuffLog.h>
+#include <Dataflash.h>
+#include <TimerUtils.h>
+#include <Atomizer.h>
+
+/**
+ * Page magic, also the page owner for Dataflash_AllocPages.
+ */
+#define PUFFLOG_PAGE_MAGIC DATAFLASH_OWNER_PUFFLOG
+
+/**
+ * Page header word offsets.
+ */
+#define PUFFLOG_PAGE_OFFSET_MAGIC 0x0
+#define PUFFLOG_PAGE_OFFSET_SEQ   0x4
+#define PUFFLOG_PAGE_OFFSET_BOOT  0x8
+#define PUFFLOG_PAGE_OFFSET_TIME  0xC
+
+/**
+ * Page header size, in bytes.
+ */
+#define PUFFLOG_PAGE_HEADER_SIZE 16
+
+/**
+ * Record types, in the low 2 bits of the tag.
+ */
+#define PUFFLOG_TYPE_PUFF 1
+#define PUFFLOG_TYPE_BOOT 2
+
+/**
+ * Buffer magic, "PLGB". Marks a buffer set up by PuffLog_Init.
+ */
+#define PUFFLOG_RAM_MAGIC 0x42474C50
+
+/**
+ * Packs a flash address (word-aligned) and a buffer length
+ * into a buffer position, see PuffLog_Ram_t.
+ */
+#define PUFFLOG_POS(addr, len) ((addr) | (uint32_t) (len) << 24)
+
+/**
+ * Gets the flash address from a buffer position.
+ */
+#define PUFFLOG_POS_ADDR(pos) ((pos) & 0xFFFFFF)
+
+/**
+ * Gets the buffer length from a buffer position.
+ */
+#define PUFFLOG_POS_LEN(pos) ((pos) >> 24)
+
+/**
+ * Maximum encoded record size, in bytes.
+ */
+#define PUFFLOG_MAX_RECORD_SIZE 20
+
+/**
+ * Gets the address of a page.
+ */
+#define PUFFLOG_PAGE_ADDR(page) (PuffLog_baseAddr + (page) * FMC_FLASH_PAGE_SIZE)
+
+/**
+ * Reads from flash through the memory map.
+ */
+#define PUFFLOG_READ_BYTE(addr) (*(volatile uint8_t *) (addr))
+#define PUFFLOG_READ_WORD(addr) (*(volatile uint32_t *) (addr))
+
+/**
+ * Checks whether a page holds a valid log page.
+ */
+#define PUFFLOG_IS_VALID(page) (PUFFLOG_READ_WORD(PUFFLOG_PAGE_ADDR(page) + PUFFLOG_PAGE_OFFSET_MAGIC) == PUFFLOG_PAGE_MAGIC)
+
+/**
+ * Log base address. Zero if not initialized.
+ */
+static uint32_t PuffLog_baseAddr;
+
+/**
+ * Number of pages.
+ */
+static uint8_t PuffLog_pageCount;
+
+/**
+ * Index of the page being written to.
+ */
+static uint8_t PuffLog_headPage;
+
+/**
+ * Write buffer.
+ * This is an internal structure.
+ */
+typedef struct {
+	/**< Buffer magic, see PUFFLOG_RAM_MAGIC. */
+	uint32_t magic;
+	/**< Flash address for the first buffered byte (word-aligned)
+	     and number of buffered bytes, see PUFFLOG_POS. */
+	volatile uint32_t pos;
+	/**< Records waiting to be written. */
+	uint8_t buffer[PUFFLOG_BUFFER_SIZE];
+} PuffLog_Ram_t;
+
+/**
+ * Write buffer. Lives in a .noinit section, so that
+ * buffered records survive a reset.
+ */
+static PuffLog_Ram_t PuffLog_ram __attribute((section(".noinit")));
+
+/**
+ * Encoder state, as of the last buffered record.
+ */
+static PuffLog_Entry_t PuffLog_state;
+
+/**
+ * Encodes an unsigned varint.
+ * This is an internal function.
+ *
+ * @param buf   Buffer to encode into.
+ * @param value Value to encode.
+ *
+ * @return Number of bytes written.
+ */
+static uint8_t PuffLog_PutVarint(uint8_t *buf, uint32_t value) {
+	uint8_t len = 0;
+
+	while(value >= 0x80) {
+		buf[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+
+	return len;
+}
+
+/**
+ * Decodes an unsigned varint.
+ * This is an internal function.
+ *
+ * @param addr Flash address, advanced past the varint.
+ *             Set to 0 if the varint is longer than 5 bytes or
+ *             runs past the end, and left at 0 if already 0.
+ * @param end  Address after the last readable byte.
+ *
+ * @return Decoded value.
+ */
+static uint32_t PuffLog_GetVarint(uint32_t *addr, uint32_t end) {
+	uint32_t value;
+	uint8_t byte, shift;
+
+	value = 0;
+	shift = 0;
+	do {
+		if(*addr == 0 || *addr >= end || shift >= 35) {
+			// Torn or corrupted record
+			*addr = 0;
+			return 0;
+		}
+		byte = PUFFLOG_READ_BYTE((*addr)++);
+		value |= (uint32_t) (byte & 0x7F) << shift;
+		shift += 7;
+	} while(byte & 0x80);
+
+	return value;
+}
+
+/**
+ * Zigzag-encodes a signed delta, so that small magnitudes
+ * give small varints.
+ */
+#define PUFFLOG_ZIGZAG(x) (((uint32_t) (x) << 1) ^ (uint32_t) ((int32_t) (x) >> 31))
+
+/**
+ * Decodes a zigzag-encoded delta.
+ */
+#define PUFFLOG_UNZIGZAG(x) ((int32_t) ((x) >> 1) ^ -(int32_t) ((x) & 1))
+
+/**
+ * Encodes a record, and updates the encoder state.
+ * This is an internal function.
+ *
+ * @param buf   Buffer to encode into (PUFFLOG_MAX_RECORD_SIZE bytes).
+ * @param type  Record type.
+ * @param entry Puff, for PUFFLOG_TYPE_PUFF.
+ *
+ * @return Number of bytes written.
+ */
+static uint8_t PuffLog_Encode(uint8_t *buf, uint8_t type, const PuffLog_Entry_t *entry) {
+	uint8_t len;
+
+	if(type == PUFFLOG_TYPE_BOOT) {
+		buf[0] = PUFFLOG_TYPE_BOOT;
+		PuffLog_state.boot++;
+		PuffLog_state.time = 0;
+		return 1;
+	}
+
+	len = 0;
+	buf[len++] = PUFFLOG_TYPE_PUFF | (entry->error & 0x7) << 2;
+	len += PuffLog_PutVarint(buf + len, entry->time - PuffLog_state.time);
+	len += PuffLog_PutVarint(buf + len, (entry->duration + 50) / 100);
+	len += PuffLog_PutVarint(buf + len, entry->energy);
+	len += PuffLog_PutVarint(buf + len, PUFFLOG_ZIGZAG((int32_t) entry->resistance - PuffLog_state.resistance));
+	len += PuffLog_PutVarint(buf + len, PUFFLOG_ZIGZAG((int32_t) entry->boardTemp - PuffLog_state.boardTemp));
+
+	PuffLog_state.time = entry->time;
+	PuffLog_state.resistance = entry->resistance;
+	PuffLog_state.boardTemp = entry->boardTemp;
+
+	return len;
+}
+
+/**
+ * Decodes the next record in a page.
+ * This is an internal function.
+ *
+ * @param addr  Record address, advanced past the record.
+ *              Set to 0 at the end of the page.
+ * @param state Decoder state. Filled with the puff for
+ *              PUFFLOG_TYPE_PUFF records.
+ *
+ * @return Record type, or 0 at the end of the page.
+ */
+static uint8_t PuffLog_Decode(uint32_t *addr, PuffLog_Entry_t *state) {
+	uint32_t end, delta;
+	uint8_t tag;
+
+	end = (*addr & ~(FMC_FLASH_PAGE_SIZE - 1)) + FMC_FLASH_PAGE_SIZE;
+
+	while(*addr < end) {
+		tag = PUFFLOG_READ_BYTE(*addr);
+		if(tag != 0xFF) {
+			break;
+		}
+		if((*addr & 0x3) == 0) {
+			// Erased: end of log
+			*addr = 0;
+			return 0;
+		}
+		// Padding up to the next word
+		*addr = (*addr | 0x3) + 1;
+	}
+
+	if(*addr >= end) {
+		*addr = 0;
+		return 0;
+	}
+
+	(*addr)++;
+	switch(tag & 0x3) {
+		case PUFFLOG_TYPE_BOOT:
+			state->boot++;
+			state->time = 0;
+			return PUFFLOG_TYPE_BOOT;
+		case PUFFLOG_TYPE_PUFF:
+			state->error = (tag >> 2) & 0x7;
+			state->time += PuffLog_GetVarint(addr, end);
+			state->duration = PuffLog_GetVarint(addr, end) * 100;
+			state->energy = PuffLog_GetVarint(addr, end);
+			// PUFFLOG_UNZIGZAG evaluates its argument twice
+			delta = PuffLog_GetVarint(addr, end);
+			state->resistance += PUFFLOG_UNZIGZAG(delta);
+			delta = PuffLog_GetVarint(addr, end);
+			state->boardTemp += PUFFLOG_UNZIGZAG(delta);
+			return *addr == 0 ? 0 : PUFFLOG_TYPE_PUFF;
+		default:
+			// Corrupted, give up on this page
+			*addr = 0;
+			return 0;
+	}
+}
+
+/**
+ * Sets up a decoder state from a page header.
+ * This is an internal function.
+ *
+ * @param page  Page index.
+ * @param state Decoder state to set up.
+ */
+static void PuffLog_LoadHeader(uint8_t page, PuffLog_Entry_t *state) {
+	state->boot = PUFFLOG_READ_WORD(PUFFLOG_PAGE_ADDR(page) + PUFFLOG_PAGE_OFFSET_BOOT);
+	state->time = PUFFLOG_READ_WORD(PUFFLOG_PAGE_ADDR(page) + PUFFLOG_PAGE_OFFSET_TIME);
+	state->resistance = 0;
+	state->boardTemp = 0;
+}
+
+/**
+ * Programs the buffered words to flash.
+ * This is an internal function.
+ *
+ * @param isPartial True to also program the last partial word,
+ *                  padded with 0xFF.
+ *
+ * @return True on success, false if another context is writing flash.
+ */
+static uint8_t PuffLog_WriteBuffer(uint8_t isPartial) {
+	uint32_t addr, word;
+	uint8_t i, len, bufferLen, left;
+
+	addr = PUFFLOG_POS_ADDR(PuffLog_ram.pos);
+	bufferLen = PUFFLOG_POS_LEN(PuffLog_ram.pos);
+	len = isPartial ? (bufferLen + 3) & ~0x3 : bufferLen & ~0x3;
+	if(len == 0) {
+		return 1;
+	}
+
+	if(!Dataflash_BeginWrite()) {
+		return 0;
+	}
+	for(i = bufferLen; i < len; i++) {
+		PuffLog_ram.buffer[i] = 0xFF;
+	}
+	for(i = 0; i < len; i += 4) {
+		// Little-endian
+		word = PuffLog_ram.buffer[i] | PuffLog_ram.buffer[i + 1] << 8 |
+			PuffLog_ram.buffer[i + 2] << 16 | (uint32_t) PuffLog_ram.buffer[i + 3] << 24;
+		Dataflash_Program(addr + i, word);
+	}
+	Dataflash_EndWrite();
+
+	// Keep the leftover bytes. They only overwrite programmed
+	// bytes, so the buffer stays valid until the position moves.
+	left = len > bufferLen ? 0 : bufferLen - len;
+	for(i = 0; i < left; i++) {
+		PuffLog_ram.buffer[i] = PuffLog_ram.buffer[len + i];
+	}
+	PuffLog_ram.pos = PUFFLOG_POS(addr + len, left);
+
+	return 1;
+}
+
+/**
+ * Recovers the records buffered before a reset, and writes them.
+ * This is an internal function.
+ *
+ * @param end Address after the last programmed word in the head page.
+ */
+static void PuffLog_RecoverBuffer(uint32_t end) {
+	uint32_t addr;
+	uint8_t len, drop, i;
+
+	addr = PUFFLOG_POS_ADDR(PuffLog_ram.pos);
+	len = PUFFLOG_POS_LEN(PuffLog_ram.pos);
+
+	if(PuffLog_ram.magic != PUFFLOG_RAM_MAGIC || len > PUFFLOG_BUFFER_SIZE || (addr & 0x3) ||
+		addr < PUFFLOG_PAGE_ADDR(PuffLog_headPage) + PUFFLOG_PAGE_HEADER_SIZE ||
+		end < addr || end > addr + ((len + 3) & ~0x3)) {
+		// Power-on, or the buffer doesn't belong to this page
+		PuffLog_ram.magic = PUFFLOG_RAM_MAGIC;
+		PuffLog_ram.pos = PUFFLOG_POS(end, 0);
+		return;
+	}
+
+	// Drop the bytes that made it to flash
+	drop = end - addr > len ? len : end - addr;
+	for(i = 0; i < len - drop; i++) {
+		PuffLog_ram.buffer[i] = PuffLog_ram.buffer[drop + i];
+	}
+	PuffLog_ram.pos = PUFFLOG_POS(end, len - drop);
+
+	PuffLog_WriteBuffer(1);
+}
+
+/**
+ * Erases the page after the head and starts writing to it.
+ * The buffer must be empty.
+ * This is an internal function.
+ *
+ * @param seq Sequence number for the new page.
+ *
+ * @return True on success, false if another context is writing flash.
+ */
+static uint8_t PuffLog_OpenPage(uint32_t seq) {
+	uint32_t addr;
+	uint8_t page;
+
+	if(!Dataflash_BeginWrite()) {
+		return 0;
+	}
+
+	page = (PuffLog_headPage + 1) % PuffLog_pageCount;
+	addr = PUFFLOG_PAGE_ADDR(page);
+
+	PuffLog_state.resistance = 0;
+	PuffLog_state.boardTemp = 0;
+
+	Dataflash_ErasePage(addr);
+	Dataflash_Program(addr + PUFFLOG_PAGE_OFFSET_SEQ, seq);
+	Dataflash_Program(addr + PUFFLOG_PAGE_OFFSET_BOOT, PuffLog_state.boot);
+	Dataflash_Program(addr + PUFFLOG_PAGE_OFFSET_TIME, PuffLog_state.time);
+	Dataflash_Program(addr + PUFFLOG_PAGE_OFFSET_MAGIC, PUFFLOG_PAGE_MAGIC);
+	Dataflash_EndWrite();
+
+	PuffLog_headPage = page;
+	PuffLog_ram.pos = PUFFLOG_POS(addr + PUFFLOG_PAGE_HEADER_SIZE, 0);
+
+	return 1;
+}
+
+/**
+ * Buffers a record, moving to the next page if needed.
+ * This is an internal function.
+ *
+ * @param type  Record type.
+ * @param entry Puff, for PUFFLOG_TYPE_PUFF.
+ *
+ * @return True on success, false if the record was dropped.
+ */
+static uint8_t PuffLog_Add(uint8_t type, const PuffLog_Entry_t *entry) {
+	PuffLog_Entry_t savedState;
+	uint8_t record[PUFFLOG_MAX_RECORD_SIZE];
+	uint8_t len, bufferLen, i;
+
+	savedState = PuffLog_state;
+	len = PuffLog_Encode(record, type, entry);
+
+	if(PUFFLOG_POS_ADDR(PuffLog_ram.pos) + PUFFLOG_POS_LEN(PuffLog_ram.pos) + len >
+		PUFFLOG_PAGE_ADDR(PuffLog_headPage) + FMC_FLASH_PAGE_SIZE) {
+		// Page is full: close it and re-encode from the new page header
+		PuffLog_state = savedState;
+		if(Atomizer_IsOn() || !PuffLog_WriteBuffer(1) ||
+			!PuffLog_OpenPage(PUFFLOG_READ_WORD(PUFFLOG_PAGE_ADDR(PuffLog_headPage) + PUFFLOG_PAGE_OFFSET_SEQ) + 1)) {
+			return 0;
+		}
+		len = PuffLog_Encode(record, type, entry);
+	}
+	else if(PUFFLOG_POS_LEN(PuffLog_ram.pos) + len > PUFFLOG_BUFFER_SIZE) {
+		if(Atomizer_IsOn() || !PuffLog_WriteBuffer(0)) {
+			PuffLog_state = savedState;
+			return 0;
+		}
+	}
+
+	// Fill the buffer, then publish the new length in one store
+	bufferLen = PUFFLOG_POS_LEN(PuffLog_ram.pos);
+	for(i = 0; i < len; i++) {
+		PuffLog_ram.buffer[bufferLen + i] = record[i];
+	}
+	PuffLog_ram.pos += (uint32_t) len << 24;
+
+	return 1;
+}
+
+uint8_t PuffLog_Init(uint8_t pageCount) {
+	PuffLog_Entry_t state;
+	uint32_t seq, headSeq, addr, end;
+	uint8_t page, head;
+
+	if(pageCount < 2) {
+		return 0;
+	}
+
+	PuffLog_baseAddr = Dataflash_AllocPages(pageCount, PUFFLOG_PAGE_MAGIC);
+	if(PuffLog_baseAddr == 0) {
+		return 0;
+	}
+	PuffLog_pageCount = pageCount;
+
+	// Find the newest page
+	head = 0xFF;
+	headSeq = 0;
+	for(page = 0; page < pageCount; page++) {
+		if(!PUFFLOG_IS_VALID(page)) {
+			continue;
+		}
+		seq = PUFFLOG_READ_WORD(PUFFLOG_PAGE_ADDR(page) + PUFFLOG_PAGE_OFFSET_SEQ);
+		if(head == 0xFF || seq > headSeq) {
+			head = page;
+			headSeq = seq;
+		}
+	}
+
+	if(head == 0xFF) {
+		// Empty log, start from the first page
+		PuffLog_headPage = pageCount - 1;
+		PuffLog_state.boot = 0;
+		PuffLog_state.time = 0;
+		if(!PuffLog_OpenPage(0)) {
+			PuffLog_baseAddr = 0;
+			return 0;
+		}
+		PuffLog_ram.magic = PUFFLOG_RAM_MAGIC;
+	}
+	else {
+		PuffLog_headPage = head;
+
+		// Find the end of the programmed words
+		addr = PUFFLOG_PAGE_ADDR(head) + FMC_FLASH_PAGE_SIZE;
+		while(addr > PUFFLOG_PAGE_ADDR(head) + PUFFLOG_PAGE_HEADER_SIZE && PUFFLOG_READ_WORD(addr - 4) == 0xFFFFFFFF) {
+			addr -= 4;
+		}
+		PuffLog_RecoverBuffer(addr);
+
+		// Replay the head page to get the encoder state back
+		PuffLog_LoadHeader(head, &PuffLog_state);
+		addr = PUFFLOG_PAGE_ADDR(head) + PUFFLOG_PAGE_HEADER_SIZE;
+		end = addr;
+		state = PuffLog_state;
+		while(PuffLog_Decode(&addr, &state)) {
+			end = addr;
+			PuffLog_state = state;
+		}
+
+		// Only padding may follow the last record. Anything else is
+		// a record torn by power loss: appending after it would make
+		// the rest of the page undecodable, so move to a new page.
+		while((end & 0x3) && PUFFLOG_READ_BYTE(end) == 0xFF) {
+			end++;
+		}
+		if(end != PUFFLOG_POS_ADDR(PuffLog_ram.pos) && !PuffLog_OpenPage(headSeq + 1)) {
+			PuffLog_baseAddr = 0;
+			return 0;
+		}
+	}
+
+	return PuffLog_Add(PUFFLOG_TYPE_BOOT, NULL);
+}
+
+uint8_t PuffLog_Append(PuffLog_Entry_t *entry) {
+	if(PuffLog_baseAddr == 0) {
+		return 0;
+	}
+
+	entry->boot = PuffLog_state.boot;
+	entry->time = Timer_GetMillis() / 1000;
+
+	return PuffLog_Add(PUFFLOG_TYPE_PUFF, entry);
+}
+
+void PuffLog_Flush() {
+	if(PuffLog_baseAddr == 0 || Atomizer_IsOn()) {
+		return;
+	}
+
+	PuffLog_WriteBuffer(1);
+}
+
+void PuffLog_Begin(PuffLog_Iterator_t *it) {
+	uint8_t i;
+
+	PuffLog_Flush();
+
+	// Oldest page is the first valid one after the head
+	it->page = PuffLog_headPage;
+	it->pagesLeft = 0;
+	it->addr = 0;
+	if(PuffLog_baseAddr == 0) {
+		return;
+	}
+
+	for(i = 1; i <= PuffLog_pageCount; i++) {
+		it->page = (PuffLog_headPage + i) % PuffLog_pageCount;
+		if(PUFFLOG_IS_VALID(it->page)) {
+			break;
+		}
+	}
+	it->pagesLeft = PuffLog_pageCount - i;
+	it->addr = PUFFLOG_PAGE_ADDR(it->page) + PUFFLOG_PAGE_HEADER_SIZE;
+	PuffLog_LoadHeader(it->page, &it->state);
+}
+
+uint8_t PuffLog_Next(PuffLog_Iterator_t *it, PuffLog_Entry_t *entry) {
+	uint8_t type;
+
+	while(1) {
+		if(it->addr != 0) {
+			type = PuffLog_Decode(&it->addr, &it->state);
+			if(type == PUFFLOG_TYPE_PUFF) {
+				*entry = it->state;
+				return 1;
+			}
+			if(type != 0) {
+				continue;
+			}
+		}
+
+		// Move to the next valid page
+		do {
+			if(it->pagesLeft == 0) {
+				return 0;
+			}
+			it->pagesLeft--;
+			it->page = (it->page + 1) % PuffLog_pageCount;
+		} while(!PUFFLOG_IS_VALID(it->page));
+
+		it->addr = PUFFLOG_PAGE_ADDR(it->page) + PUFFLOG_PAGE_HEADER_SIZE;
+		PuffLog_LoadHeader(it->page, &it->state);
+	}
+}
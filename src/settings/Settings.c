@@ -0,0 +1,250 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * RAM-shadowed settings.
+ * Commits can start from the main loop (Settings_Flush), the deferred
+ * queue (commit timer) and the battery/brown-out interrupts. Only one
+ * runs at a time: the others find the commit flag set and return,
+ * leaving their changes to the running commit, which loops until no
+ * setting is dirty.
+ * Commits from the interrupts can also preempt other flash writers
+ * (puff log, black box, apps). The key/value store refuses to write
+ * then (see Dataflash_BeginWrite): changes are left dirty, and the
+ * commit timer retries shortly, once the writer is done.
+ */
+
+#include <M451Series.h>
+#include <Settings.h>
+#include <TimerWheel.h>
+#include <Interrupt.h>
+
+/**
+ * Delay before retrying a power loss commit, in ms.
+ */
+#define SETTINGS_POWERLOSS_RETRY_DELAY 10
+
+/**
+ * Weak reference, so that the black box is only
+ * linked in if the app uses it.
+ */
+void BlackBox_HandlePowerLoss() __attribute__((weak));
+
+/**
+ * Structure for a registered setting.
+ */
+typedef struct {
+	/**< Setting variable. NULL if not registered. */
+	void *data;
+	/**< Variable size, in bytes. */
+	uint8_t size;
+} Settings_Entry_t;
+
+/**
+ * Registered settings, indexed by key.
+ */
+static Settings_Entry_t Settings_entry[KVSTORE_MAX_KEYS];
+
+/**
+ * Bitmask of changed settings, by key.
+ */
+static volatile uint32_t Settings_dirtyMask;
+
+/**
+ * True while a commit is running.
+ */
+static volatile uint8_t Settings_isCommitting;
+
+/**
+ * Commit timer index. Negative if not initialized.
+ */
+static int8_t Settings_timerIndex = -1;
+
+/**
+ * Statistics.
+ */
+static Settings_Stats_t Settings_stats;
+
+/**
+ * Writes changed settings to the key/value store.
+ * This is an internal function.
+ *
+ * @param isPowerLoss True if power is going away. Old pages
+ *                    aren't erased then.
+ */
+static void Settings_Commit(uint8_t isPowerLoss) {
+	uint32_t lock, dirty;
+	uint8_t key;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(Settings_isCommitting || Settings_timerIndex < 0) {
+		Interrupt_Unlock(lock);
+		return;
+	}
+	Settings_isCommitting = 1;
+	Interrupt_Unlock(lock);
+
+	while(Settings_dirtyMask) {
+		lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+		dirty = Settings_dirtyMask;
+		Settings_dirtyMask = 0;
+		Interrupt_Unlock(lock);
+
+		for(key = 0; key < KVSTORE_MAX_KEYS; key++) {
+			if(!(dirty & (1UL << key))) {
+				continue;
+			}
+
+			if(!KVStore_Set(key, Settings_entry[key].data, Settings_entry[key].size)) {
+				// Retry on next commit
+				lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+				Settings_dirtyMask |= dirty & ~((1UL << key) - 1);
+				Interrupt_Unlock(lock);
+				TimerWheel_RestartTimer(Settings_timerIndex,
+					isPowerLoss ? SETTINGS_POWERLOSS_RETRY_DELAY : SETTINGS_COMMIT_DELAY);
+				Settings_isCommitting = 0;
+				return;
+			}
+			Settings_stats.writeCount++;
+		}
+	}
+
+	if(!isPowerLoss) {
+		KVStore_Maintain();
+	}
+
+	Settings_isCommitting = 0;
+}
+
+/**
+ * Commit timer callback.
+ * Takes parameters as a timer callback.
+ * This is an internal function.
+ */
+static void Settings_CommitCallback(uint32_t unused) {
+	Settings_Commit(0);
+
+	// Brown-out was disabled by its handler. The black
+	// box wants every brown-out, settings only changes.
+	if(BlackBox_HandlePowerLoss || Settings_dirtyMask) {
+		NVIC_EnableIRQ(BOD_IRQn);
+	}
+}
+
+/**
+ * Brown-out interrupt handler.
+ */
+void BOD_IRQHandler() {
+	SYS_CLEAR_BOD_INT_FLAG();
+
+	// Don't fire again until the commit callback has run,
+	// once the supply has had time to recover
+	NVIC_DisableIRQ(BOD_IRQn);
+	TimerWheel_RestartTimer(Settings_timerIndex, SETTINGS_COMMIT_DELAY);
+
+	// The black box only programs flash, so it goes first
+	if(BlackBox_HandlePowerLoss) {
+		BlackBox_HandlePowerLoss();
+	}
+
+	Settings_stats.powerLossCount++;
+	Settings_Commit(1);
+}
+
+uint8_t Settings_Init(uint8_t pageCount) {
+	uint8_t wasLocked;
+
+	if(!KVStore_Init(pageCount)) {
+		return 0;
+	}
+
+	Settings_timerIndex = TimerWheel_CreateTimer(SETTINGS_COMMIT_DELAY, 0, Settings_CommitCallback, 0);
+	if(Settings_timerIndex < 0) {
+		return 0;
+	}
+	TimerWheel_StopTimer(Settings_timerIndex);
+	TimerWheel_SetCallbackDeferred(Settings_timerIndex, 1);
+
+	// Switch brown-out detection to interrupt
+	wasLocked = SYS_IsRegLocked();
+	if(wasLocked) {
+		SYS_UnlockReg();
+	}
+	SYS_EnableBOD(SYS_BODCTL_BOD_INTERRUPT_EN, SYS_BODCTL_BODVL_2_7V);
+	if(wasLocked) {
+		SYS_LockReg();
+	}
+
+	SYS_CLEAR_BOD_INT_FLAG();
+	NVIC_SetPriority(BOD_IRQn, INTERRUPT_PRIO_GPIO);
+	if(BlackBox_HandlePowerLoss) {
+		// The black box wants every brown-out, dirty or not
+		NVIC_EnableIRQ(BOD_IRQn);
+	}
+
+	return 1;
+}
+
+uint8_t Settings_Register(uint8_t key, void *data, uint8_t size) {
+	if(key >= KVSTORE_MAX_KEYS || size > KVSTORE_MAX_VALUE_SIZE) {
+		return 0;
+	}
+
+	Settings_entry[key].data = data;
+	Settings_entry[key].size = size;
+
+	return KVStore_Get(key, data, size) == size;
+}
+
+void Settings_Changed(uint8_t key) {
+	uint32_t lock;
+
+	if(Settings_timerIndex < 0 || key >= KVSTORE_MAX_KEYS || Settings_entry[key].data == NULL) {
+		return;
+	}
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	Settings_dirtyMask |= 1UL << key;
+	Settings_stats.changeCount++;
+	Interrupt_Unlock(lock);
+
+	// Coalesce until things settle down
+	TimerWheel_RestartTimer(Settings_timerIndex, SETTINGS_COMMIT_DELAY);
+	NVIC_EnableIRQ(BOD_IRQn);
+}
+
+void Settings_Flush() {
+	Settings_Commit(0);
+}
+
+void Settings_HandlePowerLoss() {
+	if(Settings_dirtyMask) {
+		Settings_stats.powerLossCount++;
+		Settings_Commit(1);
+	}
+}
+
+void Settings_GetStats(Settings_Stats_t *stats) {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	*stats = Settings_stats;
+	Interrupt_Unlock(lock);
+}
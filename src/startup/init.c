@@ -24,6 +24,8 @@
 #include <Button.h>
 #include <ADC.h>
 #include <Atomizer.h>
+#include <TimerUtils.h>
+#include <Deferred.h>
 
 /**
  * PLL clock: 72MHz.
@@ -84,6 +86,10 @@ void SYS_Init() {
 	// EADC clock: 72Mhz / 8
 	CLK_SetModuleClock(EADC_MODULE, 0, CLK_CLKDIV0_EADC(8));
 	CLK_EnableModuleClock(EADC_MODULE);
+
+	// CRC and PDMA clocks: HCLK
+	CLK_EnableModuleClock(CRC_MODULE);
+	CLK_EnableModuleClock(PDMA_MODULE);
 	
 	// Enable BOD (reset, 2.2V)
 	SYS_EnableBOD(SYS_BODCTL_BOD_RST_EN, SYS_BODCTL_BODVL_2_2V);
@@ -103,6 +109,10 @@ void SYS_Init() {
 	// is unstable.
 	GPIO_SET_DEBOUNCE_TIME(GPIO_DBCTL_DBCLKSRC_LIRC, GPIO_DBCTL_DBCLKSEL_2);
 
+	// Setup deferred work queue and start SDK tick
+	Deferred_Init();
+	Timer_Init();
+
 	// Initialize I/O
 	Display_SetupSPI();
 	Battery_Init();
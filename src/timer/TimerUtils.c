@@ -19,6 +19,54 @@
 
 #include <M451Series.h>
 #include <TimerUtils.h>
+#include <TimerWheel.h>
+#include <Deferred.h>
+#include <Interrupt.h>
+
+/**
+ * Number of hardware timers handed out by Timer_CreateTimer
+ * and Timer_CreateTimeout. TIMER3 is reserved for the SDK tick.
+ */
+#define TIMER_SLOT_COUNT 3
+
+/**
+ * Hardware timer used for the SDK clock and tick.
+ * It runs in continuous mode at 1MHz: the counter is never
+ * reset, and the compare value is moved forward for every tick.
+ */
+#define TIMER_TICK TIMER3
+
+/**
+ * Prescaler for the SDK clock: 12MHz HXT / 12 = 1MHz.
+ */
+#define TIMER_CLOCK_PRESCALE 12
+
+/**
+ * Mask for the 24-bit hardware counter.
+ */
+#define TIMER_CLOCK_CNT_MASK 0xFFFFFF
+
+/**
+ * SDK tick period, in us.
+ */
+#define TIMER_TICK_PERIOD_US 1000
+
+/**
+ * Minimum distance between the counter and the next compare
+ * value, in us. Closer compare values may be missed.
+ */
+#define TIMER_TICK_MARGIN_US 2
+
+/**
+ * Delays shorter than this (in us) are done with a cycle counter
+ * spin, since the sleep setup overhead would dominate.
+ */
+#define TIMER_DELAY_SPIN_US 10
+
+/**
+ * Alarm value when no alarm is set.
+ */
+#define TIMER_ALARM_NONE UINT64_MAX
 
 /**
  * Structure for holding timeout status.
@@ -34,35 +82,72 @@ typedef struct {
  * Timer callback pointers.
  * NULL when the timer is unused.
  */
-static volatile Timer_Callback_t Timer_callbackPtr[4];
+static volatile Timer_Callback_t Timer_callbackPtr[TIMER_SLOT_COUNT];
 
 /**
  * Timer callback user-defined data.
  */
-static volatile uint32_t Timer_callbackData[4];
+static volatile uint32_t Timer_callbackData[TIMER_SLOT_COUNT];
 
 /**
  * Timeout status.
  */
-static volatile Timer_TimeoutData_t Timer_timeoutData[4];
+static volatile Timer_TimeoutData_t Timer_timeoutData[TIMER_SLOT_COUNT];
 
 /**
  * Timer information flags.
- * Bits 0-3 are assigned to timers 0-3.
+ * Bits 0-2 are assigned to timers 0-2.
  * If a bit is 1, the corresponding timer is a timeout.
- * Bits 4-7 are unused.
+ * Bits 3-7 are unused.
  */
 static volatile uint8_t Timer_info;
 
+/**
+ * Deferred delivery flags.
+ * Bits 0-2 are assigned to timers 0-2.
+ * If a bit is 1, the callback for the corresponding timer
+ * is posted to the deferred work queue.
+ */
+static volatile uint8_t Timer_deferred;
+
 /**
  * Lookup table for timer pointers.
  */
-static TIMER_T * const Timer_TimerPtr[] = {TIMER0, TIMER1, TIMER2, TIMER3};
+static TIMER_T * const Timer_TimerPtr[] = {TIMER0, TIMER1, TIMER2};
 
 /**
  * Lookup table for timer IRQ numbers.
  */
-static const IRQn_Type Timer_IrqNum[] = {TMR0_IRQn, TMR1_IRQn, TMR2_IRQn, TMR3_IRQn};
+static const IRQn_Type Timer_IrqNum[] = {TMR0_IRQn, TMR1_IRQn, TMR2_IRQn};
+
+/**
+ * Uptime in us, as of the last counter read.
+ */
+static volatile uint64_t Timer_clockMicros;
+
+/**
+ * Hardware counter value at the last read.
+ */
+static volatile uint32_t Timer_clockLastCnt;
+
+/**
+ * Uptime of the next SDK tick, in us.
+ * Only written by the tick interrupt handler.
+ */
+static uint64_t Timer_tickNext;
+
+/**
+ * While ticks are suspended, uptime until which the tick
+ * compare is held back, in us. 0 when ticks are running.
+ */
+static volatile uint64_t Timer_tickHold;
+
+/**
+ * Uptime at which a delay ends, in us.
+ * The tick timer compare is pulled in to wake the core from
+ * WFI at this time. TIMER_ALARM_NONE if no delay is running.
+ */
+static volatile uint64_t Timer_alarm = TIMER_ALARM_NONE;
 
 /**
  * Convenience macro to define timer IRQ handlers.
@@ -74,11 +159,26 @@ static const IRQn_Type Timer_IrqNum[] = {TMR0_IRQn, TMR1_IRQn, TMR2_IRQn, TMR3_I
 			Timer_HandleTimeoutTick(n); \
 		} \
 		else { \
-			Timer_callbackPtr[n](Timer_callbackData[n]); \
+			Timer_InvokeCallback(n); \
 		} \
 	} \
 }
 
+/**
+ * Invokes a timer callback, either directly or deferred.
+ * This is an internal function.
+ *
+ * @param timerIndex Timer index.
+ */
+static void Timer_InvokeCallback(uint8_t timerIndex) {
+	if(Timer_deferred & (1 << timerIndex)) {
+		Deferred_Post(Timer_callbackPtr[timerIndex], Timer_callbackData[timerIndex]);
+	}
+	else {
+		Timer_callbackPtr[timerIndex](Timer_callbackData[timerIndex]);
+	}
+}
+
 /**
  * Handles a timeout tick.
  * This is an internal function.
@@ -90,14 +190,143 @@ static void Timer_HandleTimeoutTick(uint8_t timerIndex) {
 
 	if(Timer_timeoutData[timerIndex].tickCounter >= Timer_timeoutData[timerIndex].tickTarget) {
 		Timer_timeoutData[timerIndex].tickCounter = 0;
-		Timer_callbackPtr[timerIndex](Timer_callbackData[timerIndex]);
+		Timer_InvokeCallback(timerIndex);
 	}
 }
 
 TIMER_DEFINE_IRQ_HANDLER(0);
 TIMER_DEFINE_IRQ_HANDLER(1);
 TIMER_DEFINE_IRQ_HANDLER(2);
-TIMER_DEFINE_IRQ_HANDLER(3);
+
+/**
+ * Sets the hardware compare value for the next SDK tick
+ * or alarm, whichever comes first.
+ * This is an internal function.
+ *
+ * @return Uptime the compare value corresponds to, in us.
+ */
+static uint64_t Timer_ScheduleTick() {
+	uint64_t next;
+	uint32_t cmp;
+
+	next = Timer_tickNext;
+	if(Timer_tickHold > next) {
+		next = Timer_tickHold;
+	}
+	if(Timer_alarm < next) {
+		next = Timer_alarm;
+	}
+
+	// Compare values 0 and 1 are not allowed.
+	// Firing a couple us late is harmless, since
+	// ticks are matched against the clock anyway.
+	cmp = next & TIMER_CLOCK_CNT_MASK;
+	if(cmp < 2) {
+		cmp = 2;
+	}
+	TIMER_SET_CMP_VALUE(TIMER_TICK, cmp);
+
+	return next;
+}
+
+/**
+ * SDK tick interrupt handler.
+ * Advances the clock and drives the software timer wheel.
+ * Being called every ms, it also guarantees that the counter
+ * is read at least once per wrap (16.7s).
+ * It is also pended by software when the alarm changes, so
+ * the interrupt flag may not be set.
+ */
+void TMR3_IRQHandler() {
+	uint64_t next;
+
+	if(TIMER_GetIntFlag(TIMER_TICK) == 1) {
+		TIMER_ClearIntFlag(TIMER_TICK);
+	}
+
+	do {
+		// Catch up on all ticks that are due
+		while((int64_t) (Timer_GetMicros() - Timer_tickNext) >= 0) {
+			Timer_tickNext += TIMER_TICK_PERIOD_US;
+			TimerWheel_Tick();
+		}
+		if(Timer_GetMicros() >= Timer_alarm) {
+			// The waiting core is awake now
+			Timer_alarm = TIMER_ALARM_NONE;
+		}
+		next = Timer_ScheduleTick();
+		// If the counter got too close to (or past) the new
+		// compare value, it would only match after a full wrap
+	} while((int64_t) (next - Timer_GetMicros()) < TIMER_TICK_MARGIN_US);
+}
+
+void Timer_Init() {
+	// Enable the cycle counter for short delays
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	TIMER_TICK->CTL = TIMER_CTL_RSTCNT_Msk;
+	TIMER_TICK->CTL = TIMER_CONTINUOUS_MODE | (TIMER_CLOCK_PRESCALE - 1);
+	Timer_clockMicros = 0;
+	Timer_clockLastCnt = 0;
+	Timer_tickNext = TIMER_TICK_PERIOD_US;
+	Timer_ScheduleTick();
+
+	TIMER_EnableInt(TIMER_TICK);
+	NVIC_SetPriority(TMR3_IRQn, INTERRUPT_PRIO_TICK);
+	NVIC_EnableIRQ(TMR3_IRQn);
+	TIMER_Start(TIMER_TICK);
+}
+
+void Timer_SuspendTick(uint32_t ticks) {
+	uint32_t lock;
+
+	if(ticks < 2) {
+		// Nothing to skip
+		return;
+	}
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	// The last skipped tick is processed on time, together
+	// with all the previous ones
+	Timer_tickHold = Timer_tickNext + (ticks - 1) * (uint64_t) TIMER_TICK_PERIOD_US;
+	Timer_ScheduleTick();
+	Interrupt_Unlock(lock);
+}
+
+void Timer_ResumeTick() {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(Timer_tickHold != 0) {
+		Timer_tickHold = 0;
+		// Catch up and reschedule from the tick handler
+		NVIC_SetPendingIRQ(TMR3_IRQn);
+	}
+	Interrupt_Unlock(lock);
+}
+
+uint64_t Timer_GetMicros() {
+	uint32_t primask, cnt;
+	uint64_t micros;
+
+	// Save and restore PRIMASK, since this can be called from
+	// any context, including with interrupts already disabled
+	primask = __get_PRIMASK();
+	__set_PRIMASK(1);
+	cnt = TIMER_GetCounter(TIMER_TICK) & TIMER_CLOCK_CNT_MASK;
+	Timer_clockMicros += (cnt - Timer_clockLastCnt) & TIMER_CLOCK_CNT_MASK;
+	Timer_clockLastCnt = cnt;
+	micros = Timer_clockMicros;
+	__set_PRIMASK(primask);
+
+	return micros;
+}
+
+uint64_t Timer_GetMillis() {
+	return Timer_GetMicros() / 1000;
+}
 
 /**
  * Finds a slot for a new timer and sets it up.
@@ -115,9 +344,9 @@ static int8_t Timer_AssignSlot(uint32_t freq, uint8_t isPeriodic) {
 	uint8_t i;
 
 	// Find an unused timer
-	for(i = 0; i < 4 && Timer_callbackPtr[i] != NULL; i++);
+	for(i = 0; i < TIMER_SLOT_COUNT && Timer_callbackPtr[i] != NULL; i++);
 
-	if(i == 4) {
+	if(i == TIMER_SLOT_COUNT) {
 		// All timers are in use
 		return -1;
 	}
@@ -125,6 +354,7 @@ static int8_t Timer_AssignSlot(uint32_t freq, uint8_t isPeriodic) {
 	// Set up timer
 	TIMER_Open(Timer_TimerPtr[i], isPeriodic ? TIMER_PERIODIC_MODE : TIMER_ONESHOT_MODE, freq);
 	TIMER_EnableInt(Timer_TimerPtr[i]);
+	NVIC_SetPriority(Timer_IrqNum[i], INTERRUPT_PRIO_TIMER);
 	NVIC_EnableIRQ(Timer_IrqNum[i]);
 
 	return i;
@@ -143,6 +373,7 @@ int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t cal
 	Timer_callbackPtr[timerIndex] = callback;
 	Timer_callbackData[timerIndex] = callbackData;
 	Timer_info &= ~(1 << timerIndex);
+	Timer_deferred &= ~(1 << timerIndex);
 
 	TIMER_Start(Timer_TimerPtr[timerIndex]);
 
@@ -191,6 +422,7 @@ int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_
 	Timer_callbackPtr[timerIndex] = callback;
 	Timer_callbackData[timerIndex] = callbackData;
 	Timer_info |= 1 << timerIndex;
+	Timer_deferred &= ~(1 << timerIndex);
 	Timer_timeoutData[timerIndex].tickCounter = 0;
 	Timer_timeoutData[timerIndex].tickTarget = tickCount;
 
@@ -199,8 +431,69 @@ int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_
 	return timerIndex;
 }
 
+void Timer_SetPriority(int8_t index, uint8_t priority) {
+	if(index < 0 || index >= TIMER_SLOT_COUNT) {
+		// Invalid index
+		return;
+	}
+
+	NVIC_SetPriority(Timer_IrqNum[index], priority);
+}
+
+void Timer_SetCallbackDeferred(int8_t index, uint8_t isDeferred) {
+	uint32_t lock, priority;
+
+	if(index < 0 || index >= TIMER_SLOT_COUNT) {
+		// Invalid index
+		return;
+	}
+
+	// Enter critical section
+	// The timer interrupt reads the flags, mask it at its own priority
+	priority = NVIC_GetPriority(Timer_IrqNum[index]);
+	lock = Interrupt_Lock(priority == 0 ? 1 : priority);
+	if(isDeferred) {
+		Timer_deferred |= 1 << index;
+	}
+	else {
+		Timer_deferred &= ~(1 << index);
+	}
+	Interrupt_Unlock(lock);
+}
+
+void Timer_PauseTimer(int8_t index) {
+	if(index < 0 || index >= TIMER_SLOT_COUNT || Timer_callbackPtr[index] == NULL) {
+		// Invalid index
+		return;
+	}
+
+	TIMER_Stop(Timer_TimerPtr[index]);
+}
+
+void Timer_ResumeTimer(int8_t index) {
+	if(index < 0 || index >= TIMER_SLOT_COUNT || Timer_callbackPtr[index] == NULL) {
+		// Invalid index
+		return;
+	}
+
+	TIMER_Start(Timer_TimerPtr[index]);
+}
+
+uint8_t Timer_GetRunningMask() {
+	uint8_t i, mask;
+
+	mask = 0;
+	for(i = 0; i < TIMER_SLOT_COUNT; i++) {
+		if(Timer_TimerPtr[i]->CTL & TIMER_CTL_CNTEN_Msk) {
+			mask |= 1 << i;
+		}
+	}
+
+	return mask;
+}
+
 void Timer_DeleteTimer(int8_t index) {
-	if(index < 0 || index > 3) {
+	if(index < 0 || index >= TIMER_SLOT_COUNT) {
 		// Invalid index
 		return;
 	}
@@ -211,21 +504,66 @@ void Timer_DeleteTimer(int8_t index) {
 	Timer_callbackPtr[index] = NULL;
 }
 
-void Timer_DelayUs(uint32_t delay) {
-	CLK_SysTickDelay(delay);
+/**
+ * Busy-waits for a short time using the core cycle counter.
+ * This is an internal function.
+ *
+ * @param delay Delay in microseconds.
+ */
+static void Timer_SpinUs(uint32_t delay) {
+	uint32_t start, cycles;
+
+	start = DWT->CYCCNT;
+	cycles = delay * (SystemCoreClock / 1000000);
+	while(DWT->CYCCNT - start < cycles);
 }
 
-void Timer_DelayMs(uint32_t delay) {
-	uint8_t delayRem;
+/**
+ * Sleeps until the clock reaches the given uptime.
+ * The core sleeps with WFI, and interrupts keep being served.
+ * In interrupt handlers, inside Interrupt_Lock or with interrupts
+ * disabled, the tick alarm can't wake the core, so it spins instead.
+ * This is an internal function.
+ *
+ * @param deadline Uptime to wait for, in us.
+ */
+static void Timer_SleepUntil(uint64_t deadline) {
+	uint32_t primask;
 
-	// We do 233000us delays, which is nearly the maximum
-	// Maximizing single delay time increases precision
-	delayRem = delay % 233;
-	delay = delay / 233;
+	primask = __get_PRIMASK();
+	if(__get_IPSR() != 0 || __get_BASEPRI() != 0 || primask) {
+		while(Timer_GetMicros() < deadline);
+		return;
+	}
 
-	while(delay--) {
-		CLK_SysTickDelay(233000);
+	// Arm the alarm and let the tick handler program the compare
+	__set_PRIMASK(1);
+	Timer_alarm = deadline;
+	NVIC_SetPendingIRQ(TMR3_IRQn);
+
+	// Check and sleep with interrupts masked, so that a wakeup
+	// can't slip in between the check and WFI. A pending
+	// interrupt still wakes the core, and is then served.
+	while(Timer_GetMicros() < deadline) {
+		__WFI();
+		__set_PRIMASK(0);
+		__ISB();
+		__set_PRIMASK(1);
 	}
 
-	CLK_SysTickDelay(delayRem * 1000);
+	Timer_alarm = TIMER_ALARM_NONE;
+	__set_PRIMASK(0);
+}
+
+void Timer_DelayUs(uint32_t delay) {
+	if(delay < TIMER_DELAY_SPIN_US) {
+		Timer_SpinUs(delay);
+		return;
+	}
+
+	Timer_SleepUntil(Timer_GetMicros() + delay);
+}
+
+void Timer_DelayMs(uint32_t delay) {
+	Timer_SleepUntil(Timer_GetMicros() + delay * 1000ULL);
 }
@@ -0,0 +1,399 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/**
+ * \file
+ * Hierarchical timer wheel.
+ * There are 4 levels of 32 slots each. Level 0 has a granularity of
+ * one tick, and each next level is 32 times coarser, for a total range
+ * of 2^20 ticks (about 17 minutes). Longer timeouts are parked in the
+ * last level and rescheduled when they get cascaded.
+ * Timers are kept in per-slot doubly linked lists built from indices
+ * into a static pool, so insert and cancel are O(1). Every 32 ticks
+ * the current slot of the next level is cascaded down.
+ * Expiry times are absolute tick counts, compared with wrap-around.
+ * The wheel is guarded at INTERRUPT_PRIO_GPIO, the most urgent priority
+ * its users run at (pin handlers, brown-out), so the atomizer control
+ * loop, ADC and USB are never held back by it.
+ */
+
+#include <M451Series.h>
+#include <TimerWheel.h>
+#include <Deferred.h>
+#include <Interrupt.h>
+
+/**
+ * Number of bits for a level slot index.
+ */
+#define TIMERWHEEL_SLOT_BITS 5
+
+/**
+ * Number of slots per level.
+ */
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+
+/**
+ * Number of levels.
+ */
+#define TIMERWHEEL_LEVELS 4
+
+/**
+ * Largest delta that fits in the wheel, in ticks.
+ */
+#define TIMERWHEEL_MAX_DELTA ((1UL << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+/**
+ * Null index for lists and slots.
+ */
+#define TIMERWHEEL_NIL 0xFF
+
+/**
+ * Entry flags.
+ */
+// Entry is allocated
+#define TIMERWHEEL_FLAG_USED    (1 << 0)
+// Entry is periodic
+#define TIMERWHEEL_FLAG_PERIODIC (1 << 1)
+// Callback is deferred
+#define TIMERWHEEL_FLAG_DEFERRED (1 << 2)
+
+/**
+ * Structure for a software timer.
+ */
+typedef struct {
+	/**< Absolute expiry tick. */
+	uint32_t expiry;
+	/**< Period, in ticks. */
+	uint32_t period;
+	/**< Callback function. */
+	Timer_Callback_t callback;
+	/**< Callback user-defined data. */
+	uint32_t callbackData;
+	/**< Next entry in the slot list. */
+	uint8_t next;
+	/**< Previous entry in the slot list. */
+	uint8_t prev;
+	/**< Slot list the entry is in, TIMERWHEEL_NIL if not scheduled. */
+	uint8_t slot;
+	/**< Entry flags. */
+	uint8_t flags;
+} TimerWheel_Entry_t;
+
+/**
+ * Timer pool.
+ */
+static TimerWheel_Entry_t TimerWheel_pool[TIMERWHEEL_POOL_SIZE];
+
+/**
+ * Slot list heads, TIMERWHEEL_NIL for empty slots.
+ * Level l, slot s is at index l * TIMERWHEEL_SLOTS + s.
+ */
+static uint8_t TimerWheel_head[TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS];
+
+/**
+ * Current tick.
+ */
+static volatile uint32_t TimerWheel_now;
+
+/**
+ * Heads are 0 at startup, but TIMERWHEEL_NIL marks empty lists.
+ * Initialization is done lazily on first use.
+ */
+static uint8_t TimerWheel_isInit;
+
+/**
+ * Initializes the slot lists.
+ * Must be called with interrupts locked at INTERRUPT_PRIO_GPIO.
+ * This is an internal function.
+ */
+static void TimerWheel_LazyInit() {
+	uint16_t i;
+
+	if(TimerWheel_isInit) {
+		return;
+	}
+
+	for(i = 0; i < TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS; i++) {
+		TimerWheel_head[i] = TIMERWHEEL_NIL;
+	}
+	for(i = 0; i < TIMERWHEEL_POOL_SIZE; i++) {
+		TimerWheel_pool[i].slot = TIMERWHEEL_NIL;
+	}
+	TimerWheel_isInit = 1;
+}
+
+/**
+ * Links an entry into the slot matching its expiry.
+ * Must be called with interrupts locked at INTERRUPT_PRIO_GPIO.
+ * This is an internal function.
+ *
+ * @param index Entry index.
+ */
+static void TimerWheel_Link(uint8_t index) {
+	TimerWheel_Entry_t *entry = &TimerWheel_pool[index];
+	uint32_t delta, expiry;
+	uint8_t level, slot;
+
+	expiry = entry->expiry;
+	delta = expiry - TimerWheel_now;
+	if((int32_t) delta < 0) {
+		// Already expired, fire on the current slot
+		delta = 0;
+		expiry = TimerWheel_now;
+	}
+	else if(delta > TIMERWHEEL_MAX_DELTA) {
+		// Too far away, park in the last slot we can reach
+		delta = TIMERWHEEL_MAX_DELTA;
+		expiry = TimerWheel_now + delta;
+	}
+
+	// Find the first level that can hold the delta
+	for(level = 0; level < TIMERWHEEL_LEVELS - 1 &&
+		delta >= (1UL << (TIMERWHEEL_SLOT_BITS * (level + 1))); level++);
+	slot = level * TIMERWHEEL_SLOTS +
+		((expiry >> (TIMERWHEEL_SLOT_BITS * level)) & (TIMERWHEEL_SLOTS - 1));
+
+	// Push at head
+	entry->slot = slot;
+	entry->prev = TIMERWHEEL_NIL;
+	entry->next = TimerWheel_head[slot];
+	if(entry->next != TIMERWHEEL_NIL) {
+		TimerWheel_pool[entry->next].prev = index;
+	}
+	TimerWheel_head[slot] = index;
+}
+
+/**
+ * Unlinks an entry from its slot, if any.
+ * Must be called with interrupts locked at INTERRUPT_PRIO_GPIO.
+ * This is an internal function.
+ *
+ * @param index Entry index.
+ */
+static void TimerWheel_Unlink(uint8_t index) {
+	TimerWheel_Entry_t *entry = &TimerWheel_pool[index];
+
+	if(entry->slot == TIMERWHEEL_NIL) {
+		return;
+	}
+
+	if(entry->prev != TIMERWHEEL_NIL) {
+		TimerWheel_pool[entry->prev].next = entry->next;
+	}
+	else {
+		TimerWheel_head[entry->slot] = entry->next;
+	}
+	if(entry->next != TIMERWHEEL_NIL) {
+		TimerWheel_pool[entry->next].prev = entry->prev;
+	}
+	entry->slot = TIMERWHEEL_NIL;
+}
+
+/**
+ * Moves all entries from a slot to their new slots.
+ * Must be called with interrupts locked at INTERRUPT_PRIO_GPIO.
+ * This is an internal function.
+ *
+ * @param slot Slot index.
+ */
+static void TimerWheel_Cascade(uint8_t slot) {
+	uint8_t index;
+
+	while((index = TimerWheel_head[slot]) != TIMERWHEEL_NIL) {
+		TimerWheel_Unlink(index);
+		TimerWheel_Link(index);
+	}
+}
+
+/**
+ * Checks if a timer index is valid and allocated.
+ * This is an internal function.
+ *
+ * @param index Timer index.
+ *
+ * @return True if the index refers to an allocated timer.
+ */
+static uint8_t TimerWheel_IsValid(int8_t index) {
+	return index >= 0 && index < TIMERWHEEL_POOL_SIZE &&
+		(TimerWheel_pool[index].flags & TIMERWHEEL_FLAG_USED);
+}
+
+int8_t TimerWheel_CreateTimer(uint32_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData) {
+	uint32_t lock;
+	uint8_t i;
+
+	if(timeout == 0) {
+		timeout = 1;
+	}
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	TimerWheel_LazyInit();
+
+	// Find an unused entry
+	for(i = 0; i < TIMERWHEEL_POOL_SIZE && (TimerWheel_pool[i].flags & TIMERWHEEL_FLAG_USED); i++);
+
+	if(i == TIMERWHEEL_POOL_SIZE) {
+		// All timers are in use
+		Interrupt_Unlock(lock);
+		return -1;
+	}
+
+	TimerWheel_pool[i].flags = TIMERWHEEL_FLAG_USED | (isPeriodic ? TIMERWHEEL_FLAG_PERIODIC : 0);
+	TimerWheel_pool[i].callback = callback;
+	TimerWheel_pool[i].callbackData = callbackData;
+	TimerWheel_pool[i].period = timeout;
+	TimerWheel_pool[i].expiry = TimerWheel_now + timeout;
+	TimerWheel_Link(i);
+	Interrupt_Unlock(lock);
+
+	return i;
+}
+
+void TimerWheel_RestartTimer(int8_t index, uint32_t timeout) {
+	uint32_t lock;
+
+	if(timeout == 0) {
+		timeout = 1;
+	}
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(TimerWheel_IsValid(index)) {
+		TimerWheel_Unlink(index);
+		TimerWheel_pool[index].period = timeout;
+		TimerWheel_pool[index].expiry = TimerWheel_now + timeout;
+		TimerWheel_Link(index);
+	}
+	Interrupt_Unlock(lock);
+}
+
+void TimerWheel_SetCallbackDeferred(int8_t index, uint8_t isDeferred) {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(TimerWheel_IsValid(index)) {
+		if(isDeferred) {
+			TimerWheel_pool[index].flags |= TIMERWHEEL_FLAG_DEFERRED;
+		}
+		else {
+			TimerWheel_pool[index].flags &= ~TIMERWHEEL_FLAG_DEFERRED;
+		}
+	}
+	Interrupt_Unlock(lock);
+}
+
+void TimerWheel_StopTimer(int8_t index) {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(TimerWheel_IsValid(index)) {
+		TimerWheel_Unlink(index);
+	}
+	Interrupt_Unlock(lock);
+}
+
+void TimerWheel_DeleteTimer(int8_t index) {
+	uint32_t lock;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	if(TimerWheel_IsValid(index)) {
+		TimerWheel_Unlink(index);
+		TimerWheel_pool[index].flags = 0;
+	}
+	Interrupt_Unlock(lock);
+}
+
+uint32_t TimerWheel_GetNextExpiry() {
+	uint32_t lock, delta, minDelta;
+	uint8_t i;
+
+	// Slots on the higher levels are coarse, so
+	// look at the pool for the exact expiry
+	minDelta = UINT32_MAX;
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	for(i = 0; i < TIMERWHEEL_POOL_SIZE; i++) {
+		if((TimerWheel_pool[i].flags & TIMERWHEEL_FLAG_USED) &&
+			TimerWheel_pool[i].slot != TIMERWHEEL_NIL) {
+			delta = TimerWheel_pool[i].expiry - TimerWheel_now;
+			if((int32_t) delta <= 0) {
+				delta = 0;
+			}
+			if(delta < minDelta) {
+				minDelta = delta;
+			}
+		}
+	}
+	Interrupt_Unlock(lock);
+
+	return minDelta;
+}
+
+void TimerWheel_Tick() {
+	TimerWheel_Entry_t *entry;
+	Timer_Callback_t callback;
+	uint32_t lock, now, callbackData;
+	uint8_t slot, index;
+	int8_t level;
+
+	lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	TimerWheel_LazyInit();
+	now = ++TimerWheel_now;
+
+	// Cascade higher levels whose current slot just came up.
+	// Go top-down, so that entries can fall through several levels.
+	for(level = TIMERWHEEL_LEVELS - 1; level > 0; level--) {
+		if((now & ((1UL << (TIMERWHEEL_SLOT_BITS * level)) - 1)) == 0) {
+			TimerWheel_Cascade(level * TIMERWHEEL_SLOTS +
+				((now >> (TIMERWHEEL_SLOT_BITS * level)) & (TIMERWHEEL_SLOTS - 1)));
+		}
+	}
+
+	// Fire the current level 0 slot.
+	// The list head is re-read after every callback, since
+	// callbacks are allowed to modify timers.
+	slot = now & (TIMERWHEEL_SLOTS - 1);
+	while((index = TimerWheel_head[slot]) != TIMERWHEEL_NIL) {
+		entry = &TimerWheel_pool[index];
+		TimerWheel_Unlink(index);
+
+		if((int32_t) (entry->expiry - now) > 0) {
+			// Still has to wait, cannot end up in this slot again
+			TimerWheel_Link(index);
+			continue;
+		}
+
+		if(entry->flags & TIMERWHEEL_FLAG_PERIODIC) {
+			// Reschedule before calling back, so that
+			// the callback can stop or restart it
+			entry->expiry += entry->period;
+			TimerWheel_Link(index);
+		}
+
+		callback = entry->callback;
+		callbackData = entry->callbackData;
+		if(entry->flags & TIMERWHEEL_FLAG_DEFERRED) {
+			Deferred_Post(callback, callbackData);
+			continue;
+		}
+		Interrupt_Unlock(lock);
+		callback(callbackData);
+		lock = Interrupt_Lock(INTERRUPT_PRIO_GPIO);
+	}
+
+	Interrupt_Unlock(lock);
+}
@@ -27,6 +27,9 @@
 #include <M451Series.h>
 #include <USB_VirtualCOM.h>
 #include <USB.h>
+#include <Event.h>
+#include <Interrupt.h>
+#include <Deferred.h>
 
 /* Endpoints */
 #define USB_VCOM_CTRL_IN_EP  EP0
@@ -337,6 +340,11 @@ static volatile USB_VirtualCOM_RxBuffer_t USB_VirtualCOM_rxBuffer;
  */
 static volatile USB_VirtualCOM_RxCallback_t USB_VirtualCOM_rxCallbackPtr;
 
+/**
+ * True if the RX callback is deferred, false if invoked directly.
+ */
+static volatile uint8_t USB_VirtualCOM_isRxDeferred;
+
 /**
  * True if send mode is asynchronous, false if synchronous.
  */
@@ -474,6 +482,22 @@ static void USB_VirtualCOM_HandleBulkIn() {
 	}
 }
 
+/**
+ * Runs the deferred RX callback.
+ * This is an internal function.
+ *
+ * @param unused Unused.
+ */
+static void USB_VirtualCOM_RxTrampoline(uint32_t unused) {
+	USB_VirtualCOM_RxCallback_t callback;
+
+	// The callback could have been removed in the meantime
+	callback = USB_VirtualCOM_rxCallbackPtr;
+	if(callback != NULL) {
+		callback();
+	}
+}
+
 /**
  * Handler for bulk OUT transfers.
  * This is an internal function.
@@ -487,7 +511,12 @@ static void USB_VirtualCOM_HandleBulkOut() {
 
 	if(USB_VirtualCOM_rxCallbackPtr != NULL && writeSize != 0) {
 		// Invoke callback
-		USB_VirtualCOM_rxCallbackPtr();
+		if(USB_VirtualCOM_isRxDeferred) {
+			Deferred_Post(USB_VirtualCOM_RxTrampoline, 0);
+		}
+		else {
+			USB_VirtualCOM_rxCallbackPtr();
+		}
 	}
 
 	// Ready for next bulk OUT
@@ -513,6 +542,7 @@ static void USB_VirtualCOM_IRQHandler() {
 			// USB unplugged
 			USBD_DISABLE_USB();
 		}
+		Event_Post(EVENT_USB_ATTACH, USBD_IS_ATTACHED() ? 1 : 0);
 	}
 	else if(intSts & USBD_INTSTS_BUS) {
 		if(busState & USBD_STATE_USBRST) {
@@ -665,14 +695,15 @@ static void USB_VirtualCOM_SendSync(const uint8_t *buf, uint32_t size) {
  */
 static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 	USB_VirtualCOM_TxTransfer_t *transfer;
-	uint32_t partialSize;
+	uint32_t partialSize, lock;
 
 	if(size == 0) {
 		return;
 	}
 
 	// Enter critical section
-	__set_PRIMASK(1);
+	// Only USB needs to be masked, the control loop keeps running
+	lock = Interrupt_Lock(INTERRUPT_PRIO_USB);
 
 	partialSize = 0;
 	if(USB_VirtualCOM_bulkInWaiting) {
@@ -686,7 +717,7 @@ static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 
 	if(partialSize != 0 && partialSize < USB_VCOM_BULK_IN_MAX_PKT_SIZE) {
 		// We already transferred the whole packet
-		__set_PRIMASK(0);
+		Interrupt_Unlock(lock);
 		return;
 	}
 
@@ -696,7 +727,7 @@ static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 	// allocated for the bulk IN handler to send the zero packet.
 	transfer = (USB_VirtualCOM_TxTransfer_t *) malloc(sizeof(USB_VirtualCOM_TxTransfer_t) + size);
 	if(transfer == NULL) {
-		__set_PRIMASK(0);
+		Interrupt_Unlock(lock);
 		return;
 	}
 
@@ -718,7 +749,7 @@ static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 	}
 
 	// Exit critical section
-	__set_PRIMASK(0);
+	Interrupt_Unlock(lock);
 }
 
 void USB_VirtualCOM_Init() {
@@ -759,6 +790,7 @@ void USB_VirtualCOM_Init() {
 	USBD_Start();
 
 	// Enable USB interrupt
+	NVIC_SetPriority(USBD_IRQn, INTERRUPT_PRIO_USB);
 	NVIC_EnableIRQ(USBD_IRQn);
 }
 
@@ -780,12 +812,13 @@ uint16_t USB_VirtualCOM_GetAvailableSize() {
 }
 
 uint16_t USB_VirtualCOM_Read(uint8_t *buf, uint16_t size) {
+	uint32_t lock;
 	uint16_t readSize;
 
 	// Read in critical section
-	__set_PRIMASK(1);
+	lock = Interrupt_Lock(INTERRUPT_PRIO_USB);
 	readSize = USB_VirtualCOM_RxBuffer_Read(buf, size);
-	__set_PRIMASK(0);
+	Interrupt_Unlock(lock);
 
 	return readSize;
 }
@@ -795,6 +828,11 @@ void USB_VirtualCOM_SetRxCallback(USB_VirtualCOM_RxCallback_t callbackPtr) {
 	USB_VirtualCOM_rxCallbackPtr = callbackPtr;
 }
 
+void USB_VirtualCOM_SetRxCallbackDeferred(uint8_t isDeferred) {
+	// Atomic
+	USB_VirtualCOM_isRxDeferred = isDeferred;
+}
+
 void USB_VirtualCOM_SetAsyncMode(uint8_t isAsync) {
 	USB_VirtualCOM_isAsync = isAsync;
 }